@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -40,15 +41,27 @@ int read_into_buffer(const int fd, struct buffer * const buffer)
 		buffer->size = BUFFER_MINSIZE;
 	}
 
-	ssize_t r;
-	r = read(fd, buffer->buf + buffer->idx, buffer->size - buffer->idx);
-	buffer->idx += r;
-
-	if ((buffer->idx >= buffer->size) && (buffer->buf[buffer->idx - 1] != '\n')) {
+	/*
+	 * The buffer only needs to grow when a single line doesn't fit in it.
+	 * If it is full of complete lines, they must be taken out before there
+	 * is room to read more.
+	 */
+	if (buffer->idx >= buffer->size) {
+		if (memchr(buffer->buf, '\n', buffer->idx))
+			return 0;
 		if (enlarge_buffer(buffer, buffer->size * 2))
 			return -1;
 	}
 
+	ssize_t r;
+	r = read(fd, buffer->buf + buffer->idx, buffer->size - buffer->idx);
+	if (r < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	if (r == 0)
+		return -1;	/* End of file, i.e. the peer has hung up */
+
+	buffer->idx += r;
+
 	return 0;
 }
 
@@ -75,18 +88,18 @@ int write_buffer_into_fd(const int fd, struct buffer * const buffer)
 	return 0;
 }
 
-int bufprintf(struct buffer * const buffer, char *format, ...)
+int vbufprintf(struct buffer * const buffer, char *format, va_list ap)
 {
 	assert(buffer);
 	size_t size, len;
-	va_list ap;
+	va_list aq;
 
 	do {
 		size = buffer->size - buffer->idx;
-		va_start(ap, format);
-		len = vsnprintf(buffer->buf + buffer->idx, size, format, ap);
-		va_end(ap);
-		if (len >= size && enlarge_buffer(buffer, len + 1))
+		va_copy(aq, ap);
+		len = vsnprintf(buffer->buf + buffer->idx, size, format, aq);
+		va_end(aq);
+		if (len >= size && enlarge_buffer(buffer, buffer->idx + len + 1))
 			return -1;
 	} while (len >= size);
 
@@ -95,6 +108,18 @@ int bufprintf(struct buffer * const buffer, char *format, ...)
 	return 0;
 }
 
+int bufprintf(struct buffer * const buffer, char *format, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, format);
+	r = vbufprintf(buffer, format, ap);
+	va_end(ap);
+
+	return r;
+}
+
 int buffer_terminate_line(struct buffer * const buffer)
 {
 	assert(buffer);
@@ -107,6 +132,42 @@ int buffer_terminate_line(struct buffer * const buffer)
 	return 0;
 }
 
+/*
+ * Removes the first complete line from the buffer. The line is returned in
+ * line as a newly allocated string without the line ending, or NULL if the
+ * buffer does not yet hold a complete line.
+ */
+int buffer_extract_line(struct buffer * const buffer, char **line)
+{
+	assert(buffer);
+	assert(line);
+	char *nl;
+	size_t len;
+
+	*line = NULL;
+
+	if (!buffer->idx)
+		return 0;
+
+	nl = memchr(buffer->buf, '\n', buffer->idx);
+	if (!nl)
+		return 0;
+
+	len = nl - buffer->buf;
+	*line = malloc(len + 1);
+	if (!*line)
+		return -1;
+
+	memcpy(*line, buffer->buf, len);
+	(*line)[len] = '\0';
+	chomp(*line);
+
+	buffer->idx -= len + 1;
+	memmove(buffer->buf, nl + 1, buffer->idx);
+
+	return 0;
+}
+
 void buffer_reset(struct buffer * const buffer)
 {
 	buffer->idx = 0;
@@ -1,6 +1,9 @@
 #ifndef _HAS_BUFFER_H
 #define _HAS_BUFFER_H
 
+#include <stdarg.h>
+#include <stddef.h>
+
 struct buffer {
 	char *buf;
 	size_t idx;
@@ -10,7 +13,9 @@ struct buffer {
 int read_into_buffer(const int fd, struct buffer * const buffer);
 int write_buffer_into_fd(const int fd, struct buffer * const buffer);
 int bufprintf(struct buffer * const buffer, char *format, ...);
+int vbufprintf(struct buffer * const buffer, char *format, va_list ap);
 int buffer_terminate_line(struct buffer * const buffer);
+int buffer_extract_line(struct buffer * const buffer, char **line);
 void buffer_reset(struct buffer *buffer);
 void buffer_init(struct buffer * const buffer);
 void buffer_free(struct buffer * const buffer);
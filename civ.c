@@ -17,7 +17,7 @@
 static int is_border_system(struct system *system, struct civ *c)
 {
 	struct ptrlist neigh;
-	struct list_head *lh;
+	unsigned long lh;
 	struct system *s;
 	int is_border = 0;
 
@@ -38,35 +38,30 @@ static int is_border_system(struct system *system, struct civ *c)
 	return is_border;
 }
 
-#define CIV_GROW_MIN_LY (10 * TICK_PER_LY)
-#define CIV_GROW_STEP_LY (10 * TICK_PER_LY)
+static int is_unowned(void *system, void *data)
+{
+	struct system *s = system;
+
+	return !s->owner;
+}
+
 static int grow_civ(struct universe *u, struct civ *c)
 {
 	struct system *s, *t;
-	struct ptrlist neigh;
-	struct list_head *lh;
-	unsigned long radius;
+	struct ptrlist nearest;
 
 	if (ptrlist_len(&c->border_systems) == 0)
 		return 1;
 
 	t = ptrlist_entry(&c->border_systems, 0);
-	radius = CIV_GROW_MIN_LY;
-
-	do {
-		ptrlist_init(&neigh);
-		s = NULL;
 
-		get_neighbouring_systems(&neigh, t, radius);
-		ptrlist_for_each_entry(s, &neigh, lh) {
-			if (!s->owner)
-				break;
-		}
-		if ((s == NULL) || (s->owner))
-			radius += CIV_GROW_STEP_LY;
+	ptrlist_init(&nearest);
+	get_nearest_systems(&nearest, t, 1, is_unowned, NULL);
+	s = ptrlist_pull(&nearest);
+	ptrlist_free(&nearest);
 
-		ptrlist_free(&neigh);
-	} while ((s == NULL) || (s->owner));
+	if (!s)
+		return 1;
 
 	s->owner = c;
 	linksystems(s, t);
@@ -89,7 +84,7 @@ static void spawn_civilizations(struct universe *u)
 	struct system *s;
 	int success, tries;
 	struct ptrlist neigh;
-	struct list_head *lh;
+	unsigned long lh;
 
 	list_for_each_entry(c, &u->civs, list) {
 		tries = 0;
@@ -252,7 +247,7 @@ err:
 void civ_free(struct civ *civ)
 {
 	char *c;
-	struct list_head *lh;
+	unsigned long lh;
 	ptrlist_free(&civ->systems);
 	ptrlist_free(&civ->border_systems);
 	ptrlist_free(&civ->presystems);
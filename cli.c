@@ -11,7 +11,7 @@ struct cli_data {
 	void *data;
 };
 
-void cli_tree_destroy(struct list_head *root)
+void cli_tree_destroy(struct st_node *root)
 {
 	st_destroy(root, ST_DO_FREE_DATA);
 }
@@ -45,7 +45,7 @@ static char* trim_and_validate(char *string)
 	return string;
 }
 
-int cli_add_cmd(struct list_head *root, char *cmd, int (*func)(void*, char*), void *ptr, char *help)
+int cli_add_cmd(struct st_node *root, char *cmd, int (*func)(void*, char*), void *ptr, char *help)
 {
 	struct cli_data *node;
 
@@ -72,10 +72,9 @@ int cli_add_cmd(struct list_head *root, char *cmd, int (*func)(void*, char*), vo
 /*
  * cli_rm_cmd removes a command from the command tree. It does not, however,
  * remove any tree nodes: this is a feature to keep the number of malloc()/free()s
- * to a sane level, as the cli trees for logged in users are constantly in a
- * state of flux and the nodes will probably be reused very soon.
+ * to a sane level for trees where the nodes will probably be reused very soon.
  */
-int cli_rm_cmd(struct list_head *root, char *cmd)
+int cli_rm_cmd(struct st_node *root, char *cmd)
 {
 	struct st_node *node;
 
@@ -87,7 +86,8 @@ int cli_rm_cmd(struct list_head *root, char *cmd)
 	return 0;
 }
 
-int cli_run_cmd(struct list_head * const root, const char * const string)
+static int run_cmd(const struct st_node * const root, const char * const string,
+		void *data, const int use_data)
 {
 	int r;
 	unsigned int i, len;
@@ -120,7 +120,7 @@ int cli_run_cmd(struct list_head * const root, const char * const string)
 
 	node = st_lookup_string(root, cmd);
 	if (node && node->func)
-		r = node->func(node->data, param);
+		r = node->func(use_data ? data : node->data, param);
 	else
 		r = -1;
 
@@ -128,17 +128,33 @@ int cli_run_cmd(struct list_head * const root, const char * const string)
 	return r;
 }
 
-static void __cli_print_help(FILE *f, struct list_head *root, char *buf, size_t idx, const size_t len)
+/*
+ * Runs a command in a tree which might be shared by several users. The
+ * command function gets data instead of what was given to cli_add_cmd().
+ */
+int cli_run_cmd_on(const struct st_node * const root, const char * const string, void *data)
+{
+	return run_cmd(root, string, data, 1);
+}
+
+int cli_run_cmd(struct st_node * const root, const char * const string)
+{
+	return run_cmd(root, string, NULL, 0);
+}
+
+static void __cli_print_help(FILE *f, const struct st_node *root, char *buf, size_t idx, const size_t len)
 {
-	struct st_node *st;
+	const struct st_node *st;
 	struct cli_data *cli;
+	unsigned int i;
 
 	if (len - idx < 2)
 		return;
 
 	buf[idx + 1] = '\0';
 
-	list_for_each_entry(st, root, list) {
+	for (i = 0; i < root->len; i++) {
+		st = &root->children[i];
 		buf[idx] = st->c;
 		if (st->data) {
 			cli = st->data;
@@ -151,14 +167,15 @@ static void __cli_print_help(FILE *f, struct list_head *root, char *buf, size_t
 		}
 	}
 
-	list_for_each_entry(st, root, list) {
+	for (i = 0; i < root->len; i++) {
+		st = &root->children[i];
 		buf[idx] = st->c;
-		__cli_print_help(f, &st->children, buf, idx + 1, len);
+		__cli_print_help(f, st, buf, idx + 1, len);
 	}
 }
 
 #define MAX_CMD_LEN 64
-void cli_print_help(FILE *f, struct list_head *root)
+void cli_print_help(FILE *f, const struct st_node *root)
 {
 	char buf[MAX_CMD_LEN];
 	memset(buf, 0, sizeof(buf));
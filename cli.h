@@ -2,14 +2,15 @@
 #define _HAS_CLI_H
 
 #include <stdio.h>
-#include "list.h"
+#include "stringtree.h"
 
-void cli_tree_destroy(struct list_head *root);
+void cli_tree_destroy(struct st_node *root);
 
-int cli_add_cmd(struct list_head *root, char *cmd, int (*func)(void*, char*), void *ptr, char *help);
-int cli_rm_cmd(struct list_head *root, char *cmd);
-int cli_run_cmd(struct list_head * const root, const char * const string);
+int cli_add_cmd(struct st_node *root, char *cmd, int (*func)(void*, char*), void *ptr, char *help);
+int cli_rm_cmd(struct st_node *root, char *cmd);
+int cli_run_cmd(struct st_node * const root, const char * const string);
+int cli_run_cmd_on(const struct st_node * const root, const char * const string, void *data);
 
-void cli_print_help(FILE *f, struct list_head *root);
+void cli_print_help(FILE *f, const struct st_node *root);
 
 #endif
@@ -1,7 +1,10 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
 #include "common.h"
 
 const char* greek[GREEK_N] = {
@@ -18,7 +21,7 @@ const char* roman[ROMAN_N] = {
 
 /* upper case letter to corresponding lower case
  * letter, all invalid letters underscores */
-static const char capital_to_lower[256] = {
+const char capital_to_lower[256] = {
 	 95,  95,  95,  95,  95,  95,  95,  95,
 	 95,  95,  95,  95,  95,  95,  95,  95,
 	 95,  95,  95,  95,  95,  95,  95,  95,
@@ -62,7 +65,7 @@ void downcase_valid(char *c)
 	unsigned char *s = (unsigned char*)c;
 	unsigned int i;
 	for (i = 0; s[i] != '\0'; i++)
-		s[i] = capital_to_lower[s[i]];
+		s[i] = DOWNCASE_VALID(s[i]);
 }
 
 /*
@@ -114,3 +117,27 @@ int str_to_long(const char * const str, long *out)
 
 	return 0;
 }
+
+/*
+ * Syncs the directory that file is in, so that a file just created or
+ * renamed there is still there after a crash.
+ */
+int sync_dir_of(const char * const file)
+{
+	char *copy;
+	int fd, r;
+
+	copy = strdup(file);
+	if (!copy)
+		return -1;
+
+	fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+	free(copy);
+	if (fd < 0)
+		return -1;
+
+	r = fsync(fd);
+	close(fd);
+
+	return r;
+}
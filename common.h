@@ -99,12 +99,26 @@ extern const char* roman[ROMAN_N];
 #define MIN(x, y)			\
 	((x < y) ? x : y)
 
+/*
+ * Vectors of longs, for loops over arrays that use the GCC vector extensions
+ * to run several elements at a time no matter how the code is optimized.
+ * LONG_VECTOR_AT() is a vector starting at any long in an array.
+ */
+#define LONG_VECTOR_LEN 2
+typedef long long_vector __attribute__((vector_size(LONG_VECTOR_LEN * sizeof(long))));
+typedef long long_vector_unaligned __attribute__((vector_size(LONG_VECTOR_LEN * sizeof(long)),
+			aligned(sizeof(long))));
+#define LONG_VECTOR_AT(p) (*(long_vector_unaligned*)(p))
+
 /* Misc functions */
 
+extern const char capital_to_lower[256];
+#define DOWNCASE_VALID(c) capital_to_lower[(unsigned char)(c)]
 void downcase_valid(char *c);
 void chomp(char *s);
 int limit_long_to_int(const long l);
 unsigned int limit_long_to_uint(const long l);
 int str_to_long(const char * const str, long *out);
+int sync_dir_of(const char * const file);
 
 #endif
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -32,22 +33,54 @@
 #include "player.h"
 #include "mtrandom.h"
 
+struct send_chunk {
+	struct buffer buf;
+	size_t sent;
+	struct list_head list;
+};
+
 int conn_init(struct connection *conn)
 {
 	assert(conn);
 
 	memset(conn, 0, sizeof(*conn));
-	pthread_mutex_init(&conn->worker_lock, NULL);
+	pthread_mutex_init(&conn->cmd_lock, NULL);
+	pthread_mutex_init(&conn->send_lock, NULL);
 	conn->id = mtrandom_uint(UINT32_MAX);
 	buffer_init(&conn->send);
 	buffer_init(&conn->recv);
 
 	INIT_LIST_HEAD(&conn->list);
 	INIT_LIST_HEAD(&conn->work);
+	INIT_LIST_HEAD(&conn->send_queue);
+	ptrlist_init(&conn->cmds);
+
+	conn->refcount = 1;
 
 	return 0;
 }
 
+static void free_send_queue(struct connection *conn)
+{
+	struct send_chunk *c, *_c;
+
+	list_for_each_entry_safe(c, _c, &conn->send_queue, list) {
+		list_del(&c->list);
+		buffer_free(&c->buf);
+		free(c);
+	}
+
+	conn->send_queued = 0;
+}
+
+static void free_cmds(struct connection *conn)
+{
+	char *line;
+
+	while ((line = ptrlist_pull(&conn->cmds)))
+		free(line);
+}
+
 /*
  * This function needs to be very safe as it can be called on a
  * half-initialized connection structure if something went wrong.
@@ -57,16 +90,38 @@ void connection_free(struct connection *conn)
 	if (!conn)
 		return;
 
-	pthread_mutex_destroy(&conn->worker_lock);
+	pthread_mutex_destroy(&conn->cmd_lock);
+	pthread_mutex_destroy(&conn->send_lock);
 
 	if (conn->peerfd)
 		close(conn->peerfd);
+	free_send_queue(conn);
+	free_cmds(conn);
 	buffer_free(&conn->send);
 	buffer_free(&conn->recv);
 	if (conn->pl)
 		player_free(conn->pl);
 }
 
+void conn_get(struct connection *conn)
+{
+	__sync_add_and_fetch(&conn->refcount, 1);
+}
+
+/*
+ * Drops a reference to the connection. Whoever drops the last reference,
+ * the server loop or a worker, also frees the connection.
+ */
+void conn_put(struct connection *conn)
+{
+	if (__sync_sub_and_fetch(&conn->refcount, 1))
+		return;
+
+	log_printfn(LOG_CONN, "connection %x freed", conn->id);
+	connection_free(conn);
+	free(conn);
+}
+
 void __attribute__((format(printf, 2, 3))) conn_error(struct connection *data, char *format, ...)
 {
 	char msg[128];
@@ -81,60 +136,95 @@ void __attribute__((format(printf, 2, 3))) conn_error(struct connection *data, c
 	server_disconnect_nicely(data);
 }
 
+static struct connection* take_work(struct conn_worker *w, const int steal)
+{
+	struct connection *conn = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (!list_empty(&w->work_items)) {
+		if (steal)
+			conn = list_entry(w->work_items.prev, struct connection, work);
+		else
+			conn = list_first_entry(&w->work_items, struct connection, work);
+		list_del_init(&conn->work);
+		conn->queued_on = NULL;
+		__sync_sub_and_fetch(&w->conn_data->pending, 1);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return conn;
+}
+
+static struct connection* find_work(struct conn_worker *w)
+{
+	struct conn_data *data = w->conn_data;
+	struct connection *conn;
+
+	conn = take_work(w, 0);
+	for (unsigned int i = 1; !conn && i < data->num_workers; i++)
+		conn = take_work(&data->workers[(w->idx + i) % data->num_workers], 1);
+
+	return conn;
+}
+
 #define PROMPT "yastg> "
 void* connection_worker(void *_w)
 {
-	struct conn_worker_list *w = _w;
+	struct conn_worker *w = _w;
 	struct conn_data *data = w->conn_data;
 	struct connection *conn;
+	char *line;
 
 	do {
-		/*
-		 * Remember: The locking here need to be synchronized with
-		 * the locking in disconnect_peer() to avoid nasty races
-		 * in case a connection is terminated when work is about to start.
-		 */
-		pthread_mutex_lock(&data->workers_lock);
-
-		while (list_empty(&data->work_items) && !w->terminate)
-			pthread_cond_wait(&data->workers_cond, &data->workers_lock);
-
-		if (w->terminate) {
-			pthread_mutex_unlock(&data->workers_lock);
+		if (w->terminate)
 			break;
-		}
-
-		conn = list_first_entry(&data->work_items, struct connection, work);
-		list_del_init(&conn->work);
 
 		/*
-		 * This needs to be in this order to avoid a race when
-		 * server_disconnect_cb() is running _now_.
+		 * The reference the work item held on the connection is now ours,
+		 * so the connection stays around even if it is disconnected
+		 * while we are working on it.
 		 */
-		pthread_mutex_lock(&conn->worker_lock);
-		pthread_mutex_unlock(&data->workers_lock);
-
-		if (conn->terminate) {
-			pthread_mutex_unlock(&conn->worker_lock);
+		conn = find_work(w);
+		if (!conn) {
+			/*
+			 * Going idle and conn_do_work() both use full barriers, so
+			 * either we see the new work here or the other thread sees
+			 * us idle and wakes us up.
+			 */
+			pthread_mutex_lock(&data->idle_lock);
+			__sync_add_and_fetch(&data->idle, 1);
+			while (!__sync_fetch_and_add(&data->pending, 0) && !w->terminate)
+				pthread_cond_wait(&data->idle_cond, &data->idle_lock);
+			__sync_sub_and_fetch(&data->idle, 1);
+			pthread_mutex_unlock(&data->idle_lock);
 			continue;
 		}
 
-		if (conn->worker) {
-			pthread_mutex_unlock(&conn->worker_lock);
-			log_printfn(LOG_CONN, "Got new data too fast -- old worker is still busy");
-			continue;
+		pthread_mutex_lock(&conn->cmd_lock);
+		line = ptrlist_pull(&conn->cmds);
+		pthread_mutex_unlock(&conn->cmd_lock);
+
+		if (line && !conn->terminate) {
+			if (line[0] != '\0' && player_run_cmd(conn->pl, line) < 0)
+				conn_send(conn, "Unknown command or syntax error: \"%s\"\n", line);
+			conn_send(conn, PROMPT);
+			conn_flush(conn);
 		}
-		conn->worker = 1;
-		pthread_mutex_unlock(&conn->worker_lock);
+		free(line);
 
-		if (conn->recv.buf[0] != '\0' && cli_run_cmd(&conn->pl->cli, conn->recv.buf) < 0)
-			conn_send(conn, "Unknown command or syntax error: \"%s\"\n", conn->recv.buf);
-		buffer_reset(&conn->recv);
-		conn_send(conn, PROMPT);
+		/*
+		 * Only one worker at a time runs commands for a connection, so
+		 * the connection stays scheduled until its queue is empty. It
+		 * goes to the back of the work queue to be fair to other peers.
+		 */
+		pthread_mutex_lock(&conn->cmd_lock);
+		if (!conn->terminate && ptrlist_len(&conn->cmds))
+			conn_do_work(data, conn);
+		else
+			conn->scheduled = 0;
+		pthread_mutex_unlock(&conn->cmd_lock);
 
-		pthread_mutex_lock(&conn->worker_lock);
-		conn->worker = 0;
-		pthread_mutex_unlock(&conn->worker_lock);
+		conn_put(conn);
 
 	} while(1);
 
@@ -165,129 +255,332 @@ int conn_fulfixinit(struct connection *data)
 	player_go(data->pl, SYSTEM, ptrlist_entry(&univ.systems, 0));
 
 	conn_send(data, PROMPT);
+	conn_flush(data);
 
 	log_printfn(LOG_CONN, "peer %s successfully logged in as %s", data->peer, data->pl->name);
 
 	return 0;
 }
 
+/*
+ * Queues the connection on its own worker, which keeps a connection's
+ * commands on the same thread unless another worker runs out of work.
+ */
 void conn_do_work(struct conn_data *data, struct connection *conn)
 {
-	pthread_mutex_lock(&data->workers_lock);
-	list_add_tail(&conn->work, &data->work_items);
-	pthread_cond_signal(&data->workers_cond);
-	pthread_mutex_unlock(&data->workers_lock);
+	struct conn_worker *w = &data->workers[conn->id % data->num_workers];
+
+	pthread_mutex_lock(&w->lock);
+	if (list_empty(&conn->work)) {
+		conn_get(conn);
+		list_add_tail(&conn->work, &w->work_items);
+		conn->queued_on = w;
+		__sync_add_and_fetch(&data->pending, 1);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	if (__sync_fetch_and_add(&data->idle, 0)) {
+		pthread_mutex_lock(&data->idle_lock);
+		pthread_cond_signal(&data->idle_cond);
+		pthread_mutex_unlock(&data->idle_lock);
+	}
 }
 
-void conn_send_buffer(struct connection * const data)
+/*
+ * Adds a command line to the connection's queue, taking over the line, and
+ * schedules the connection for work unless it already is. Returns the
+ * number of commands queued, or -1 on error.
+ */
+long conn_queue_cmd(struct conn_data *data, struct connection *conn, char *line)
 {
-	assert(data);
-	assert(data->peerfd);
-	if (write_buffer_into_fd(data->peerfd, &data->send)) {
-		log_printfn(LOG_CONN,
-				"send error (connection %x), terminating connection",
-				data->id);
-		server_disconnect_nicely(data);
+	long len;
+
+	pthread_mutex_lock(&conn->cmd_lock);
+
+	if (ptrlist_push(&conn->cmds, line)) {
+		pthread_mutex_unlock(&conn->cmd_lock);
+		return -1;
 	}
+
+	len = ptrlist_len(&conn->cmds);
+	if (!conn->scheduled) {
+		conn->scheduled = 1;
+		conn_do_work(data, conn);
+	}
+
+	pthread_mutex_unlock(&conn->cmd_lock);
+
+	return len;
 }
 
-static int start_new_worker(struct conn_data *data)
+unsigned long conn_cmds_queued(struct connection *conn)
 {
-	struct conn_worker_list *w;
-	sigset_t old, new;
+	unsigned long len;
 
-	sigfillset(&new);
+	pthread_mutex_lock(&conn->cmd_lock);
+	len = ptrlist_len(&conn->cmds);
+	pthread_mutex_unlock(&conn->cmd_lock);
+
+	return len;
+}
+
+/*
+ * Removes any pending work for the connection, dropping the reference
+ * the work item held. Work already being done is left to finish.
+ */
+void conn_cancel_work(struct conn_data *data, struct connection *conn)
+{
+	struct conn_worker *w;
+	int queued = 0;
+
+	/* The connection might be stolen by another worker while we lock */
+	while (!queued && (w = conn->queued_on)) {
+		pthread_mutex_lock(&w->lock);
+		if (conn->queued_on == w) {
+			list_del_init(&conn->work);
+			conn->queued_on = NULL;
+			__sync_sub_and_fetch(&data->pending, 1);
+			queued = 1;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	if (queued)
+		conn_put(conn);
+}
+
+/*
+ * Must be called with conn->send_lock held. Moves everything in the send
+ * buffer to the end of the send queue.
+ */
+static int __queue_send_buffer(struct connection * const conn)
+{
+	struct send_chunk *c;
+
+	if (!conn->send.idx)
+		return 0;
 
-	w = malloc(sizeof(*w));
-	if (!w)
+	c = malloc(sizeof(*c));
+	if (!c)
 		return -1;
-	memset(w, 0, sizeof(*w));
-	w->conn_data = data;
+
+	c->buf = conn->send;
+	c->sent = 0;
+	list_add_tail(&c->list, &conn->send_queue);
+	conn->send_queued += c->buf.idx;
+
+	buffer_init(&conn->send);
+
+	return 0;
+}
+
+void conn_queue_send_buffer(struct connection * const conn)
+{
+	pthread_mutex_lock(&conn->send_lock);
+	__queue_send_buffer(conn);
+	pthread_mutex_unlock(&conn->send_lock);
+}
+
+void __attribute__((format(printf, 2, 3))) conn_send(struct connection * const conn, char *format, ...)
+{
+	va_list ap;
+	int r;
+
+	assert(conn);
+
+	if (conn->terminate)
+		return;
+
+	pthread_mutex_lock(&conn->send_lock);
+
+	va_start(ap, format);
+	r = vbufprintf(&conn->send, format, ap);
+	va_end(ap);
+
+	/* The send buffer is full, start on a new one and try again */
+	if (r && conn->send.idx && !__queue_send_buffer(conn)) {
+		va_start(ap, format);
+		r = vbufprintf(&conn->send, format, ap);
+		va_end(ap);
+	}
+
+	pthread_mutex_unlock(&conn->send_lock);
+
+	if (r)
+		log_printfn(LOG_CONN, "output too large (connection %x), dropping it", conn->id);
+}
+
+/*
+ * Hands everything sent so far over to the server loop, which will write it
+ * to the peer as soon as the socket is writable.
+ */
+void conn_flush(struct connection * const conn)
+{
+	conn_queue_send_buffer(conn);
+
+	if (!conn->terminate)
+		ev_async_send(conn->loop, &conn->flush_watcher);
+}
+
+#define CONN_MAX_IOVECS 64
+/*
+ * Writes as much of the send queue as the peer socket accepts without
+ * blocking. Returns the number of bytes still queued, or -1 on error.
+ */
+ssize_t conn_write_queued(struct connection * const conn)
+{
+	struct iovec iov[CONN_MAX_IOVECS];
+	struct send_chunk *c, *_c;
+	ssize_t r;
+	size_t n;
+	int iovcnt;
+
+	assert(conn->peerfd);
+
+	pthread_mutex_lock(&conn->send_lock);
+
+	while (!list_empty(&conn->send_queue)) {
+		iovcnt = 0;
+		list_for_each_entry(c, &conn->send_queue, list) {
+			if (iovcnt == CONN_MAX_IOVECS)
+				break;
+			iov[iovcnt].iov_base = c->buf.buf + c->sent;
+			iov[iovcnt].iov_len = c->buf.idx - c->sent;
+			iovcnt++;
+		}
+
+		r = writev(conn->peerfd, iov, iovcnt);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			pthread_mutex_unlock(&conn->send_lock);
+			return -1;
+		}
+
+		conn->send_queued -= r;
+		list_for_each_entry_safe(c, _c, &conn->send_queue, list) {
+			n = MIN((size_t)r, c->buf.idx - c->sent);
+			c->sent += n;
+			r -= n;
+			if (c->sent < c->buf.idx)
+				break;
+
+			list_del(&c->list);
+			buffer_free(&c->buf);
+			free(c);
+		}
+	}
+
+	r = conn->send_queued;
+
+	pthread_mutex_unlock(&conn->send_lock);
+
+	return r;
+}
+
+static int start_worker(struct conn_worker *w)
+{
+	sigset_t old, new;
+
+	sigfillset(&new);
 
 	if (pthread_sigmask(SIG_SETMASK, &new, &old))
-		goto err_free;
+		return -1;
 
 	if (pthread_create(&w->thread, NULL, connection_worker, w))
-		goto err_free;
+		return -1;
 
 	if (pthread_sigmask(SIG_SETMASK, &old, NULL)) {
 		pthread_cancel(w->thread);
-		goto err_free;
+		pthread_join(w->thread, NULL);
+		return -1;
 	}
 
-	list_add(&w->list, &data->workers);
-
 	return 0;
+}
 
-err_free:
-	free(w);
-	return -1;
+static void stop_workers(struct conn_data *data, unsigned int num)
+{
+	pthread_mutex_lock(&data->idle_lock);
+
+	for (unsigned int i = 0; i < num; i++)
+		data->workers[i].terminate = 1;
+	pthread_cond_broadcast(&data->idle_cond);
+
+	pthread_mutex_unlock(&data->idle_lock);
+
+	for (unsigned int i = 0; i < num; i++)
+		pthread_join(data->workers[i].thread, NULL);
 }
 
-#define NUM_WORKERS 4
-static int initialize_workers(struct conn_data *data)
+static int initialize_workers(struct conn_data *data, unsigned int num_workers)
 {
-	INIT_LIST_HEAD(&data->workers);
+	unsigned int i;
+
+	data->workers = calloc(num_workers, sizeof(*data->workers));
+	if (!data->workers)
+		return -1;
+	data->num_workers = num_workers;
 
-	for (int i = 0; i < NUM_WORKERS; i++) {
-		if (start_new_worker(data))
+	for (i = 0; i < num_workers; i++) {
+		data->workers[i].conn_data = data;
+		data->workers[i].idx = i;
+		INIT_LIST_HEAD(&data->workers[i].work_items);
+		pthread_mutex_init(&data->workers[i].lock, NULL);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (start_worker(&data->workers[i]))
 			goto err;
 	}
 
 	return 0;
 
-	struct conn_worker_list *w;
 err:
-	list_for_each_entry(w, &data->workers, list)
-		free(w);
+	stop_workers(data, i);
+	for (i = 0; i < num_workers; i++)
+		pthread_mutex_destroy(&data->workers[i].lock);
+	free(data->workers);
+	data->workers = NULL;
 
 	return -1;
-}       
+}
 
-int conndata_init(struct conn_data *data)
+int conndata_init(struct conn_data *data, unsigned int num_workers)
 {
+	assert(num_workers > 0);
+
 	memset(data, 0, sizeof(*data));
-	INIT_LIST_HEAD(&data->work_items);
 
-	if (pthread_mutex_init(&data->workers_lock, NULL))
+	if (pthread_mutex_init(&data->idle_lock, NULL))
 		return -1;
-	if (pthread_cond_init(&data->workers_cond, NULL))
+	if (pthread_cond_init(&data->idle_cond, NULL))
 		goto err_mutex;
-	if (initialize_workers(data))
+	if (initialize_workers(data, num_workers))
 		goto err_cond;
 
 	return 0;
 
 err_cond:
-	pthread_cond_destroy(&data->workers_cond);
+	pthread_cond_destroy(&data->idle_cond);
 err_mutex:
-	pthread_mutex_destroy(&data->workers_lock);
+	pthread_mutex_destroy(&data->idle_lock);
 
 	return -1;
 }
 
 void conn_shutdown(struct conn_data *data)
 {
-	struct conn_worker_list *w;
-
-	pthread_mutex_lock(&data->workers_lock);
-
-	list_for_each_entry(w, &data->workers, list)
-		w->terminate = 1;
-	pthread_cond_broadcast(&data->workers_cond);
-
-	pthread_mutex_unlock(&data->workers_lock);
-
-	list_for_each_entry(w, &data->workers, list)
-		pthread_join(w->thread, NULL);
+	stop_workers(data, data->num_workers);
 }
 
 void conn_destroy(struct conn_data *data)
 {
-	pthread_cond_destroy(&data->workers_cond);
-	pthread_mutex_destroy(&data->workers_lock);
+	pthread_cond_destroy(&data->idle_cond);
+	pthread_mutex_destroy(&data->idle_lock);
 
-	struct conn_worker_list *w, *p;
-	list_for_each_entry_safe(w, p, &data->workers, list)
-		free(w);
+	for (unsigned int i = 0; i < data->num_workers; i++)
+		pthread_mutex_destroy(&data->workers[i].lock);
+	free(data->workers);
+	data->workers = NULL;
 }
@@ -6,53 +6,87 @@
 #include <arpa/inet.h>
 #include <ev.h>
 #include "buffer.h"
+#include "ptrlist.h"
 #include "player.h"
 #include "server.h"
 
 #define CONN_BUFSIZE 1500
 #define CONN_MAXBUFSIZE 10240
 
-#define conn_send(data, ...)					\
-	do {							\
-		if (!data->terminate) {				\
-			bufprintf(&data->send, __VA_ARGS__);	\
-			conn_send_buffer(data);			\
-		}						\
-	} while (0)
+/*
+ * Output is queued and written by the server loop when the peer socket is
+ * writable. A peer which has more than CONN_SEND_HIGH_WATER bytes queued is
+ * not read from until the queue has drained below CONN_SEND_LOW_WATER, and
+ * a peer lagging more than CONN_SEND_MAX bytes behind is disconnected.
+ */
+#define CONN_SEND_LOW_WATER (16 * 1024)
+#define CONN_SEND_HIGH_WATER (64 * 1024)
+#define CONN_SEND_MAX (1024 * 1024)
+
+/*
+ * Commands received from a peer are run in order, one at a time. A peer
+ * with CONN_MAX_QUEUED_CMDS commands waiting is not read from until the
+ * queue is down to half of that.
+ */
+#define CONN_MAX_QUEUED_CMDS 256
 
 struct connection {
 	uint32_t id;
+	struct ev_loop *loop;
 	ev_io data_watcher;
+	ev_io write_watcher;
 	ev_async kill_watcher;
+	ev_async flush_watcher;
 	fd_set rfds;
 	int peerfd;
 	struct sockaddr_storage sock;
 	char peer[INET6_ADDRSTRLEN + 7];
 	struct player *pl;
 	struct buffer send, recv;
+	struct list_head send_queue;
+	size_t send_queued;
+	pthread_mutex_t send_lock;
 	int paused;
+	int throttled;
+	int backlogged;
 	int terminate;
 	struct list_head list, work;
-	volatile int worker;
-	pthread_mutex_t worker_lock;
-};
-
-struct conn_data {
-	struct list_head workers;
-	pthread_mutex_t workers_lock;
-	pthread_cond_t workers_cond;
-	struct list_head work_items;
+	struct conn_worker *queued_on;
+	int refcount;
+	struct ptrlist cmds;
+	int scheduled;
+	pthread_mutex_t cmd_lock;
 };
 
-struct conn_worker_list {
+/*
+ * Every worker has its own queue of connections with work to do. A
+ * connection is always queued on the same worker, but a worker that runs
+ * out of work steals connections from the back of the other workers'
+ * queues. Workers only share the idle lock, which they take when there is
+ * nothing to do at all.
+ */
+struct conn_worker {
 	pthread_t thread;
 	volatile int terminate;
 	struct conn_data *conn_data;
-	struct list_head list;
+	unsigned int idx;
+	pthread_mutex_t lock;
+	struct list_head work_items;
+};
+
+struct conn_data {
+	struct conn_worker *workers;
+	unsigned int num_workers;
+	unsigned long pending;
+	unsigned int idle;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
 };
 
 int conn_init(struct connection *conn);
 void connection_free(struct connection *conn);
+void conn_get(struct connection *conn);
+void conn_put(struct connection *conn);
 void* conn_main(void *dataptr);
 void conn_cleanexit(struct connection *data);
 void __attribute__((format(printf, 2, 3))) conn_error(struct connection *data, char *format, ...);
@@ -60,9 +94,15 @@ void* connection_worker(void *_data);
 int conn_fulfixinit(struct connection *data);
 
 void conn_do_work(struct conn_data *data, struct connection *conn);
-void conn_send_buffer(struct connection * const data);
+long conn_queue_cmd(struct conn_data *data, struct connection *conn, char *line);
+unsigned long conn_cmds_queued(struct connection *conn);
+void conn_cancel_work(struct conn_data *data, struct connection *conn);
+void __attribute__((format(printf, 2, 3))) conn_send(struct connection * const conn, char *format, ...);
+void conn_flush(struct connection * const conn);
+void conn_queue_send_buffer(struct connection * const conn);
+ssize_t conn_write_queued(struct connection * const conn);
 
-int conndata_init(struct conn_data *data);
+int conndata_init(struct conn_data *data, unsigned int num_workers);
 void conn_shutdown(struct conn_data *data);
 void conn_destroy(struct conn_data *data);
 
@@ -12,13 +12,16 @@
 #include "buffer.h"
 #include "cli.h"
 #include "item.h"
+#include "journal.h"
 #include "list.h"
 #include "log.h"
 #include "module.h"
 #include "planet.h"
 #include "planet_type.h"
 #include "port.h"
+#include "port_update.h"
 #include "server.h"
+#include "snapshot.h"
 #include "universe.h"
 
 static void write_msg(int fd, struct signal *msg, char *msgdata)
@@ -194,6 +197,47 @@ static int cmd_rmmod(void *_console, char *name)
 	return 0;
 }
 
+/*
+ * Saves a snapshot of the universe to file, and removes the records it
+ * includes from the journal. Returns -1 if the snapshot couldn't be saved
+ * and 1 if the journal couldn't be checkpointed.
+ */
+static int save_universe(const char * const file)
+{
+	/* Records appended before the snapshot was started are part of it */
+	const uint64_t seq = journal_seq();
+
+	if (snapshot_save(&univ, file, seq))
+		return -1;
+
+	if (journal_checkpoint(seq))
+		return 1;
+
+	return 0;
+}
+
+static int cmd_save(void *_console, char *param)
+{
+	int r;
+
+	if (!param) {
+		printf("usage: save <file name>\n");
+		return 0;
+	}
+
+	r = save_universe(param);
+	if (r < 0) {
+		printf("Error saving universe to %s\n", param);
+		return 0;
+	}
+
+	printf("Universe saved to %s, load it with -u\n", param);
+	if (r)
+		printf("Error removing saved records from the journal\n");
+
+	return 0;
+}
+
 static int cmd_ships(void *_console, char *param)
 {
 	struct ship_type *type;
@@ -227,8 +271,13 @@ static int cmd_stats(void *_console, char *param)
 {
 	struct tm t;
 	char created[32];
+	struct port_update_stats pu;
+	struct journal_stats js;
 	memset(created, 0, sizeof(created));
 
+	port_update_get_stats(&pu);
+	journal_get_stats(&js);
+
 	localtime_r(&univ.created, &t);
 	strftime(created, sizeof(created), "%c", &t);
 
@@ -236,10 +285,19 @@ static int cmd_stats(void *_console, char *param)
 			"  Size of universe:          %lu systems\n"
 			"  Universe created:          %s\n"
 			"  Number of users known:     %s\n"
-			"  Number of users connected: %s\n",
+			"  Number of users connected: %s\n"
+			"  Port updates:              %lu ticks, %lu missed deadline, %lu ports deferred\n"
+			"  Port update time:          %lu ms last, %lu ms average, %lu ms max for %lu ports\n"
+			"  Journal:                   %lu records in %lu commits, %lu kB, %lu stalls, %lu errors\n"
+			"  Journal commit time:       %lu ms last, %lu ms max\n",
 			ptrlist_len(&univ.systems),
 			created,
-			"FIXME", "FIXME");
+			"FIXME", "FIXME",
+			pu.ticks, pu.overruns, pu.deferred,
+			pu.last_usec / 1000, (pu.ticks ? pu.total_usec / pu.ticks : 0) / 1000,
+			pu.max_usec / 1000, pu.num_ports,
+			js.records, js.commits, js.bytes / 1024, js.stalls, js.errors,
+			js.last_usec / 1000, js.max_usec / 1000);
 	return 0;
 }
 
@@ -274,6 +332,8 @@ static int register_console_commands(struct console * console)
 		goto err;
 	if (cli_add_cmd(&console->cli, "rmmod", cmd_rmmod, console, "Unload a loadable module"))
 		goto err;
+	if (cli_add_cmd(&console->cli, "save", cmd_save, console, "Save the universe to a snapshot file"))
+		goto err;
 	if (cli_add_cmd(&console->cli, "ships", cmd_ships, console, "List available ship types"))
 		goto err;
 	if (cli_add_cmd(&console->cli, "stats", cmd_stats, console, "Display statistics"))
@@ -291,6 +351,7 @@ err:
 }
 
 #define CONSOLE_PROMPT "console> "
+#define CONSOLE_SNAPSHOT_INTERVAL (10 * 60)	/* Seconds between periodic snapshots */
 static void console_cmd_cb(struct ev_loop * const loop, ev_io * const w, const int revents)
 {
 	struct console *console = w->data;
@@ -316,10 +377,18 @@ static void console_kill_cb(struct ev_loop * const loop, struct ev_async *w, int
 	ev_break(loop, EVBREAK_ALL);
 }
 
+static void console_snapshot_cb(struct ev_loop * const loop, ev_timer * const w, const int revents)
+{
+	struct console *console = w->data;
+
+	if (save_universe(console->snapshot_file))
+		log_printfn(LOG_MAIN, "periodic snapshot to %s failed", console->snapshot_file);
+}
+
 static void* console_main(void *_console)
 {
 	struct console *console = _console;
-	INIT_LIST_HEAD(&console->cli);
+	st_init(&console->cli);
 
 	console->loop = ev_loop_new(EVFLAG_AUTO | EVFLAG_NOSIGMASK);
 	if (!console->loop)
@@ -335,6 +404,13 @@ static void* console_main(void *_console)
 	ev_async_start(console->loop, &console->kill_watcher);
 	ev_io_start(console->loop, &console->cmd_watcher);
 
+	if (console->snapshot_file) {
+		ev_timer_init(&console->snapshot_timer, console_snapshot_cb,
+				CONSOLE_SNAPSHOT_INTERVAL, CONSOLE_SNAPSHOT_INTERVAL);
+		console->snapshot_timer.data = console;
+		ev_timer_start(console->loop, &console->snapshot_timer);
+	}
+
 	printf("Welcome to YASTG %s, built %s %s.\n\n", PACKAGE_VERSION, __DATE__, __TIME__);
 	printf("Universe has %lu systems in total\n", ptrlist_len(&univ.systems));
 	printf("\n" CONSOLE_PROMPT);
@@ -342,6 +418,8 @@ static void* console_main(void *_console)
 
 	ev_run(console->loop, 0);
 
+	if (console->snapshot_file)
+		ev_timer_stop(console->loop, &console->snapshot_timer);
 	ev_io_stop(console->loop, &console->cmd_watcher);
 	ev_async_stop(console->loop, &console->kill_watcher);
 	cli_tree_destroy(&console->cli);
@@ -5,14 +5,17 @@
 #include <pthread.h>
 #include "list.h"
 #include "server.h"
+#include "stringtree.h"
 
 struct console {
 	struct server *server;
-	struct list_head cli;
+	struct st_node cli;
 	struct ev_loop *loop;
 	int sleep;
 	ev_async kill_watcher;
 	ev_io cmd_watcher;
+	char *snapshot_file;		/* Saved to periodically, if set */
+	ev_timer snapshot_timer;
 	pthread_t thread;
 	struct buffer buffer;
 };
@@ -11,46 +11,175 @@
 #include "constellation.h"
 #include "system.h"
 #include "star.h"
+#include "planet.h"
+#include "port.h"
 #include "ptrlist.h"
 #include "stringtree.h"
 
-static int addconstellation(const char * const cname)
+/*
+ * Constellations are generated in three steps. Their names and sizes are
+ * decided first, then the contents of their systems (stars, planets and
+ * ports) are generated in parallel, and finally the systems are placed in
+ * the universe one constellation at a time.
+ *
+ * Each constellation's contents are generated with the random number stream
+ * GENESIS_STREAM + its index, and everything else is done in order by a
+ * single thread, so the universe only depends on the seed and not on how
+ * the threads happen to be scheduled.
+ */
+#define GENESIS_STREAM (1ULL << 32)
+
+struct new_constellation {
+	char *name;
+	unsigned long num_systems;
+	struct system **systems;
+};
+
+struct genesis {
+	struct new_constellation *cons;
+	unsigned long num;
+	unsigned long next;		/* Next constellation to generate */
+	int err;
+};
+
+static int create_systems(struct new_constellation *c, const unsigned long idx)
 {
-	unsigned long nums, numc, i;
 	char *string;
+
+	mtrandom_use_stream(GENESIS_STREAM + idx);
+
+	string = malloc(strlen(c->name) + GREEK_LEN + 2);
+	if (!string)
+		return -1;
+
+	for (unsigned long i = 0; i < c->num_systems; i++) {
+		c->systems[i] = malloc(sizeof(*c->systems[i]));
+		if (!c->systems[i])
+			goto err;
+
+		sprintf(string, "%s %s", greek[i], c->name);
+		if (system_create(c->systems[i], string)) {
+			free(c->systems[i]);
+			c->systems[i] = NULL;
+			goto err;
+		}
+	}
+
+	free(string);
+	return 0;
+
+err:
+	free(string);
+	return -1;
+}
+
+static void* genesis_worker(void *_g)
+{
+	struct genesis *g = _g;
+	unsigned long i;
+
+	while ((i = __sync_fetch_and_add(&g->next, 1)) < g->num) {
+		if (create_systems(&g->cons[i], i))
+			g->err = 1;
+	}
+
+	return NULL;
+}
+
+static int create_all_systems(struct genesis *g, unsigned int num_threads)
+{
+	pthread_t *threads;
+	unsigned int started;
+	struct mtrandom saved;
+
+	num_threads = MAX(MIN(num_threads, g->num), 1);
+
+	threads = malloc(num_threads * sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL, genesis_worker, g))
+			break;
+	}
+
+	/*
+	 * If we couldn't start any threads, do the work ourselves, and then go
+	 * back to our own stream so placing the systems draws the same numbers
+	 * as when the threads did the work.
+	 */
+	if (!started) {
+		mtrandom_save(&saved);
+		genesis_worker(g);
+		mtrandom_restore(&saved);
+	}
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return g->err ? -1 : 0;
+}
+
+static int register_ports(struct system *s)
+{
+	unsigned long lh, li;
+	struct planet *planet;
+	struct port *port;
+
+	ptrlist_for_each_entry(planet, &s->planets, lh) {
+		ptrlist_for_each_entry(port, &planet->ports, li) {
+			if (port_register(port))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Makes the planets of the system known by name. The caller must hold the
+ * planetnames_lock of the universe for writing.
+ */
+static void register_planets(struct system *s)
+{
+	struct planet *planet;
+	unsigned long lh;
+
+	ptrlist_for_each_entry(planet, &s->planets, lh) {
+		st_add_string(&univ.planetnames, planet->name, planet);
+		if (planet->gname)
+			st_add_string(&univ.planetnames, planet->gname, planet);
+	}
+}
+
+static int place_constellation(struct new_constellation *c)
+{
+	unsigned long i;
 	struct system *fs, *s;
 	struct ptrlist work;
 	double phi;
 	unsigned long r;
 
-	string = malloc(strlen(cname)+GREEK_LEN+2);
-	if (!string)
-		return -1;
-
 	ptrlist_init(&work);
 
-	/* Determine number of systems in constellation */
-	nums = mtrandom_uint(GREEK_N);
-	if (nums == 0)
-		nums = 1;
-
-	printf("addconstellation: will create %lu systems (universe has %lu so far)\n", nums, ptrlist_len(&univ.systems));
+	printf("Placing constellation %s with %lu systems (universe has %lu so far)\n",
+			c->name, c->num_systems, ptrlist_len(&univ.systems));
 
 	pthread_rwlock_wrlock(&univ.systemnames_lock);
+	pthread_rwlock_wrlock(&univ.planetnames_lock);
 
 	fs = NULL;
-	for (numc = 0; numc < nums; numc++) {
-
-		/* Create a new system and put it in s */
-		s = malloc(sizeof(*s));
-		if (!s)
-			goto err;
-		sprintf(string, "%s %s", greek[numc], cname);
-		if (system_create(s, string))
-			goto err;
+	for (unsigned long numc = 0; numc < c->num_systems; numc++) {
+		s = c->systems[numc];
 
+		s->idx = ptrlist_len(&univ.systems);
 		ptrlist_push(&univ.systems, s);
+		/* It's freed along with the universe from now on */
+		c->systems[numc] = NULL;
 		st_add_string(&univ.systemnames, s->name, s);
+		register_planets(s);
 
 		if (fs == NULL) {
 			/* This was the first system generated for this constellation
@@ -87,34 +216,98 @@ static int addconstellation(const char * const cname)
 				ptrlist_pull(&work);
 		}
 
+		if (register_ports(s))
+			goto err;
+
 		printf("Created %s (%p) at %ldx%ld\n", s->name, s, s->x, s->y);
 
 	}
 
+	pthread_rwlock_unlock(&univ.planetnames_lock);
 	pthread_rwlock_unlock(&univ.systemnames_lock);
 
-	free(string);
 	ptrlist_free(&work);
 
 	return 0;
 
 err:
+	pthread_rwlock_unlock(&univ.planetnames_lock);
 	pthread_rwlock_unlock(&univ.systemnames_lock);
+	ptrlist_free(&work);
 	return -1;
 }
 
-int spawn_constellations(struct universe *u)
+static void free_genesis(struct genesis *g)
 {
-	char *name;
-	for (size_t ncons = 0; ncons < CONSTELLATION_MAXNUM; ncons++) {
-		name = create_unique_name(&u->avail_constellations);
-		printf("Adding constellation %s\n", name);
-		if (addconstellation(name)) {
-			free(name);
-			return -1;
+	for (unsigned long i = 0; i < g->num; i++) {
+		free(g->cons[i].name);
+		free(g->cons[i].systems);
+	}
+	free(g->cons);
+}
+
+/*
+ * Systems that weren't placed in the universe because genesis failed are
+ * freed here, the others are freed along with the universe.
+ */
+static void free_unplaced_systems(struct genesis *g)
+{
+	for (unsigned long i = 0; i < g->num; i++) {
+		for (unsigned long j = 0; j < g->cons[i].num_systems; j++) {
+			if (g->cons[i].systems[j])
+				system_free(g->cons[i].systems[j]);
 		}
-		free(name);
 	}
+}
+
+int spawn_constellations(struct universe *u, const unsigned int num_threads)
+{
+	struct genesis g;
+	struct new_constellation *c;
+
+	memset(&g, 0, sizeof(g));
+	g.cons = calloc(CONSTELLATION_MAXNUM, sizeof(*g.cons));
+	if (!g.cons)
+		return -1;
+
+	for (g.num = 0; g.num < CONSTELLATION_MAXNUM; g.num++) {
+		c = &g.cons[g.num];
+
+		c->name = create_unique_name(&u->avail_constellations);
+		if (!c->name)
+			goto err;
+
+		/* Determine number of systems in constellation */
+		c->num_systems = mtrandom_uint(GREEK_N);
+		if (c->num_systems == 0)
+			c->num_systems = 1;
+
+		c->systems = calloc(c->num_systems, sizeof(*c->systems));
+		if (!c->systems) {
+			free(c->name);
+			goto err;
+		}
+	}
+
+	printf("Generating %lu constellations using %u threads\n", g.num, num_threads);
+
+	if (create_all_systems(&g, num_threads)) {
+		free_unplaced_systems(&g);
+		goto err;
+	}
+
+	for (unsigned long i = 0; i < g.num; i++) {
+		if (place_constellation(&g.cons[i])) {
+			free_unplaced_systems(&g);
+			goto err;
+		}
+	}
+
+	free_genesis(&g);
 
 	return 0;
+
+err:
+	free_genesis(&g);
+	return -1;
 }
@@ -9,6 +9,6 @@
 #define CONSTELLATION_PHI_RANDOM 1.0
 #define CONSTELLATION_MAXNUM 128
 
-int spawn_constellations(struct universe *u);
+int spawn_constellations(struct universe *u, const unsigned int num_threads);
 
 #endif
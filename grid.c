@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "ptrlist.h"
+#include "grid.h"
+
+#define GRID_MIN_BUCKETS 64
+#define GRID_MIN_ENTRIES 4
+
+int grid_init(struct grid *g, const long cell_size)
+{
+	assert(cell_size > 0);
+
+	memset(g, 0, sizeof(*g));
+	g->cell_size = cell_size;
+
+	g->buckets = calloc(GRID_MIN_BUCKETS, sizeof(*g->buckets));
+	if (!g->buckets)
+		return -1;
+	g->num_buckets = GRID_MIN_BUCKETS;
+
+	return 0;
+}
+
+void grid_free(struct grid *g)
+{
+	struct grid_cell *c, *next;
+
+	for (unsigned long i = 0; i < g->num_buckets; i++) {
+		for (c = g->buckets[i]; c; c = next) {
+			next = c->next;
+			free(c->x);
+			free(c->y);
+			free(c->data);
+			free(c);
+		}
+	}
+
+	free(g->buckets);
+	memset(g, 0, sizeof(*g));
+}
+
+/*
+ * Rounds towards negative infinity, so that cell 0 only contains
+ * coordinates from 0 up to cell_size - 1.
+ */
+static long cell_coord(const struct grid * const g, const long v)
+{
+	if (v >= 0)
+		return v / g->cell_size;
+	else
+		return -((-v - 1) / g->cell_size) - 1;
+}
+
+static unsigned long cell_hash(const long cx, const long cy)
+{
+	return ((unsigned long)cx * 73856093UL) ^ ((unsigned long)cy * 19349663UL);
+}
+
+static struct grid_cell* find_cell(const struct grid * const g, const long cx, const long cy)
+{
+	struct grid_cell *c;
+
+	c = g->buckets[cell_hash(cx, cy) & (g->num_buckets - 1)];
+	for (; c; c = c->next) {
+		if (c->cx == cx && c->cy == cy)
+			return c;
+	}
+
+	return NULL;
+}
+
+static int rehash(struct grid *g)
+{
+	struct grid_cell **buckets, *c, *next;
+	unsigned long num = g->num_buckets * 2;
+	unsigned long b;
+
+	buckets = calloc(num, sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	for (unsigned long i = 0; i < g->num_buckets; i++) {
+		for (c = g->buckets[i]; c; c = next) {
+			next = c->next;
+			b = cell_hash(c->cx, c->cy) & (num - 1);
+			c->next = buckets[b];
+			buckets[b] = c;
+		}
+	}
+
+	free(g->buckets);
+	g->buckets = buckets;
+	g->num_buckets = num;
+
+	return 0;
+}
+
+static struct grid_cell* new_cell(struct grid *g, const long cx, const long cy)
+{
+	struct grid_cell *c;
+	unsigned long b;
+
+	if (g->num_cells >= g->num_buckets && rehash(g))
+		return NULL;
+
+	c = malloc(sizeof(*c));
+	if (!c)
+		return NULL;
+	memset(c, 0, sizeof(*c));
+	c->cx = cx;
+	c->cy = cy;
+
+	b = cell_hash(cx, cy) & (g->num_buckets - 1);
+	c->next = g->buckets[b];
+	g->buckets[b] = c;
+
+	if (!g->num_cells) {
+		g->min_cx = g->max_cx = cx;
+		g->min_cy = g->max_cy = cy;
+	} else {
+		g->min_cx = MIN(g->min_cx, cx);
+		g->max_cx = MAX(g->max_cx, cx);
+		g->min_cy = MIN(g->min_cy, cy);
+		g->max_cy = MAX(g->max_cy, cy);
+	}
+	g->num_cells++;
+
+	return c;
+}
+
+static int grow_cell(struct grid_cell *c)
+{
+	unsigned long size = MAX(c->alloc * 2, GRID_MIN_ENTRIES);
+	void *ptr;
+
+	if (!(ptr = realloc(c->x, size * sizeof(*c->x))))
+		return -1;
+	c->x = ptr;
+	if (!(ptr = realloc(c->y, size * sizeof(*c->y))))
+		return -1;
+	c->y = ptr;
+	if (!(ptr = realloc(c->data, size * sizeof(*c->data))))
+		return -1;
+	c->data = ptr;
+
+	c->alloc = size;
+
+	return 0;
+}
+
+int grid_insert(struct grid *g, const long x, const long y, void *data)
+{
+	const long cx = cell_coord(g, x);
+	const long cy = cell_coord(g, y);
+	struct grid_cell *c;
+
+	c = find_cell(g, cx, cy);
+	if (!c && !(c = new_cell(g, cx, cy)))
+		return -1;
+
+	if (c->len == c->alloc && grow_cell(c))
+		return -1;
+
+	c->x[c->len] = x;
+	c->y[c->len] = y;
+	c->data[c->len] = data;
+	c->len++;
+	g->num_entries++;
+
+	return 0;
+}
+
+int grid_remove(struct grid *g, const long x, const long y, void *data)
+{
+	struct grid_cell *c;
+	unsigned long last;
+
+	c = find_cell(g, cell_coord(g, x), cell_coord(g, y));
+	if (!c)
+		return -1;
+
+	for (unsigned long i = 0; i < c->len; i++) {
+		if (c->data[i] == data && c->x[i] == x && c->y[i] == y) {
+			last = --c->len;
+			c->x[i] = c->x[last];
+			c->y[i] = c->y[last];
+			c->data[i] = c->data[last];
+			g->num_entries--;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void* grid_lookup(const struct grid * const g, const long x, const long y)
+{
+	struct grid_cell *c;
+
+	c = find_cell(g, cell_coord(g, x), cell_coord(g, y));
+	if (!c)
+		return NULL;
+
+	for (unsigned long i = 0; i < c->len; i++) {
+		if (c->x[i] == x && c->y[i] == y)
+			return c->data[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Computes the squared distance from (x, y) to n points. This is written
+ * as a plain loop without branches so the compiler can vectorize it.
+ * The squares are calculated unsigned, which gives the right result for
+ * all distances up to 2^32 and doesn't trap on overflow with -ftrapv.
+ */
+void grid_distances_squared(const long * restrict xs, const long * restrict ys,
+		const unsigned long n, const long x, const long y,
+		unsigned long * restrict result)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		const unsigned long dx = (unsigned long)xs[i] - (unsigned long)x;
+		const unsigned long dy = (unsigned long)ys[i] - (unsigned long)y;
+
+		result[i] = dx * dx + dy * dy;
+	}
+}
+
+#define GRID_BATCH 64
+
+static unsigned long range_in_cell(const struct grid_cell * const c, const long x, const long y,
+		const unsigned long max_squared, struct ptrlist * const result)
+{
+	unsigned long d[GRID_BATCH];
+	unsigned long found = 0;
+	unsigned long n;
+
+	for (unsigned long start = 0; start < c->len; start += GRID_BATCH) {
+		n = MIN(GRID_BATCH, c->len - start);
+		grid_distances_squared(c->x + start, c->y + start, n, x, y, d);
+
+		for (unsigned long i = 0; i < n; i++) {
+			if (d[i] >= max_squared)
+				continue;
+
+			found++;
+			if (result)
+				ptrlist_push(result, c->data[start + i]);
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Finds everything closer than radius to (x, y). If result is NULL, the
+ * matches are only counted. The order of the result is undefined.
+ */
+unsigned long grid_range(const struct grid * const g, const long x, const long y,
+		const unsigned long radius, struct ptrlist * const result)
+{
+	const unsigned long max_squared = radius * radius;
+	long min_cx, max_cx, min_cy, max_cy;
+	struct grid_cell *c;
+	unsigned long found = 0;
+
+	if (!g->num_entries)
+		return 0;
+
+	min_cx = MAX(cell_coord(g, x - (long)radius), g->min_cx);
+	max_cx = MIN(cell_coord(g, x + (long)radius), g->max_cx);
+	min_cy = MAX(cell_coord(g, y - (long)radius), g->min_cy);
+	max_cy = MIN(cell_coord(g, y + (long)radius), g->max_cy);
+
+	if (min_cx > max_cx || min_cy > max_cy)
+		return 0;
+
+	/*
+	 * Large areas are cheaper to search by going through the cells that
+	 * actually exist than by looking up every cell in the area.
+	 */
+	if ((unsigned long)(max_cx - min_cx + 1) * (max_cy - min_cy + 1) > g->num_cells) {
+		for (unsigned long i = 0; i < g->num_buckets; i++) {
+			for (c = g->buckets[i]; c; c = c->next) {
+				if (c->cx >= min_cx && c->cx <= max_cx &&
+						c->cy >= min_cy && c->cy <= max_cy)
+					found += range_in_cell(c, x, y, max_squared, result);
+			}
+		}
+
+		return found;
+	}
+
+	for (long cy = min_cy; cy <= max_cy; cy++) {
+		for (long cx = min_cx; cx <= max_cx; cx++) {
+			c = find_cell(g, cx, cy);
+			if (c)
+				found += range_in_cell(c, x, y, max_squared, result);
+		}
+	}
+
+	return found;
+}
+
+struct nearest {
+	unsigned long d;
+	void *data;
+};
+
+/*
+ * Keeps the k best candidates found so far sorted by distance.
+ */
+static void nearest_in_cell(const struct grid_cell * const c, const long x, const long y,
+		const unsigned long k, struct nearest * const best, unsigned long * const found,
+		int (*filter)(void*, void*), void *arg)
+{
+	unsigned long d[GRID_BATCH];
+	unsigned long n, j;
+	void *data;
+
+	for (unsigned long start = 0; start < c->len; start += GRID_BATCH) {
+		n = MIN(GRID_BATCH, c->len - start);
+		grid_distances_squared(c->x + start, c->y + start, n, x, y, d);
+
+		for (unsigned long i = 0; i < n; i++) {
+			data = c->data[start + i];
+
+			if (*found == k && d[i] >= best[k - 1].d)
+				continue;
+			if (filter && !filter(data, arg))
+				continue;
+
+			if (*found < k)
+				(*found)++;
+			for (j = *found - 1; j > 0 && best[j - 1].d > d[i]; j--)
+				best[j] = best[j - 1];
+			best[j].d = d[i];
+			best[j].data = data;
+		}
+	}
+}
+
+static void nearest_at(const struct grid * const g, const long cx, const long cy,
+		const long x, const long y, const unsigned long k, struct nearest * const best,
+		unsigned long * const found, int (*filter)(void*, void*), void *arg)
+{
+	struct grid_cell *c;
+
+	if (cx < g->min_cx || cx > g->max_cx || cy < g->min_cy || cy > g->max_cy)
+		return;
+
+	c = find_cell(g, cx, cy);
+	if (c)
+		nearest_in_cell(c, x, y, k, best, found, filter, arg);
+}
+
+/*
+ * Finds the k entries closest to (x, y) for which filter returns non-zero,
+ * or all entries if filter is NULL. The result is sorted by distance,
+ * closest first.
+ *
+ * The search goes through square rings of cells around (x, y). Nothing
+ * outside ring r can be closer than r cells, so the search stops as soon as
+ * k entries closer than that have been found.
+ */
+unsigned long grid_nearest(const struct grid * const g, const long x, const long y,
+		const unsigned long k, int (*filter)(void *data, void *arg), void *arg,
+		struct ptrlist * const result)
+{
+	const long cx = cell_coord(g, x);
+	const long cy = cell_coord(g, y);
+	struct nearest *best;
+	unsigned long reach;
+	unsigned long found = 0;
+
+	if (!k || !g->num_entries)
+		return 0;
+
+	best = malloc(k * sizeof(*best));
+	if (!best)
+		return 0;
+
+	for (long r = 0; ; r++) {
+		if (cx - r < g->min_cx && cx + r > g->max_cx &&
+				cy - r < g->min_cy && cy + r > g->max_cy)
+			break;
+
+		for (long dy = -r; dy <= r; dy++) {
+			if (dy == -r || dy == r) {
+				for (long dx = -r; dx <= r; dx++)
+					nearest_at(g, cx + dx, cy + dy, x, y, k, best, &found, filter, arg);
+			} else {
+				nearest_at(g, cx - r, cy + dy, x, y, k, best, &found, filter, arg);
+				nearest_at(g, cx + r, cy + dy, x, y, k, best, &found, filter, arg);
+			}
+		}
+
+		reach = r * g->cell_size;
+		if (found == k && best[k - 1].d <= reach * reach)
+			break;
+	}
+
+	if (result) {
+		for (unsigned long i = 0; i < found; i++)
+			ptrlist_push(result, best[i].data);
+	}
+
+	free(best);
+
+	return found;
+}
@@ -0,0 +1,55 @@
+#ifndef _HAS_GRID_H
+#define _HAS_GRID_H
+
+#include "ptrlist.h"
+
+/*
+ * A uniform grid over the plane for finding things by position. Only cells
+ * containing something are allocated, and they are kept in a hash table
+ * keyed on cell coordinates, so the grid doesn't need to know the size of
+ * the universe beforehand.
+ *
+ * Coordinates within a cell are stored as separate x and y arrays, so that
+ * distances to a whole cell can be computed by grid_distances_squared() in
+ * one vectorizable loop. Distances are compared squared, so no square roots
+ * are needed.
+ */
+
+struct grid_cell {
+	long cx, cy;
+	long *x;
+	long *y;
+	void **data;
+	unsigned long len;
+	unsigned long alloc;
+	struct grid_cell *next;		/* Next cell in the same hash bucket */
+};
+
+struct grid {
+	long cell_size;
+	struct grid_cell **buckets;
+	unsigned long num_buckets;
+	unsigned long num_cells;
+	unsigned long num_entries;
+	long min_cx, max_cx;		/* Bounding box of all cells ever used */
+	long min_cy, max_cy;
+};
+
+int grid_init(struct grid *g, const long cell_size);
+void grid_free(struct grid *g);
+
+int grid_insert(struct grid *g, const long x, const long y, void *data);
+int grid_remove(struct grid *g, const long x, const long y, void *data);
+void* grid_lookup(const struct grid * const g, const long x, const long y);
+
+void grid_distances_squared(const long * restrict xs, const long * restrict ys,
+		const unsigned long n, const long x, const long y,
+		unsigned long * restrict result);
+
+unsigned long grid_range(const struct grid * const g, const long x, const long y,
+		const unsigned long radius, struct ptrlist * const result);
+unsigned long grid_nearest(const struct grid * const g, const long x, const long y,
+		const unsigned long k, int (*filter)(void *data, void *arg), void *arg,
+		struct ptrlist * const result);
+
+#endif
@@ -20,7 +20,7 @@ static void set_weight(struct item *item, struct config *conf)
 	item->weight = conf->l;
 }
 
-static void build_command_tree(struct list_head *root)
+static void build_command_tree(struct st_node *root)
 {
 	st_add_string(root, "price", set_base_price);
 	st_add_string(root, "weight", set_weight);
@@ -29,7 +29,7 @@ static void build_command_tree(struct list_head *root)
 int load_items_from_file(const char * const file, struct universe * const universe)
 {
 	struct list_head conf_root = LIST_HEAD_INIT(conf_root);
-	struct list_head cmd_root = LIST_HEAD_INIT(cmd_root);
+	struct st_node cmd_root = ST_ROOT_INIT;
 	struct config *conf, *child;
 	struct item *item;
 	void (*func)(struct item*, struct config*);
@@ -45,6 +45,10 @@ int load_items_from_file(const char * const file, struct universe * const univer
 		if (!item)
 			goto err;
 
+		/* Items are added first in the list, so the first one is the latest */
+		item->idx = list_empty(&universe->items) ? 0 :
+			list_first_entry(&universe->items, struct item, list)->idx + 1;
+
 		item->name = strdup(conf->key);
 		if (!item->name) {
 			free(item);
@@ -6,6 +6,7 @@
 
 struct item {
 	char *name;
+	unsigned int idx;		/* Number of items loaded before this one */
 	long weight;
 	long base_price;
 	struct list_head list;
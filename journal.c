@@ -0,0 +1,672 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+#include "cargo.h"
+#include "common.h"
+#include "item.h"
+#include "log.h"
+#include "market.h"
+#include "player.h"
+#include "port.h"
+#include "port_update.h"
+#include "price.h"
+#include "ship.h"
+#include "stringtree.h"
+#include "universe.h"
+
+/*
+ * The journal is an append-only file of state changes made since the last
+ * snapshot. Command workers only copy their records into a memory buffer,
+ * and a writer thread writes the buffer to the file and syncs it. Records
+ * arriving while the writer is busy are written in the next batch, so the
+ * number of syncs doesn't grow with the number of records.
+ *
+ * Records store the state after the change rather than the change itself,
+ * and every port remembers the last record applied to it, which is saved
+ * in snapshots. When replaying the journal on top of a snapshot, records
+ * that are already part of the snapshot are skipped. Records also store the
+ * economy tick of the port, which is caught up to it before the record is
+ * applied, so the items that weren't traded end up where they were too.
+ * The credits and cargo of the player are recorded for reference only, as
+ * players aren't kept over a restart.
+ *
+ * A record that is cut short or doesn't match its checksum ends the
+ * journal, as it must have been the last one written before a crash.
+ *
+ * The journal starts with a header telling which universe the records
+ * belong to, and which records have been removed by checkpoints. It is
+ * only replayed on top of the same universe, loaded from a snapshot that
+ * includes the removed records (or created again from the same seed, if
+ * no records have been removed).
+ */
+#define JOURNAL_MAGIC "YASTGJNL"
+#define JOURNAL_BUF_SIZE (1 << 20)
+#define JOURNAL_NAME_MAX 256
+
+struct journal_header {
+	char magic[8];
+	uint64_t universe;		/* ID of the universe */
+	uint64_t checkpoint;		/* Records up to this have been removed */
+};
+
+enum journal_record_type {
+	JOURNAL_TRADE = 1,
+};
+
+enum journal_names {
+	JOURNAL_PORT,
+	JOURNAL_ITEM,
+	JOURNAL_PLAYER,
+	JOURNAL_SHIP,
+	JOURNAL_NAMES_NUM
+};
+
+/*
+ * Followed by the names, each terminated by '\0'. The whole record is
+ * padded to a multiple of 8 bytes.
+ */
+struct journal_record {
+	uint32_t len;
+	uint32_t checksum;		/* Of everything after this field */
+	uint64_t seq;
+	int64_t time;
+	uint32_t type;
+	uint16_t name_len[JOURNAL_NAMES_NUM];	/* Including the '\0' */
+	uint32_t pad;
+	int64_t amount;			/* Moved to the ship, negative when selling */
+	int64_t price;			/* Paid by the player, negative when selling */
+	int64_t port_amount;		/* Left in the port */
+	int64_t cargo_amount;		/* In the ship */
+	int64_t credits;		/* Left to the player */
+	uint64_t tick;			/* Economy tick of the port, see port_update.c */
+};
+
+#define JOURNAL_RECORD_MAX (sizeof(struct journal_record) + JOURNAL_NAMES_NUM * JOURNAL_NAME_MAX)
+#define JOURNAL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+static struct journal {
+	char *file;
+	int fd;
+	int running;
+	int terminate;
+	pthread_t thread;
+
+	pthread_mutex_t lock;		/* Protects everything below */
+	pthread_cond_t wake_writer;
+	pthread_cond_t space;
+	char *buf;			/* Filled by the workers */
+	char *spare;			/* Written by the writer */
+	size_t len;
+	uint64_t next_seq;
+	struct journal_stats stats;
+
+	pthread_mutex_t file_lock;	/* Held while writing to fd */
+} journal = { .fd = -1 };
+
+static uint32_t checksum(const void * const data, const size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static uint32_t record_checksum(const struct journal_record * const r)
+{
+	return checksum(&r->seq, r->len - offsetof(struct journal_record, seq));
+}
+
+static int write_all(const int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static unsigned long usec_since(const struct timespec * const start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void* journal_writer(void *ptr)
+{
+	struct timespec start;
+	unsigned long usec;
+	size_t len;
+	char *buf;
+	int r;
+
+	pthread_mutex_lock(&journal.lock);
+	for (;;) {
+		while (!journal.len && !journal.terminate)
+			pthread_cond_wait(&journal.wake_writer, &journal.lock);
+
+		if (!journal.len)
+			break;
+
+		buf = journal.buf;
+		len = journal.len;
+		journal.buf = journal.spare;
+		journal.len = 0;
+		pthread_cond_broadcast(&journal.space);
+		pthread_mutex_unlock(&journal.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(&journal.file_lock);
+		r = write_all(journal.fd, buf, len);
+		if (!r)
+			r = fdatasync(journal.fd);
+		pthread_mutex_unlock(&journal.file_lock);
+		usec = usec_since(&start);
+
+		if (r)
+			log_printfn(LOG_JOURNAL, "failed writing %zu bytes to %s: %s",
+					len, journal.file, strerror(errno));
+
+		pthread_mutex_lock(&journal.lock);
+		journal.spare = buf;
+		journal.stats.commits++;
+		journal.stats.bytes += len;
+		journal.stats.errors += r ? 1 : 0;
+		journal.stats.last_usec = usec;
+		journal.stats.max_usec = MAX(journal.stats.max_usec, usec);
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	return NULL;
+}
+
+static void append(struct journal_record * const r)
+{
+	pthread_mutex_lock(&journal.lock);
+
+	if (journal.len + r->len > JOURNAL_BUF_SIZE) {
+		journal.stats.stalls++;
+		pthread_cond_signal(&journal.wake_writer);
+		while (journal.len + r->len > JOURNAL_BUF_SIZE)
+			pthread_cond_wait(&journal.space, &journal.lock);
+	}
+
+	r->seq = journal.next_seq++;
+	r->checksum = record_checksum(r);
+	memcpy(journal.buf + journal.len, r, r->len);
+
+	if (!journal.len)
+		pthread_cond_signal(&journal.wake_writer);
+	journal.len += r->len;
+	journal.stats.records++;
+
+	pthread_mutex_unlock(&journal.lock);
+}
+
+static char* add_name(struct journal_record * const r, char *pos,
+		const enum journal_names n, const char * const name)
+{
+	size_t len = MIN(strlen(name), JOURNAL_NAME_MAX - 1);
+
+	memcpy(pos, name, len);
+	pos[len] = '\0';
+	r->name_len[n] = len + 1;
+
+	return pos + len + 1;
+}
+
+void journal_trade(struct port * const port, const unsigned int i, const struct player * const player,
+		const struct ship * const ship, const long amount, const long price)
+{
+	char data[JOURNAL_RECORD_MAX] __attribute__((aligned(8)));
+	struct journal_record *r = (struct journal_record*)data;
+	struct item *item = port->stock.item[i];
+	struct cargo *cargo;
+	char *pos;
+
+	if (!journal.running)
+		return;
+
+	memset(r, 0, sizeof(*r));
+	r->time = time(NULL);
+	r->type = JOURNAL_TRADE;
+	r->amount = amount;
+	r->price = price;
+	r->port_amount = port->stock.amount[i];
+	r->tick = port->updated_tick;
+	r->credits = player->credits;
+	cargo = st_lookup_exact(&ship->cargo_names, item->name);
+	r->cargo_amount = cargo ? cargo->amount : 0;
+
+	pos = data + sizeof(*r);
+	pos = add_name(r, pos, JOURNAL_PORT, port->name);
+	pos = add_name(r, pos, JOURNAL_ITEM, item->name);
+	pos = add_name(r, pos, JOURNAL_PLAYER, player->name);
+	pos = add_name(r, pos, JOURNAL_SHIP, ship->name);
+	r->len = JOURNAL_ALIGN(pos - data);
+	memset(pos, 0, data + r->len - pos);
+
+	append(r);
+	port->journal_seq = r->seq;
+}
+
+/*
+ * Returns the length of the record at data, or 0 if there isn't a complete
+ * and valid record there.
+ */
+static size_t check_record(const char * const data, const size_t len)
+{
+	const struct journal_record *r = (const struct journal_record*)data;
+	const char *name;
+	size_t names = 0;
+
+	if (len < sizeof(*r) || r->len < sizeof(*r) || r->len > len || r->len % 8)
+		return 0;
+	if (r->checksum != record_checksum(r))
+		return 0;
+
+	name = data + sizeof(*r);
+	for (int n = 0; n < JOURNAL_NAMES_NUM; n++) {
+		names += r->name_len[n];
+		if (!r->name_len[n] || sizeof(*r) + names > r->len || name[r->name_len[n] - 1] != '\0')
+			return 0;
+		name += r->name_len[n];
+	}
+
+	return r->len;
+}
+
+static int write_header(const int fd, const uint64_t checkpoint)
+{
+	struct journal_header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+	h.universe = univ.id;
+	h.checkpoint = checkpoint;
+
+	return write_all(fd, (const char*)&h, sizeof(h));
+}
+
+/*
+ * Returns 0 if the journal starting with h can be replayed on top of the
+ * universe.
+ */
+static int check_header(const struct journal_header * const h)
+{
+	if (memcmp(h->magic, JOURNAL_MAGIC, sizeof(h->magic))) {
+		log_printfn(LOG_JOURNAL, "%s is not a journal", journal.file);
+		return -1;
+	}
+
+	if (h->universe != univ.id) {
+		log_printfn(LOG_JOURNAL, "%s belongs to universe %llu, not %llu",
+				journal.file, (unsigned long long)h->universe,
+				(unsigned long long)univ.id);
+		return -1;
+	}
+
+	if (h->checkpoint > univ.journal_seq) {
+		log_printfn(LOG_JOURNAL, "%s needs a snapshot with records up to %llu, the universe has %llu",
+				journal.file, (unsigned long long)h->checkpoint,
+				(unsigned long long)univ.journal_seq);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int replay_trade(const struct journal_record * const r)
+{
+	const char *port_name = (const char*)(r + 1);
+	const char *item_name = port_name + r->name_len[JOURNAL_PORT];
+	struct port *port;
+	long i;
+
+	pthread_rwlock_rdlock(&univ.portnames_lock);
+	port = st_lookup_exact(&univ.portnames, port_name);
+	pthread_rwlock_unlock(&univ.portnames_lock);
+	if (!port)
+		return -1;
+
+	pthread_rwlock_wrlock(&port->items_lock);
+	i = port_item_index(port, item_name);
+	if (i < 0 || r->port_amount < 0 || r->port_amount > port->stock.max[i]) {
+		pthread_rwlock_unlock(&port->items_lock);
+		return -1;
+	}
+	if (r->seq > port->journal_seq) {
+		/* The rest of the stock goes on from the snapshot as it did before */
+		port_catch_up_to(port, r->tick);
+		port->stock.amount[i] = r->port_amount;
+		port->journal_seq = r->seq;
+		price_update(&port->stock);
+		market_update_port(port);
+	}
+	pthread_rwlock_unlock(&port->items_lock);
+
+	return 0;
+}
+
+static int read_file(const int fd, char **data, size_t *len)
+{
+	struct stat st;
+	ssize_t r;
+	size_t pos = 0;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	*len = st.st_size;
+	*data = malloc(MAX(*len, 1));
+	if (!*data)
+		return -1;
+
+	while (pos < *len) {
+		r = pread(fd, *data + pos, *len - pos, pos);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			free(*data);
+			return -1;
+		}
+		pos += r;
+	}
+
+	return 0;
+}
+
+/*
+ * Applies the journal to the universe, and cuts off anything after the last
+ * valid record so new records are appended right after it. A journal that
+ * is empty, or was cut short while writing its header, is started over.
+ */
+static int replay(const int fd, uint64_t * const last_seq)
+{
+	const struct journal_record *r;
+	unsigned long applied = 0, skipped = 0;
+	size_t len, pos = sizeof(struct journal_header), rlen;
+	char *data;
+
+	if (read_file(fd, &data, &len))
+		return -1;
+
+	if (len < sizeof(struct journal_header)) {
+		free(data);
+		if (ftruncate(fd, 0) || write_header(fd, univ.journal_seq) || fdatasync(fd) ||
+				sync_dir_of(journal.file))
+			return -1;
+		return 0;
+	}
+
+	if (check_header((const struct journal_header*)data)) {
+		free(data);
+		return -1;
+	}
+
+	while ((rlen = check_record(data + pos, len - pos))) {
+		r = (const struct journal_record*)(data + pos);
+
+		if (r->type == JOURNAL_TRADE && !replay_trade(r))
+			applied++;
+		else
+			skipped++;
+
+		*last_seq = MAX(*last_seq, r->seq);
+		pos += rlen;
+	}
+
+	free(data);
+
+	if (pos != len) {
+		log_printfn(LOG_JOURNAL, "ignoring %zu bytes of incomplete records at the end of %s",
+				len - pos, journal.file);
+		if (ftruncate(fd, pos))
+			return -1;
+	}
+
+	if (lseek(fd, 0, SEEK_END) < 0)
+		return -1;
+
+	log_printfn(LOG_JOURNAL, "replayed %lu records from %s, skipped %lu for unknown ports or items or bad amounts",
+			applied, journal.file, skipped);
+
+	return 0;
+}
+
+/*
+ * Replays the journal in file on top of the universe, and then starts
+ * appending to it.
+ */
+int journal_open(const char * const file)
+{
+	sigset_t old, new;
+	struct port *port;
+	uint64_t last_seq = 0;
+	unsigned long lh;
+
+	journal.file = strdup(file);
+	if (!journal.file)
+		goto err;
+
+	journal.fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (journal.fd < 0) {
+		log_printfn(LOG_JOURNAL, "could not open %s: %s", file, strerror(errno));
+		goto err_free_file;
+	}
+
+	if (replay(journal.fd, &last_seq))
+		goto err_close;
+
+	/* A snapshot can be newer than the journal it was saved with */
+	last_seq = MAX(last_seq, univ.journal_seq);
+	ptrlist_for_each_entry(port, &univ.ports, lh)
+		last_seq = MAX(last_seq, port->journal_seq);
+	journal.next_seq = last_seq + 1;
+	journal.len = 0;
+	journal.terminate = 0;
+	memset(&journal.stats, 0, sizeof(journal.stats));
+
+	journal.buf = malloc(JOURNAL_BUF_SIZE);
+	journal.spare = malloc(JOURNAL_BUF_SIZE);
+	if (!journal.buf || !journal.spare)
+		goto err_free_bufs;
+
+	if (pthread_mutex_init(&journal.lock, NULL))
+		goto err_free_bufs;
+	if (pthread_mutex_init(&journal.file_lock, NULL))
+		goto err_free_lock;
+	if (pthread_cond_init(&journal.wake_writer, NULL))
+		goto err_free_file_lock;
+	if (pthread_cond_init(&journal.space, NULL))
+		goto err_free_wake;
+
+	sigfillset(&new);
+	if (pthread_sigmask(SIG_SETMASK, &new, &old))
+		goto err_free_space;
+	if (pthread_create(&journal.thread, NULL, journal_writer, NULL)) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		goto err_free_space;
+	}
+	if (pthread_sigmask(SIG_SETMASK, &old, NULL))
+		die("%s", "Failed restoring signals after starting journal thread");
+
+	journal.running = 1;
+
+	return 0;
+
+err_free_space:
+	pthread_cond_destroy(&journal.space);
+err_free_wake:
+	pthread_cond_destroy(&journal.wake_writer);
+err_free_file_lock:
+	pthread_mutex_destroy(&journal.file_lock);
+err_free_lock:
+	pthread_mutex_destroy(&journal.lock);
+err_free_bufs:
+	free(journal.buf);
+	free(journal.spare);
+err_close:
+	close(journal.fd);
+	journal.fd = -1;
+err_free_file:
+	free(journal.file);
+err:
+	return -1;
+}
+
+/*
+ * Writes everything appended so far and stops the writer.
+ */
+void journal_close(void)
+{
+	if (!journal.running)
+		return;
+
+	pthread_mutex_lock(&journal.lock);
+	journal.terminate = 1;
+	pthread_cond_signal(&journal.wake_writer);
+	pthread_mutex_unlock(&journal.lock);
+	pthread_join(journal.thread, NULL);
+	journal.running = 0;
+
+	close(journal.fd);
+	journal.fd = -1;
+	free(journal.file);
+	free(journal.buf);
+	free(journal.spare);
+
+	pthread_cond_destroy(&journal.space);
+	pthread_cond_destroy(&journal.wake_writer);
+	pthread_mutex_destroy(&journal.file_lock);
+	pthread_mutex_destroy(&journal.lock);
+}
+
+/*
+ * Returns the sequence number of the last record appended, or 0 if the
+ * journal isn't open.
+ */
+uint64_t journal_seq(void)
+{
+	uint64_t seq;
+
+	if (!journal.running)
+		return 0;
+
+	pthread_mutex_lock(&journal.lock);
+	seq = journal.next_seq - 1;
+	pthread_mutex_unlock(&journal.lock);
+
+	return seq;
+}
+
+/*
+ * Removes all records up to and including seq from the journal, once a
+ * snapshot that was started after they were appended has been saved. The
+ * remaining records are copied to a new file, which replaces the journal.
+ */
+int journal_checkpoint(const uint64_t seq)
+{
+	const struct journal_record *r;
+	size_t len, pos = 0, rlen;
+	unsigned long kept = 0;
+	char *data = NULL, *tmp = NULL;
+	int fd = -1;
+
+	if (!journal.running)
+		return 0;
+
+	pthread_mutex_lock(&journal.file_lock);
+
+	if (read_file(journal.fd, &data, &len))
+		goto err;
+
+	if (asprintf(&tmp, "%s.tmp", journal.file) < 0) {
+		tmp = NULL;
+		goto err;
+	}
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto err;
+
+	if (write_header(fd, seq))
+		goto err_unlink;
+
+	pos = sizeof(struct journal_header);
+	while ((rlen = check_record(data + pos, len - pos))) {
+		r = (const struct journal_record*)(data + pos);
+		if (r->seq > seq) {
+			if (write_all(fd, data + pos, rlen))
+				goto err_unlink;
+			kept++;
+		}
+		pos += rlen;
+	}
+
+	if (fdatasync(fd) || rename(tmp, journal.file))
+		goto err_unlink;
+
+	/* The new journal has replaced the old one, so it must be appended to */
+	close(journal.fd);
+	journal.fd = fd;
+
+	if (sync_dir_of(journal.file))
+		goto err;
+
+	pthread_mutex_unlock(&journal.file_lock);
+
+	log_printfn(LOG_JOURNAL, "checkpoint at record %llu, %lu newer records kept",
+			(unsigned long long)seq, kept);
+
+	free(tmp);
+	free(data);
+	return 0;
+
+err_unlink:
+	close(fd);
+	unlink(tmp);
+err:
+	pthread_mutex_unlock(&journal.file_lock);
+	log_printfn(LOG_JOURNAL, "checkpoint of %s failed: %s", journal.file, strerror(errno));
+	free(tmp);
+	free(data);
+	return -1;
+}
+
+void journal_get_stats(struct journal_stats *stats)
+{
+	if (!journal.running) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	*stats = journal.stats;
+	pthread_mutex_unlock(&journal.lock);
+}
@@ -0,0 +1,32 @@
+#ifndef _HAS_JOURNAL_H
+#define _HAS_JOURNAL_H
+
+#include <stdint.h>
+
+struct player;
+struct port;
+struct ship;
+
+struct journal_stats {
+	unsigned long records;
+	unsigned long commits;		/* Batches written and synced */
+	unsigned long bytes;
+	unsigned long stalls;		/* Appends that waited for a full buffer */
+	unsigned long errors;
+	unsigned long last_usec;	/* Time to write and sync the last batch */
+	unsigned long max_usec;
+};
+
+int journal_open(const char * const file);
+void journal_close(void);
+uint64_t journal_seq(void);
+int journal_checkpoint(const uint64_t seq);
+void journal_get_stats(struct journal_stats *stats);
+
+/*
+ * Must be called with port->items_lock and ship->cargo_lock write-held
+ */
+void journal_trade(struct port * const port, const unsigned int i, const struct player * const player,
+		const struct ship * const ship, const long amount, const long price);
+
+#endif
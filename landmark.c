@@ -0,0 +1,246 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "landmark.h"
+#include "log.h"
+#include "ptrlist.h"
+#include "route.h"
+#include "system.h"
+#include "universe.h"
+
+/*
+ * The landmark tables make route searches fast (the ALT technique). By the
+ * triangle inequality, the distance between two systems is at least the
+ * difference of their distances to any landmark, and the largest such
+ * difference is a far better estimate than the straight distance. The
+ * landmarks are picked one at a time as the system farthest from the ones
+ * already picked, so they end up on the edges of the universe where they
+ * give the best estimates.
+ *
+ * Only the largest group of systems linked to each other gets landmarks.
+ * Every system is also given the number of its group, so a search between
+ * two systems that aren't linked in any way can be refused at once.
+ *
+ * Distances are stored as whole light years, rounded down, which keeps the
+ * tables at half the size. As the difference of two rounded distances can
+ * be one light year too much, one light year is taken off the estimate.
+ */
+
+void landmarks_init(struct landmarks *lm)
+{
+	memset(lm, 0, sizeof(*lm));
+}
+
+void landmarks_free(struct landmarks *lm)
+{
+	free(lm->systems);
+	free(lm->component);
+	free(lm->distance);
+	free(lm->jumps);
+	landmarks_init(lm);
+}
+
+int landmarks_alloc(struct landmarks *lm, const unsigned int num, const unsigned long num_systems)
+{
+	landmarks_free(lm);
+
+	lm->num = num;
+	lm->num_systems = num_systems;
+	lm->systems = malloc(MAX(num, 1) * sizeof(*lm->systems));
+	lm->component = malloc(MAX(num_systems, 1) * sizeof(*lm->component));
+	lm->distance = malloc(MAX(num * num_systems, 1) * sizeof(*lm->distance));
+	lm->jumps = malloc(MAX(num * num_systems, 1) * sizeof(*lm->jumps));
+
+	if (!lm->systems || !lm->component || !lm->distance || !lm->jumps) {
+		landmarks_free(lm);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Numbers the groups of systems linked to each other and returns the number
+ * of the largest one, storing its size in size.
+ */
+static uint32_t find_components(uint32_t * const component, const unsigned long num_systems,
+		uint32_t * const queue, unsigned long *size)
+{
+	struct system *system, *link;
+	unsigned long head, tail, lh;
+	uint32_t num = 0, largest = 0;
+
+	for (unsigned long i = 0; i < num_systems; i++)
+		component[i] = LANDMARK_UNREACHABLE;
+
+	*size = 0;
+	for (unsigned long i = 0; i < num_systems; i++) {
+		if (component[i] != LANDMARK_UNREACHABLE)
+			continue;
+
+		component[i] = num;
+		queue[0] = i;
+		for (head = 0, tail = 1; head < tail; head++) {
+			system = ptrlist_entry(&univ.systems, queue[head]);
+			ptrlist_for_each_entry(link, &system->links, lh) {
+				if (component[link->idx] != LANDMARK_UNREACHABLE)
+					continue;
+				component[link->idx] = num;
+				queue[tail++] = link->idx;
+			}
+		}
+
+		if (tail > *size) {
+			*size = tail;
+			largest = num;
+		}
+		num++;
+	}
+
+	return largest;
+}
+
+static void store_costs(uint32_t * const table, const unsigned long * const cost,
+		const unsigned int num, const unsigned int landmark,
+		const unsigned long num_systems, const unsigned long unit)
+{
+	for (unsigned long i = 0; i < num_systems; i++) {
+		if (cost[i] == ULONG_MAX)
+			table[i * num + landmark] = LANDMARK_UNREACHABLE;
+		else
+			table[i * num + landmark] = MIN(cost[i] / unit, LANDMARK_UNREACHABLE - 1);
+	}
+}
+
+static int pick_landmarks(struct landmarks * const lm, const uint32_t largest,
+		unsigned long * const cost, unsigned long * const nearest)
+{
+	struct system *system;
+	unsigned long far;
+
+	/* Start from any system in the largest group, and go to the farthest */
+	for (unsigned long i = 0; i < lm->num_systems; i++) {
+		if (lm->component[i] == largest) {
+			if (route_costs(ptrlist_entry(&univ.systems, i), ROUTE_DISTANCE, nearest))
+				return -1;
+			break;
+		}
+	}
+
+	for (unsigned int k = 0; k < lm->num; k++) {
+		far = 0;
+		for (unsigned long i = 0; i < lm->num_systems; i++) {
+			if (lm->component[i] == largest && nearest[i] >= far) {
+				far = nearest[i];
+				lm->systems[k] = i;
+			}
+		}
+		system = ptrlist_entry(&univ.systems, lm->systems[k]);
+
+		if (route_costs(system, ROUTE_DISTANCE, cost))
+			return -1;
+		store_costs(lm->distance, cost, lm->num, k, lm->num_systems, TICK_PER_LY);
+		for (unsigned long i = 0; i < lm->num_systems; i++)
+			nearest[i] = MIN(nearest[i], cost[i]);
+
+		if (route_costs(system, ROUTE_JUMPS, cost))
+			return -1;
+		store_costs(lm->jumps, cost, lm->num, k, lm->num_systems, 1);
+	}
+
+	return 0;
+}
+
+/*
+ * Picks up to num landmarks among the systems in univ and fills in the
+ * tables. Must be called when the hyperspace links are final, i.e. after
+ * civ_spawncivs(). The tables in lm are only replaced once the new ones are
+ * complete.
+ */
+int landmarks_build(struct landmarks *lm, const unsigned int num)
+{
+	const unsigned long num_systems = ptrlist_len(&univ.systems);
+	unsigned long *cost = NULL, *nearest = NULL, size;
+	uint32_t largest, *component = NULL, *queue = NULL;
+	struct landmarks new;
+	int r = -1;
+
+	landmarks_init(&new);
+
+	component = malloc(MAX(num_systems, 1) * sizeof(*component));
+	queue = malloc(MAX(num_systems, 1) * sizeof(*queue));
+	cost = malloc(MAX(num_systems, 1) * sizeof(*cost));
+	nearest = malloc(MAX(num_systems, 1) * sizeof(*nearest));
+	if (!component || !queue || !cost || !nearest)
+		goto out;
+
+	largest = find_components(component, num_systems, queue, &size);
+
+	if (landmarks_alloc(&new, MIN(num, size), num_systems))
+		goto out;
+	memcpy(new.component, component, num_systems * sizeof(*component));
+
+	if (pick_landmarks(&new, largest, cost, nearest)) {
+		landmarks_free(&new);
+		goto out;
+	}
+
+	landmarks_free(lm);
+	*lm = new;
+	r = 0;
+
+	log_printfn(LOG_MAIN, "picked %u landmarks among %lu linked systems, %lu systems in all",
+			lm->num, size, num_systems);
+
+out:
+	free(nearest);
+	free(cost);
+	free(queue);
+	free(component);
+	return r;
+}
+
+/*
+ * Returns 0 if there is no way by hyperspace between the systems. Without
+ * tables, any two systems might be.
+ */
+int landmarks_connected(const struct landmarks * const lm,
+		const struct system * const a, const struct system * const b)
+{
+	if (a->idx >= lm->num_systems || b->idx >= lm->num_systems)
+		return 1;
+
+	return lm->component[a->idx] == lm->component[b->idx];
+}
+
+/*
+ * Returns a distance in ticks, or a number of jumps, that the shortest way
+ * between the systems is at least.
+ */
+unsigned long landmarks_bound(const struct landmarks * const lm,
+		const struct system * const a, const struct system * const b,
+		const enum route_metric metric)
+{
+	const uint32_t *table = metric == ROUTE_JUMPS ? lm->jumps : lm->distance;
+	const uint32_t *x, *y;
+	uint32_t bound = 0, d;
+
+	if (a->idx >= lm->num_systems || b->idx >= lm->num_systems)
+		return 0;
+
+	x = &table[a->idx * lm->num];
+	y = &table[b->idx * lm->num];
+	for (unsigned int i = 0; i < lm->num; i++) {
+		if (x[i] == LANDMARK_UNREACHABLE || y[i] == LANDMARK_UNREACHABLE)
+			continue;
+		d = x[i] > y[i] ? x[i] - y[i] : y[i] - x[i];
+		bound = MAX(bound, d);
+	}
+
+	if (metric == ROUTE_JUMPS)
+		return bound;
+
+	return bound > 1 ? (bound - 1) * (unsigned long)TICK_PER_LY : 0;
+}
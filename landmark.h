@@ -0,0 +1,36 @@
+#ifndef _HAS_LANDMARK_H
+#define _HAS_LANDMARK_H
+
+#include <stdint.h>
+#include "route.h"
+
+#define LANDMARKS_NUM 16
+#define LANDMARK_UNREACHABLE UINT32_MAX
+
+struct system;
+
+/*
+ * The distances from a few landmark systems to every system, in whole light
+ * years and in jumps. The tables are indexed by system->idx * num + the
+ * landmark, so the distances of one system are next to each other.
+ */
+struct landmarks {
+	unsigned int num;
+	unsigned long num_systems;
+	uint32_t *systems;		/* Index of each landmark system */
+	uint32_t *component;		/* Systems linked to each other share one */
+	uint32_t *distance;
+	uint32_t *jumps;
+};
+
+void landmarks_init(struct landmarks *lm);
+void landmarks_free(struct landmarks *lm);
+int landmarks_alloc(struct landmarks *lm, const unsigned int num, const unsigned long num_systems);
+int landmarks_build(struct landmarks *lm, const unsigned int num);
+int landmarks_connected(const struct landmarks * const lm,
+		const struct system * const a, const struct system * const b);
+unsigned long landmarks_bound(const struct landmarks * const lm,
+		const struct system * const a, const struct system * const b,
+		const enum route_metric metric);
+
+#endif
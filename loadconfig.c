@@ -59,7 +59,7 @@ mem_err:
 
 static int build_list_of_file_names(struct config_type configs[], const size_t len, const struct list_head *conf_root)
 {
-	struct list_head cmd_root = LIST_HEAD_INIT(cmd_root);
+	struct st_node cmd_root = ST_ROOT_INIT;
 	for (size_t i = 0; i < len; i++) {
 		if (st_add_string(&cmd_root, configs[i].key, &configs[i].head))
 			goto err;
@@ -130,7 +130,7 @@ static int do_load_from_files(const struct config_type configs[], const size_t l
  */
 static int load_names_from_files(const struct config_type configs[], const size_t len)
 {
-	struct list_head cmd_root = LIST_HEAD_INIT(cmd_root);
+	struct st_node cmd_root = ST_ROOT_INIT;
 	const char *constellations = NULL;
 	const char *first = NULL;
 	const char *sur = NULL;
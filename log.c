@@ -1,78 +1,332 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include <time.h>
 #include "common.h"
 #include "log.h"
 
 #define CTIME_LEN 26		/* From ctime() */
 
-static pthread_mutex_t log_mutex;
+/*
+ * Every thread logging something gets its own ring of log entries, which
+ * only that thread writes to and only the flusher thread reads from, so
+ * logging doesn't need any locks. The flusher formats the timestamps and
+ * writes the entries to the log file every LOG_FLUSH_INTERVAL_MS.
+ *
+ * If a ring is full, the entry is dropped and counted instead of making
+ * the thread wait. The flusher logs how many entries were dropped, and is
+ * woken early when a ring is half full.
+ * Messages longer than LOG_MSG_LEN are truncated.
+ */
+#define LOG_RING_SIZE 512		/* Must be a power of two */
+#define LOG_MSG_LEN 232
+#define LOG_FLUSH_INTERVAL_MS 100
+
+struct log_entry {
+	time_t time;
+	enum log_subsystems subsystem;
+	char msg[LOG_MSG_LEN];
+};
+
+struct log_ring {
+	unsigned long head;		/* Written by the owning thread */
+	unsigned long tail;		/* Written by the flusher */
+	unsigned long dropped;
+	unsigned long dropped_reported;
+	int orphaned;			/* The owning thread has exited */
+	struct log_ring *next;
+	struct log_entry entries[LOG_RING_SIZE];
+};
+
 static FILE *log_fd;
 static char log_timestr[CTIME_LEN];
+static time_t log_timestr_time = -1;
+
+static pthread_mutex_t write_lock;	/* Held while writing to log_fd */
+static pthread_mutex_t rings_lock;	/* Protects the list of rings */
+static struct log_ring *rings;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring;
+
+static pthread_t flusher;
+static int flusher_running;
+static int terminate;
+static pthread_mutex_t flusher_lock;
+static pthread_cond_t flusher_cond;
 
 static const char subsystems[LOG_SUBSYSTEM_NUM][16] = {
 	"config",
 	"connection",
+	"journal",
 	"main",
 	"panic",
 	"port_update",
 	"server"
 };
 
-void log_init(const char * const name)
+/*
+ * ctime_r() is expensive, so the formatted time is only updated when the
+ * second changes. Must be called with write_lock held.
+ */
+static const char* format_time(const time_t t)
+{
+	int i = -1;
+
+	if (t == log_timestr_time)
+		return log_timestr;
+
+	ctime_r(&t, &log_timestr[0]);
+	while (log_timestr[++i] != '\n');
+	log_timestr[i] = '\0';
+	log_timestr_time = t;
+
+	return log_timestr;
+}
+
+/*
+ * We don't check the return codes from the fprintf()s, this is a feature.
+ * Must be called with write_lock held.
+ */
+static void drain_ring(struct log_ring *ring)
+{
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	struct log_entry *e;
+
+	for (unsigned long i = ring->tail; i != head; i++) {
+		e = &ring->entries[i & (LOG_RING_SIZE - 1)];
+		fprintf(log_fd, "%s %s: %s\n", format_time(e->time), subsystems[e->subsystem], e->msg);
+	}
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+	if (dropped != ring->dropped_reported) {
+		fprintf(log_fd, "%s log: %lu messages dropped, the log buffer was full\n",
+				format_time(time(NULL)), dropped - ring->dropped_reported);
+		ring->dropped_reported = dropped;
+	}
+}
+
+/*
+ * Must be called with write_lock held.
+ */
+static void drain_all_rings()
+{
+	struct log_ring *ring, **prev;
+
+	pthread_mutex_lock(&rings_lock);
+
+	prev = &rings;
+	while ((ring = *prev)) {
+		drain_ring(ring);
+
+		if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE)) {
+			*prev = ring->next;
+			free(ring);
+		} else {
+			prev = &ring->next;
+		}
+	}
+
+	pthread_mutex_unlock(&rings_lock);
+
+	fflush(log_fd);
+}
+
+static void orphan_ring(void *ptr)
+{
+	struct log_ring *ring = ptr;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring* get_ring()
 {
-	if (pthread_mutex_init(&log_mutex, NULL) != 0)
+	struct log_ring *ring;
+
+	if (my_ring)
+		return my_ring;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, offsetof(struct log_ring, entries));
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+
+	return ring;
+}
+
+static void* log_flusher(void *ptr)
+{
+	struct timespec next;
+
+	pthread_mutex_lock(&flusher_lock);
+	while (!terminate) {
+		clock_gettime(CLOCK_REALTIME, &next);
+		next.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&flusher_cond, &flusher_lock, &next);
+		pthread_mutex_unlock(&flusher_lock);
+
+		pthread_mutex_lock(&write_lock);
+		drain_all_rings();
+		pthread_mutex_unlock(&write_lock);
+
+		pthread_mutex_lock(&flusher_lock);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+
+	return NULL;
+}
+
+static void start_flusher()
+{
+	sigset_t old, new;
+
+	if (pthread_mutex_init(&write_lock, NULL) != 0)
+		die("%s", "Failed initializing log mutex");
+	if (pthread_mutex_init(&rings_lock, NULL) != 0)
+		die("%s", "Failed initializing log mutex");
+	if (pthread_mutex_init(&flusher_lock, NULL) != 0)
 		die("%s", "Failed initializing log mutex");
+	if (pthread_cond_init(&flusher_cond, NULL) != 0)
+		die("%s", "Failed initializing log condition");
+	if (pthread_key_create(&ring_key, orphan_ring) != 0)
+		die("%s", "Failed creating log thread key");
+
+	terminate = 0;
+
+	sigfillset(&new);
+	if (pthread_sigmask(SIG_SETMASK, &new, &old))
+		die("%s", "Failed blocking signals for log thread");
+	if (pthread_create(&flusher, NULL, log_flusher, NULL))
+		die("%s", "Failed starting log thread");
+	if (pthread_sigmask(SIG_SETMASK, &old, NULL))
+		die("%s", "Failed restoring signals after starting log thread");
+
+	flusher_running = 1;
+}
+
+void log_init(const char * const name)
+{
 	if ((log_fd = fopen(name, "a+")) == NULL)
 		die("Failed creating or opening log file %s", name);
+	start_flusher();
 }
 
 void log_init_stdout()
 {
-	if (pthread_mutex_init(&log_mutex, NULL) != 0)
-		die("%s", "Failed initializing log mutex");
 	log_fd = stdout;
+	start_flusher();
 }
 
 void log_close()
 {
-	pthread_mutex_lock(&log_mutex);
+	struct log_ring *ring, *next;
+
+	if (!flusher_running)
+		return;
+
+	pthread_mutex_lock(&flusher_lock);
+	terminate = 1;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+	flusher_running = 0;
+
+	pthread_mutex_lock(&write_lock);
+	drain_all_rings();
 	if (log_fd != stdout)
 		fclose(log_fd);
 	log_fd = NULL;
-	pthread_mutex_unlock(&log_mutex);
-	pthread_mutex_destroy(&log_mutex);
+	pthread_mutex_unlock(&write_lock);
+
+	for (ring = rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	rings = NULL;
+	my_ring = NULL;
+
+	pthread_key_delete(ring_key);
+	pthread_cond_destroy(&flusher_cond);
+	pthread_mutex_destroy(&flusher_lock);
+	pthread_mutex_destroy(&rings_lock);
+	pthread_mutex_destroy(&write_lock);
+}
+
+/*
+ * Panics are written at once, after everything logged before them, as the
+ * process is about to exit.
+ */
+static void log_panic(const char *format, va_list ap)
+{
+	pthread_mutex_lock(&write_lock);
+	if (log_fd) {
+		drain_all_rings();
+		fprintf(log_fd, "%s %s: ", format_time(time(NULL)), subsystems[LOG_PANIC]);
+		vfprintf(log_fd, format, ap);
+		fprintf(log_fd, "%s", "\n");
+		fflush(log_fd);
+	}
+	pthread_mutex_unlock(&write_lock);
 }
 
 void __attribute__((format(printf, 2, 3))) log_printfn(const enum log_subsystems subsystem,
 		const char *format, ...)
 {
-	/* We don't check the return codes from the fprintf() or the fflush(),
-	   this is a feature. */
 	va_list ap;
-	time_t now = time(NULL);
-	int i = -1;
+	struct log_ring *ring;
+	struct log_entry *e;
+	unsigned long head, used;
 
 	assert(subsystem < LOG_SUBSYSTEM_NUM);
 
-	if (!log_fd)
+	if (!log_fd || !flusher_running)
 		return;
 
-	pthread_mutex_lock(&log_mutex);
+	if (subsystem == LOG_PANIC) {
+		va_start(ap, format);
+		log_panic(format, ap);
+		va_end(ap);
+		return;
+	}
 
-	ctime_r(&now, &log_timestr[0]);
-	while (log_timestr[++i] != '\n');
-	log_timestr[i] = '\0';
+	ring = get_ring();
+	if (!ring)
+		return;
 
-	fprintf(log_fd, "%s %s: ", log_timestr, subsystems[subsystem]);
+	head = ring->head;
+	used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used >= LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	e = &ring->entries[head & (LOG_RING_SIZE - 1)];
+	e->time = time(NULL);
+	e->subsystem = subsystem;
 	va_start(ap, format);
-	vfprintf(log_fd, format, ap);
+	vsnprintf(e->msg, sizeof(e->msg), format, ap);
 	va_end(ap);
-	fprintf(log_fd, "%s", "\n");
-	fflush(log_fd);
 
-	pthread_mutex_unlock(&log_mutex);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* Don't wait for the flusher's next round if we're filling up fast */
+	if (used == LOG_RING_SIZE / 2)
+		pthread_cond_signal(&flusher_cond);
 }
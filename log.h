@@ -4,6 +4,7 @@
 enum log_subsystems {
 	LOG_CONFIG,
 	LOG_CONN,
+	LOG_JOURNAL,
 	LOG_MAIN,
 	LOG_PANIC,
 	LOG_PORT_UPDATE,
@@ -26,10 +26,13 @@
 #include "port_type.h"
 #include "inventory.h"
 #include "item.h"
+#include "journal.h"
+#include "market.h"
 #include "player.h"
 #include "planet.h"
 #include "planet_type.h"
 #include "ship_type.h"
+#include "snapshot.h"
 #include "universe.h"
 #include "parseconfig.h"
 #include "civ.h"
@@ -39,20 +42,60 @@
 #define PORT "2049"
 #define BACKLOG 16
 
-const char* options = "d";
+const char* options = "de:j:l:s:S:u:w:";
 int detached = 0;
+uint64_t seed;
+int seed_given = 0;
+char *snapshot_file = NULL;
+char *journal_file = NULL;
+char *save_file = NULL;
 
 extern int sockfd;
 
-static int parse_command_line(int argc, char **argv)
+static int parse_command_line(int argc, char **argv, struct server * const server)
 {
-	char c;
+	char c, *end;
+	long l;
 	while ((c = getopt(argc, argv, options)) > 0) {
 		switch (c) {
 		case 'd':
 			printf("Detached mode\n");
 			detached = 1;
 			break;
+		case 'e':
+			if (!strcmp(optarg, "periodic"))
+				server->economy = PORT_UPDATE_PERIODIC;
+			else if (!strcmp(optarg, "lazy"))
+				server->economy = PORT_UPDATE_LAZY;
+			else
+				return -1;
+			break;
+		case 'j':
+			journal_file = optarg;
+			break;
+		case 'l':
+			if (str_to_long(optarg, &l) || l < 1 || l > UINT16_MAX)
+				return -1;
+			server->num_loops = l;
+			break;
+		case 's':
+			/* Logged seeds use all 64 bits, so str_to_long() won't do */
+			seed = strtoull(optarg, &end, 10);
+			if (end == optarg || *end != '\0')
+				return -1;
+			seed_given = 1;
+			break;
+		case 'S':
+			save_file = optarg;
+			break;
+		case 'u':
+			snapshot_file = optarg;
+			break;
+		case 'w':
+			if (str_to_long(optarg, &l) || l < 1 || l > UINT16_MAX)
+				return -1;
+			server->num_workers = l;
+			break;
 		default:
 			return -1;
 		}
@@ -68,11 +111,16 @@ static void open_log_file()
 	log_printfn(LOG_MAIN, "This is %s, built %s %s", PACKAGE_VERSION, __DATE__, __TIME__);
 }
 
-static int create_universe(struct universe * const u)
+static int create_universe(struct universe * const u, const unsigned int num_threads)
 {
+	if (snapshot_file) {
+		printf("Loading universe from %s\n", snapshot_file);
+		return snapshot_load(u, snapshot_file);
+	}
+
 	printf("Creating universe\n");
 
-	if (universe_genesis(u))
+	if (universe_genesis(u, num_threads))
 		return -1;
 
 	return 0;
@@ -116,11 +164,17 @@ int main(int argc, char **argv)
 
 	open_log_file();
 
-	if (parse_command_line(argc, argv))
+	initialize_server(&server);
+	if (parse_command_line(argc, argv, &server))
 		die("%s", "Syntax error on command line");
 
 	srand(time(NULL));
-	mtrandom_init();
+	if (seed_given)
+		mtrandom_init_seed(seed);
+	else
+		mtrandom_init();
+	log_printfn(LOG_MAIN, "random seed is %llu, use -s to create the same universe again",
+			(unsigned long long)mtrandom_seed());
 
 	universe_init(&univ);
 	names_init(&univ.avail_constellations);
@@ -130,13 +184,24 @@ int main(int argc, char **argv)
 	if (parse_config_files(&univ))
 		die("%s", "Could not parse config files");
 
-	if (create_universe(&univ))
+	if (create_universe(&univ, server.num_workers))
 		die("%s", "Could not create universe");
 
+	if (market_build())
+		die("%s", "Could not build the market index");
+
+	/* Replaying the journal keeps the market index up to date */
+	if (journal_file && journal_open(journal_file))
+		die("Could not open journal %s", journal_file);
+
+	if (player_cli_init())
+		die("%s", "Could not create player commands");
+
 	if (start_server(&server))
 		die("%s", "Could not start server thread");
 
 	console_init(&console, &server);
+	console.snapshot_file = save_file;
 	if (start_console(&console))
 		die("%s", "Could not start console thread");
 
@@ -150,13 +215,16 @@ int main(int argc, char **argv)
 	stop_server(&server);
 	pthread_join(console.thread, NULL);
 	pthread_join(server.thread, NULL);
+	journal_close();
 
 	log_printfn(LOG_MAIN, "cleaning up");
 	printf("Cleaning up ... ");
 
 	console_free(&console);
+	player_cli_free();
+	market_free();
 
-	struct list_head *lh;
+	unsigned long lh;
 	struct system *s;
 	ptrlist_for_each_entry(s, &univ.systems, lh) {
 		system_free(s);
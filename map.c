@@ -59,7 +59,7 @@ static void plot_items_in_map(struct list_head *items,
 	list_for_each_entry(map_item, items, list) {
 		row++;
 
-		if (row > buf_size_y)
+		if (row >= buf_size_y)
 			break;
 
 		if (row == 1)
@@ -104,7 +104,7 @@ char* generate_map(char * const out, const size_t len, struct system *origin,
 	const unsigned int max_y = y_size + 3;
 
 	struct ptrlist neigh;
-	struct list_head *lh;
+	unsigned long lh;
 	struct system *s;
 	char buf[max_y][max_x];
 
@@ -124,7 +124,7 @@ char* generate_map(char * const out, const size_t len, struct system *origin,
 	get_neighbouring_systems(&neigh, origin, radius);
 	ptrlist_push(&neigh, origin);
 
-	ptrlist_sort(&neigh, origin, cmp_system_distances);
+	sort_systems_by_distance(&neigh, origin);
 
 	szprintf(&buf[0][2], "%s", "SYSTEM MAP");
 	szprintf(&buf[0][x_size / 2], "|<- %lu ly ", radius / TICK_PER_LY);
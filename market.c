@@ -0,0 +1,646 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "grid.h"
+#include "item.h"
+#include "list.h"
+#include "log.h"
+#include "market.h"
+#include "port.h"
+#include "price.h"
+#include "ptrlist.h"
+#include "system.h"
+#include "universe.h"
+
+/*
+ * The market is an index of the prices and stock of every port, so the
+ * cheapest sellers or best buyers of an item near a system can be found
+ * without locking and walking all ports. The universe is divided into
+ * square cells, and each cell has a book per item with the ports in the
+ * cell that trade in it, sorted on price. A search merges the books of the
+ * cells within range, cheapest (or best paying) first, and stops as soon
+ * as it has found enough ports.
+ *
+ * Every port has an entry per item in port->market, which is updated by
+ * market_update_port() whenever the stock or prices of the port change.
+ * Changing an amount only touches the entry, and changing a price moves
+ * the entry within its book, which is short as it only holds the ports of
+ * one cell. The ports and their items never change after the index has
+ * been built, so only the entries need locking, one lock per cell.
+ *
+ * The books also keep the total stock of their ports, which is how full
+ * the region is when pricing, see price.c.
+ *
+ * In lazy economy mode, ports nobody has looked at are shown as they were
+ * when they were last updated.
+ */
+#define MARKET_CELL_SIZE (50 * TICK_PER_LY)
+/* The farthest a port can be from the center of its cell, rounded up */
+#define MARKET_CELL_REACH (MARKET_CELL_SIZE * 3 / 4)
+#define MARKET_CANDIDATES 16		/* Ports of each item to try buying from and selling to */
+
+struct market_entry {
+	struct port *port;
+	unsigned int item;		/* Index in port->stock */
+	long x, y;			/* Position of the port */
+	long price;
+	long amount;
+	long room;
+};
+
+struct market_book {
+	struct market_entry *entries;	/* Sorted on price, the cheapest first */
+	unsigned long len;
+	unsigned long alloc;
+	long amount;			/* Of all entries */
+	long max;
+	long inverse_max;		/* See price.c */
+};
+
+struct market_cell {
+	long x, y;			/* Center of the cell */
+	pthread_rwlock_t lock;
+	struct market_book *books;	/* Indexed by item->idx */
+};
+
+/* Where the items of a port are in the index */
+struct market_port {
+	struct market_cell *cell;
+	struct market_entry *entries[];	/* One per item in port->stock */
+};
+
+/* A position in a book during a search */
+struct market_cursor {
+	const struct market_book *book;
+	unsigned long pos;
+};
+
+static struct grid cells;		/* Cells stored at their centers */
+static struct ptrlist all_cells;
+static unsigned int num_items;
+static int built;
+
+static long cell_center(const long coord)
+{
+	long c = coord / MARKET_CELL_SIZE;
+
+	if (coord < 0 && c * MARKET_CELL_SIZE != coord)
+		c--;
+
+	return c * MARKET_CELL_SIZE + MARKET_CELL_SIZE / 2;
+}
+
+static void cell_free(struct market_cell *cell)
+{
+	for (unsigned int i = 0; i < num_items; i++)
+		free(cell->books[i].entries);
+	free(cell->books);
+	pthread_rwlock_destroy(&cell->lock);
+	free(cell);
+}
+
+static struct market_cell* get_cell(const struct system * const system)
+{
+	const long x = cell_center(system->x), y = cell_center(system->y);
+	struct market_cell *cell;
+
+	cell = grid_lookup(&cells, x, y);
+	if (cell)
+		return cell;
+
+	cell = malloc(sizeof(*cell));
+	if (!cell)
+		return NULL;
+
+	cell->x = x;
+	cell->y = y;
+	cell->books = calloc(MAX(num_items, 1), sizeof(*cell->books));
+	if (!cell->books) {
+		free(cell);
+		return NULL;
+	}
+	pthread_rwlock_init(&cell->lock, NULL);
+
+	if (grid_insert(&cells, x, y, cell))
+		goto err;
+	if (ptrlist_push(&all_cells, cell)) {
+		grid_remove(&cells, x, y, cell);
+		goto err;
+	}
+
+	return cell;
+
+err:
+	cell_free(cell);
+	return NULL;
+}
+
+static int book_append(struct market_book * const book, const struct market_entry * const entry)
+{
+	struct market_entry *entries;
+	unsigned long alloc;
+
+	if (book->len == book->alloc) {
+		alloc = book->alloc ? book->alloc * 2 : 4;
+		entries = realloc(book->entries, alloc * sizeof(*entries));
+		if (!entries)
+			return -1;
+		book->entries = entries;
+		book->alloc = alloc;
+	}
+
+	book->entries[book->len++] = *entry;
+	book->amount += entry->amount;
+	book->max += entry->amount + entry->room;
+
+	return 0;
+}
+
+static int cmp_entries(const void *_a, const void *_b)
+{
+	const struct market_entry *a = _a;
+	const struct market_entry *b = _b;
+
+	if (a->price < b->price)
+		return -1;
+	else if (a->price > b->price)
+		return 1;
+	else
+		return 0;
+}
+
+/* Lets the port of an entry know where it is after it has been moved */
+static void link_entry(struct market_entry * const entry)
+{
+	entry->port->market->entries[entry->item] = entry;
+}
+
+/*
+ * Moves an entry to its place in the book after its price has changed.
+ * The lock of the cell must be held for writing.
+ */
+static void book_reprice(struct market_book * const book, struct market_entry * const entry,
+		const long price)
+{
+	struct market_entry * const entries = book->entries;
+	struct market_entry moved = *entry;
+	unsigned long pos = entry - entries;
+
+	moved.price = price;
+
+	for (; pos > 0 && entries[pos - 1].price > price; pos--) {
+		entries[pos] = entries[pos - 1];
+		link_entry(&entries[pos]);
+	}
+	for (; pos + 1 < book->len && entries[pos + 1].price < price; pos++) {
+		entries[pos] = entries[pos + 1];
+		link_entry(&entries[pos]);
+	}
+
+	entries[pos] = moved;
+	link_entry(&entries[pos]);
+}
+
+static int add_port(struct port *port)
+{
+	const struct port_stock * const stock = &port->stock;
+	struct market_entry entry;
+	struct market_cell *cell;
+	int r = -1;
+
+	cell = get_cell(port->system);
+	if (!cell)
+		return -1;
+
+	port->market = malloc(sizeof(*port->market) + stock->len * sizeof(*port->market->entries));
+	if (!port->market)
+		return -1;
+	port->market->cell = cell;
+
+	entry.port = port;
+	entry.x = port->system->x;
+	entry.y = port->system->y;
+
+	pthread_rwlock_rdlock(&port->items_lock);
+
+	for (unsigned int i = 0; i < stock->len; i++) {
+		entry.item = i;
+		entry.price = stock->price[i];
+		entry.amount = stock->amount[i];
+		entry.room = stock->max[i] - stock->amount[i];
+		if (book_append(&cell->books[stock->item[i]->idx], &entry))
+			goto unlock;
+	}
+	r = 0;
+
+unlock:
+	pthread_rwlock_unlock(&port->items_lock);
+	return r;
+}
+
+static void sort_books(struct market_cell * const cell)
+{
+	struct market_book *book;
+
+	for (unsigned int i = 0; i < num_items; i++) {
+		book = &cell->books[i];
+		if (!book->len)
+			continue;
+
+		book->inverse_max = price_inverse(book->max);
+		qsort(book->entries, book->len, sizeof(*book->entries), cmp_entries);
+		for (unsigned long j = 0; j < book->len; j++)
+			link_entry(&book->entries[j]);
+	}
+}
+
+/*
+ * Indexes all ports in the universe. Must be called when all ports exist
+ * and before anything changes their stock, i.e. before the server starts.
+ * The books are sorted once all entries are in them, and only then do the
+ * ports get to know where their entries are.
+ */
+int market_build(void)
+{
+	struct market_cell *cell;
+	struct port *port;
+	struct item *item;
+	unsigned long lh;
+
+	market_free();
+
+	if (grid_init(&cells, MARKET_CELL_SIZE))
+		return -1;
+	ptrlist_init(&all_cells);
+	built = 1;
+
+	list_for_each_entry(item, &univ.items, list)
+		num_items = MAX(num_items, item->idx + 1);
+
+	pthread_rwlock_rdlock(&univ.ports_lock);
+	ptrlist_for_each_entry(port, &univ.ports, lh) {
+		if (add_port(port)) {
+			pthread_rwlock_unlock(&univ.ports_lock);
+			market_free();
+			return -1;
+		}
+	}
+	pthread_rwlock_unlock(&univ.ports_lock);
+
+	ptrlist_for_each_entry(cell, &all_cells, lh)
+		sort_books(cell);
+
+	log_printfn(LOG_MAIN, "market index has %lu ports in %lu cells",
+			ptrlist_len(&univ.ports), ptrlist_len(&all_cells));
+
+	return 0;
+}
+
+void market_free(void)
+{
+	struct market_cell *cell;
+	struct port *port;
+	unsigned long lh;
+
+	if (!built)
+		return;
+
+	ptrlist_for_each_entry(port, &univ.ports, lh) {
+		free(port->market);
+		port->market = NULL;
+	}
+
+	ptrlist_for_each_entry(cell, &all_cells, lh)
+		cell_free(cell);
+	ptrlist_free(&all_cells);
+	grid_free(&cells);
+
+	num_items = 0;
+	built = 0;
+}
+
+/*
+ * Brings the entries of a port up to date with its stock, and tells the
+ * port how full the region is for the next price update. The caller must
+ * hold port->items_lock for writing.
+ */
+void market_update_port(struct port *port)
+{
+	struct port_stock * const stock = &port->stock;
+	struct market_entry *entry;
+	struct market_book *book;
+	struct market_cell *cell;
+
+	if (!port->market)
+		return;
+
+	cell = port->market->cell;
+	pthread_rwlock_wrlock(&cell->lock);
+
+	for (unsigned int i = 0; i < stock->len; i++) {
+		entry = port->market->entries[i];
+		book = &cell->books[stock->item[i]->idx];
+		book->amount += stock->amount[i] - entry->amount;
+		entry->amount = stock->amount[i];
+		entry->room = stock->max[i] - stock->amount[i];
+		if (entry->price != stock->price[i])
+			book_reprice(book, entry, stock->price[i]);
+		stock->demand[i] = price_fill(book->amount, book->inverse_max);
+	}
+
+	pthread_rwlock_unlock(&cell->lock);
+}
+
+/*
+ * Returns 1 if some part of the cell is within radius from origin. The
+ * grid only finds cells by their centers, so it returns some cells that are
+ * too far away.
+ */
+static int cell_in_range(const struct market_cell * const cell, const struct system * const origin,
+		const unsigned long max_squared)
+{
+	const long dx = MAX(labs(origin->x - cell->x) - MARKET_CELL_SIZE / 2, 0);
+	const long dy = MAX(labs(origin->y - cell->y) - MARKET_CELL_SIZE / 2, 0);
+	unsigned long d;
+
+	grid_distances_squared(&dx, &dy, 1, 0, 0, &d);
+
+	return d <= max_squared;
+}
+
+/*
+ * Sellers walk the books from the cheapest entry, buyers from the best
+ * paying. The cursor heap is ordered on the next entry of each book.
+ */
+static const struct market_entry* cursor_entry(const struct market_cursor * const c,
+		const int selling)
+{
+	return &c->book->entries[selling ? c->pos : c->book->len - 1 - c->pos];
+}
+
+static int cursor_before(const struct market_cursor * const a, const struct market_cursor * const b,
+		const int selling)
+{
+	const long pa = cursor_entry(a, selling)->price;
+	const long pb = cursor_entry(b, selling)->price;
+
+	return selling ? pa < pb : pa > pb;
+}
+
+static void sift_down(struct market_cursor * const heap, const unsigned long len,
+		unsigned long i, const int selling)
+{
+	const struct market_cursor c = heap[i];
+	unsigned long child;
+
+	for (; (child = 2 * i + 1) < len; i = child) {
+		if (child + 1 < len && cursor_before(&heap[child + 1], &heap[child], selling))
+			child++;
+		if (!cursor_before(&heap[child], &c, selling))
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = c;
+}
+
+/*
+ * Finds up to num ports within radius from origin that have some of item
+ * (for sellers) or room for it (for buyers), cheapest or best paying first.
+ * The cost is one step per cell in range, and then a heap operation per
+ * entry looked at.
+ */
+static unsigned int find_quotes(const struct item * const item, const struct system * const origin,
+		const unsigned long radius, const int selling,
+		struct market_quote *quotes, const unsigned int num)
+{
+	const unsigned long max_squared = radius * radius;
+	const struct market_entry *entry;
+	struct market_cursor *heap = NULL;
+	struct market_cell *cell, **locked = NULL;
+	struct ptrlist near;
+	unsigned long lh, len = 0, num_locked = 0, distance;
+	unsigned int n = 0;
+
+	if (!built || item->idx >= num_items || !num)
+		return 0;
+
+	ptrlist_init(&near);
+	grid_range(&cells, origin->x, origin->y, radius + MARKET_CELL_REACH, &near);
+
+	heap = malloc(MAX(ptrlist_len(&near), 1) * sizeof(*heap));
+	locked = malloc(MAX(ptrlist_len(&near), 1) * sizeof(*locked));
+	if (!heap || !locked)
+		goto out;
+
+	/* The length of a book never changes, only the order of the entries */
+	ptrlist_for_each_entry(cell, &near, lh) {
+		if (!cell->books[item->idx].len || !cell_in_range(cell, origin, max_squared))
+			continue;
+
+		pthread_rwlock_rdlock(&cell->lock);
+		locked[num_locked++] = cell;
+		heap[len].book = &cell->books[item->idx];
+		heap[len].pos = 0;
+		len++;
+	}
+
+	for (unsigned long i = len / 2; i > 0; i--)
+		sift_down(heap, len, i - 1, selling);
+
+	while (len && n < num) {
+		entry = cursor_entry(&heap[0], selling);
+		if (++heap[0].pos == heap[0].book->len)
+			heap[0] = heap[--len];
+		if (len)
+			sift_down(heap, len, 0, selling);
+
+		if ((selling ? entry->amount : entry->room) <= 0)
+			continue;
+
+		grid_distances_squared(&entry->x, &entry->y, 1, origin->x, origin->y, &distance);
+		if (distance > max_squared)
+			continue;
+
+		quotes[n].port = entry->port;
+		quotes[n].item = entry->item;
+		quotes[n].price = entry->price;
+		quotes[n].amount = entry->amount;
+		quotes[n].room = entry->room;
+		quotes[n].distance = system_distance(origin, entry->port->system);
+		n++;
+	}
+
+	for (unsigned long i = 0; i < num_locked; i++)
+		pthread_rwlock_unlock(&locked[i]->lock);
+
+out:
+	free(locked);
+	free(heap);
+	ptrlist_free(&near);
+	return n;
+}
+
+/*
+ * Stores the num cheapest ports within radius from origin that have item
+ * in stock in quotes. Returns the number of ports found.
+ */
+unsigned int market_sellers(const struct item * const item, const struct system * const origin,
+		const unsigned long radius, struct market_quote *quotes, const unsigned int num)
+{
+	return find_quotes(item, origin, radius, 1, quotes, num);
+}
+
+/*
+ * Stores the num best paying ports within radius from origin that have
+ * room for item in quotes. Returns the number of ports found.
+ */
+unsigned int market_buyers(const struct item * const item, const struct system * const origin,
+		const unsigned long radius, struct market_quote *quotes, const unsigned int num)
+{
+	return find_quotes(item, origin, radius, 0, quotes, num);
+}
+
+static double profit_per_ly(const struct market_trade * const trade)
+{
+	return trade->profit / (double)MAX(trade->distance, TICK_PER_LY) * TICK_PER_LY;
+}
+
+/*
+ * Keeps the num best trades sorted in trades, the best first.
+ */
+static void add_trade(struct market_trade *trades, unsigned int *n, const unsigned int num,
+		const struct market_trade * const trade)
+{
+	const double score = profit_per_ly(trade);
+	unsigned int i;
+
+	if (*n == num && score <= profit_per_ly(&trades[num - 1]))
+		return;
+
+	i = *n < num ? (*n)++ : num - 1;
+	for (; i > 0 && score > profit_per_ly(&trades[i - 1]); i--)
+		trades[i] = trades[i - 1];
+	trades[i] = *trade;
+}
+
+static long trade_profit(const struct port_stock * const from, const unsigned int i,
+		const struct port_stock * const to, const unsigned int j, const long amount)
+{
+	return price_sell(to, j, amount) - price_buy(from, i, amount);
+}
+
+/*
+ * Returns how many of an item to buy at from and sell at to, up to amount
+ * and what credits buy, and stores what that makes in profit. Every unit
+ * bought raises the price at from and every unit sold lowers it at to, so
+ * the trade stops at the last unit that still makes money.
+ */
+static long size_trade(const struct market_quote * const from, const struct market_quote * const to,
+		long amount, const long credits, long *profit)
+{
+	const struct port_stock *fs = &from->port->stock, *ts = &to->port->stock;
+	const unsigned int i = from->item, j = to->item;
+	pthread_rwlock_t *first = &from->port->items_lock, *second = &to->port->items_lock;
+	long lo = 0, hi, mid;
+
+	*profit = 0;
+	if (from->port == to->port)
+		return 0;
+
+	/* Always lock two ports in the same order */
+	if (first > second) {
+		first = &to->port->items_lock;
+		second = &from->port->items_lock;
+	}
+	pthread_rwlock_rdlock(first);
+	pthread_rwlock_rdlock(second);
+
+	amount = MIN(amount, ts->max[j] - ts->amount[j]);
+	hi = price_affordable(fs, i, amount, credits);
+
+	/*
+	 * Each unit makes less than the one before it, so lo is always worth
+	 * trading and hi, unless it is the last unit, isn't.
+	 */
+	if (hi > 0 && trade_profit(fs, i, ts, j, hi) > trade_profit(fs, i, ts, j, hi - 1)) {
+		lo = hi;
+	} else {
+		while (lo + 1 < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (trade_profit(fs, i, ts, j, mid) > trade_profit(fs, i, ts, j, mid - 1))
+				lo = mid;
+			else
+				hi = mid;
+		}
+	}
+
+	*profit = trade_profit(fs, i, ts, j, lo);
+
+	pthread_rwlock_unlock(second);
+	pthread_rwlock_unlock(first);
+
+	if (*profit <= 0)
+		return 0;
+
+	return lo;
+}
+
+/*
+ * Finds the num trades within radius from origin that make the most profit
+ * per light year travelled, buying as much as capacity (in weight) and
+ * credits allow at one port and selling it at another, priced the way
+ * trading would, see size_trade(). Only the cheapest and best paying
+ * MARKET_CANDIDATES ports of each item are considered.
+ * Returns the number of trades found.
+ */
+unsigned int market_best_trades(const struct system * const origin, const unsigned long radius,
+		const long capacity, const long credits,
+		struct market_trade *trades, const unsigned int num)
+{
+	struct market_quote sellers[MARKET_CANDIDATES], buyers[MARKET_CANDIDATES];
+	const struct market_quote *from, *to;
+	struct market_trade trade;
+	unsigned int n = 0, num_sellers, num_buyers;
+	struct item *item;
+
+	if (!num)
+		return 0;
+
+	list_for_each_entry(item, &univ.items, list) {
+		num_sellers = market_sellers(item, origin, radius, sellers, MARKET_CANDIDATES);
+		if (!num_sellers)
+			continue;
+		num_buyers = market_buyers(item, origin, radius, buyers, MARKET_CANDIDATES);
+
+		for (unsigned int s = 0; s < num_sellers; s++) {
+			from = &sellers[s];
+
+			for (unsigned int b = 0; b < num_buyers; b++) {
+				to = &buyers[b];
+
+				/* The rest pay even less */
+				if (to->price <= from->price)
+					break;
+
+				trade.amount = MIN(from->amount, to->room);
+				if (item->weight > 0)
+					trade.amount = MIN(trade.amount, capacity / item->weight);
+				trade.amount = size_trade(from, to, trade.amount, credits, &trade.profit);
+				if (trade.amount <= 0)
+					continue;
+
+				trade.item = item;
+				trade.from = from->port;
+				trade.to = to->port;
+				trade.distance = from->distance +
+					system_distance(from->port->system, to->port->system);
+
+				add_trade(trades, &n, num, &trade);
+			}
+		}
+	}
+
+	return n;
+}
@@ -0,0 +1,39 @@
+#ifndef _HAS_MARKET_H
+#define _HAS_MARKET_H
+
+struct item;
+struct port;
+struct system;
+
+struct market_quote {
+	struct port *port;
+	unsigned int item;		/* Index in port->stock */
+	long price;
+	long amount;			/* In stock */
+	long room;			/* How much more the port can take */
+	unsigned long distance;		/* From the origin of the search */
+};
+
+struct market_trade {
+	struct item *item;
+	struct port *from;
+	struct port *to;
+	long amount;
+	long profit;
+	unsigned long distance;		/* From the origin via from to to */
+};
+
+int market_build(void);
+void market_free(void);
+void market_update_port(struct port *port);
+
+unsigned int market_sellers(const struct item * const item, const struct system * const origin,
+		const unsigned long radius, struct market_quote *quotes, const unsigned int num);
+unsigned int market_buyers(const struct item * const item, const struct system * const origin,
+		const unsigned long radius, struct market_quote *quotes, const unsigned int num);
+
+unsigned int market_best_trades(const struct system * const origin, const unsigned long radius,
+		const long capacity, const long credits,
+		struct market_trade *trades, const unsigned int num);
+
+#endif
@@ -5,14 +5,90 @@
 #include <limits.h>
 #include <stdint.h>
 #include "mtrandom.h"
-#include "mt19937ar-cok.h"
 
 #define RANDOM_DEV "/dev/urandom"
 
+/*
+ * Every thread has its own xoshiro256** generator, so random numbers can be
+ * drawn from any thread without locking. All generators are derived from one
+ * global seed: a thread's generator is seeded from the global seed and a
+ * stream number, and different streams give unrelated sequences.
+ *
+ * A thread that hasn't picked a stream with mtrandom_use_stream() gets the
+ * next free automatic stream the first time it needs a random number.
+ * Automatic streams have the top bit set, so they never collide with streams
+ * chosen explicitly. The thread calling mtrandom_init() uses stream 0.
+ */
+#define AUTO_STREAM (1ULL << 63)
+
+static uint64_t global_seed;
+static uint64_t next_auto_stream;
+
+static __thread struct mtrandom thread_rng;
+static __thread int thread_rng_seeded;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(const uint64_t x, const int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t next(struct mtrandom * const r)
+{
+	const uint64_t result = rotl(r->s[1] * 5, 7) * 9;
+	const uint64_t t = r->s[1] << 17;
+
+	r->s[2] ^= r->s[0];
+	r->s[3] ^= r->s[1];
+	r->s[1] ^= r->s[2];
+	r->s[0] ^= r->s[3];
+	r->s[2] ^= t;
+	r->s[3] = rotl(r->s[3], 45);
+
+	return result;
+}
+
+void mtrandom_seed_stream(struct mtrandom *r, const uint64_t stream)
+{
+	uint64_t x = stream;
+
+	x = global_seed ^ splitmix64(&x);
+	for (int i = 0; i < 4; i++)
+		r->s[i] = splitmix64(&x);
+}
+
+void mtrandom_use_stream(const uint64_t stream)
+{
+	mtrandom_seed_stream(&thread_rng, stream);
+	thread_rng_seeded = 1;
+}
+
+static struct mtrandom* rng()
+{
+	if (!thread_rng_seeded)
+		mtrandom_use_stream(AUTO_STREAM | __sync_fetch_and_add(&next_auto_stream, 1));
+
+	return &thread_rng;
+}
+
+void mtrandom_init_seed(const uint64_t seed)
+{
+	global_seed = seed;
+	mtrandom_use_stream(0);
+}
+
 void mtrandom_init()
 {
 	FILE *f;
-	uint32_t seed;
+	uint64_t seed;
 	unsigned int n;
 	if (!(f = fopen(RANDOM_DEV, "r"))) {
 		printf("No %s, initializing PRNG from system time\n", RANDOM_DEV);
@@ -21,25 +97,43 @@ void mtrandom_init()
 		printf("%s detected, will use for PRNG initialization\n", RANDOM_DEV);
 		n = 0;
 		while (n < sizeof(seed))
-			n += fread(&seed + n, 1, sizeof(seed) - n, f);
+			n += fread((char*)&seed + n, 1, sizeof(seed) - n, f);
 		fclose(f);
 	}
-	mt_init_genrand(seed);
+	mtrandom_init_seed(seed);
+}
+
+uint64_t mtrandom_seed()
+{
+	return global_seed;
+}
+
+/*
+ * Stores the state of the calling thread's generator in r, so it can be
+ * put back with mtrandom_restore() after drawing from another stream.
+ */
+void mtrandom_save(struct mtrandom *r)
+{
+	*r = *rng();
+}
+
+void mtrandom_restore(const struct mtrandom *r)
+{
+	thread_rng = *r;
+	thread_rng_seeded = 1;
 }
 
 int64_t mtrandom_int64(int64_t range)
 {
-	int64_t r = 0;
+	int64_t r;
 	if (range == 0)
 		return range;
 
 	/*
-	 * The 31 bit shift guarantees the number is positive.
+	 * The shift guarantees the number is positive.
 	 * We only return a negative number if the range is negative.
 	 */
-	r |= mt_genrand_int32();
-	r <<= 31;
-	r |= mt_genrand_int32();
+	r = next(rng()) >> 1;
 
 	if (range > 0)
 		return r % range;
@@ -49,15 +143,10 @@ int64_t mtrandom_int64(int64_t range)
 
 uint64_t mtrandom_uint64(uint64_t range)
 {
-	uint64_t r = 0;
 	if (range == 0)
 		return range;
 
-	r |= mt_genrand_int32();
-	r <<= 32;
-	r |= mt_genrand_int32();
-
-	return r % range;
+	return next(rng()) % range;
 }
 
 unsigned int mtrandom_uint(unsigned int range)
@@ -65,7 +154,7 @@ unsigned int mtrandom_uint(unsigned int range)
 	if (range == 0)
 		return range;
 
-	return mt_genrand_int32() % range;
+	return (uint32_t)(next(rng()) >> 32) % range;
 }
 
 int mtrandom_int(int range)
@@ -73,7 +162,7 @@ int mtrandom_int(int range)
 	if (range == 0)
 		return range;
 
-	return mt_genrand_int32() % range;
+	return (uint32_t)(next(rng()) >> 32) % range;
 }
 
 unsigned long mtrandom_ulong(unsigned long range)
@@ -88,13 +177,12 @@ long mtrandom_long(long range)
 
 double mtrandom_double(double range)
 {
-	/* This method will actually generate a numerical distribution error
-	   of range * 2^(-32), but it is good enough for our purposes. */
-	double r = floor(mt_genrand_real2() * range);
+	/* Uses the top 53 bits, which is all a double can hold */
+	double r = floor((next(rng()) >> 11) * 0x1.0p-53 * range);
 	return r;
 }
 
 int mtrandom_bool()
 {
-	return mt_genrand_int32() & 0x1;
+	return next(rng()) >> 63;
 }
@@ -3,7 +3,18 @@
 
 #include <stdint.h>
 
+struct mtrandom {
+	uint64_t s[4];
+};
+
 void mtrandom_init();
+void mtrandom_init_seed(const uint64_t seed);
+uint64_t mtrandom_seed();
+
+void mtrandom_seed_stream(struct mtrandom *r, const uint64_t stream);
+void mtrandom_use_stream(const uint64_t stream);
+void mtrandom_save(struct mtrandom *r);
+void mtrandom_restore(const struct mtrandom *r);
 
 int64_t mtrandom_int64(int64_t range);
 uint64_t mtrandom_uint64(uint64_t range);
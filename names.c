@@ -11,7 +11,8 @@
 
 void names_init(struct name_list *l)
 {
-	INIT_LIST_HEAD(&l->taken);
+	st_init(&l->taken);
+	pthread_mutex_init(&l->taken_lock, NULL);
 	l->prefix = ptrarray_create();
 	l->first  = ptrarray_create();
 	l->second = ptrarray_create();
@@ -21,6 +22,7 @@ void names_init(struct name_list *l)
 void names_free(struct name_list *l)
 {
 	st_destroy(&l->taken, ST_DONT_FREE_DATA);
+	pthread_mutex_destroy(&l->taken_lock);
 	ptrarray_free(l->prefix);
 	ptrarray_free(l->first);
 	ptrarray_free(l->second);
@@ -111,6 +113,12 @@ char* create_unique_name(struct name_list *l)
 {
 	char *name = NULL;
 
+	/*
+	 * Names are handed out from several server loops at once, so both
+	 * picking a name and marking it as taken need to happen atomically.
+	 */
+	pthread_mutex_lock(&l->taken_lock);
+
 	do {
 		free(name);
 		name = create_name(l);
@@ -122,10 +130,13 @@ char* create_unique_name(struct name_list *l)
 	 * is fine, even though it might not be a valid pointer in the future.
 	 */
 	if (st_add_string(&l->taken, name, name)) {
+		pthread_mutex_unlock(&l->taken_lock);
 		free(name);
 		return NULL;
 	}
 
+	pthread_mutex_unlock(&l->taken_lock);
+
 	return name;
 }
 
@@ -1,15 +1,18 @@
 #ifndef _HAS_NAMES_H
 #define _HAS_NAMES_H
 
+#include <pthread.h>
 #include "list.h"
 #include "ptrarray.h"
+#include "stringtree.h"
 
 struct name_list {
 	struct ptrarray *prefix;
 	struct ptrarray *first;
 	struct ptrarray *second;
 	struct ptrarray *suffix;
-	struct list_head taken;
+	struct st_node taken;
+	pthread_mutex_t taken_lock;
 };
 
 void names_init(struct name_list *l);
@@ -16,7 +16,7 @@
 #include "stringtree.h"
 #include "system.h"
 
-static void planet_init(struct planet *p)
+void planet_init(struct planet *p)
 {
 	memset(p, 0, sizeof(*p));
 
@@ -31,7 +31,7 @@ void planet_free(struct planet *p)
 	assert(p != NULL);
 	struct port *b;
 	struct planet *m;
-	struct list_head *lh;
+	unsigned long lh;
 	ptrlist_for_each_entry(b, &p->ports, lh)
 		port_free(b);
 	ptrlist_free(&p->ports);
@@ -131,8 +131,6 @@ int planet_populate_system(struct system* system)
 	int num = planet_gennum();
 	int i;
 
-	pthread_rwlock_wrlock(&univ.planetnames_lock);
-
 	for (i = 0; i < num; i++) {
 		p = malloc(sizeof(*p));
 		if (!p)
@@ -145,7 +143,7 @@ int planet_populate_system(struct system* system)
 
 	ptrlist_sort(&system->planets, NULL, cmp_planet_distances);
 
-	struct list_head *lh;
+	unsigned long lh;
 	i = 0;
 	ptrlist_for_each_entry(p, &system->planets, lh) {
 		p->name = malloc(strlen(system->name) + ROMAN_LEN + 2);
@@ -155,19 +153,13 @@ int planet_populate_system(struct system* system)
 		}
 
 		sprintf(p->name, "%s %s", system->name, roman[i]);
-		st_add_string(&univ.planetnames, p->name, p);
-		if (p->gname)
-			st_add_string(&univ.planetnames, p->gname, p);
 
 		i++;
 	}
 
-	pthread_rwlock_unlock(&univ.planetnames_lock);
-
 	return 0;
 
 err:
 	ptrlist_free(&system->planets);
-	pthread_rwlock_unlock(&univ.planetnames_lock);
 	return -1;
 }
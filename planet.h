@@ -20,6 +20,7 @@ struct planet {
 	struct list_head list;
 };
 
+void planet_init(struct planet *p);
 void planet_free(struct planet *p);
 struct planet* createplanet();
 int planet_populate_system(struct system* system);
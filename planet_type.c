@@ -102,7 +102,7 @@ static int set_description(struct planet_type *type, struct config *conf)
 static int set_life(enum planet_life *life, char *value)
 {
 	int i;
-	struct list_head life_root = LIST_HEAD_INIT(life_root);
+	struct st_node life_root = ST_ROOT_INIT;
 	int lifes[PLANET_LIFE_NUM];
 
 	if (!value)
@@ -176,7 +176,7 @@ static int set_zones(struct planet_type *type, struct config *conf)
 {
 	struct config *child;
 	unsigned int i;
-	struct list_head zone_root = LIST_HEAD_INIT(zone_root);
+	struct st_node zone_root = ST_ROOT_INIT;
 	int zones[PLANET_ZONE_NUM];
 
 	for (i = 0; i < ARRAY_SIZE(zones); i++)
@@ -199,7 +199,7 @@ static int set_zones(struct planet_type *type, struct config *conf)
 	return 0;
 }
 
-static int build_command_tree(struct list_head *root)
+static int build_command_tree(struct st_node *root)
 {
 	if (st_add_string(root, "atmosphere", set_atmosphere))
 		return -1;
@@ -228,7 +228,7 @@ static int build_command_tree(struct list_head *root)
 int load_planets_from_file(const char * const file, struct universe * const universe)
 {
 	struct list_head conf_root = LIST_HEAD_INIT(conf_root);
-	struct list_head cmd_root = LIST_HEAD_INIT(cmd_root);
+	struct st_node cmd_root = ST_ROOT_INIT;
 	struct config *conf, *child;
 	struct planet_type *pl_type;
 	int (*func)(struct planet_type*, struct config*);
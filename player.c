@@ -12,15 +12,20 @@
 #include "common.h"
 #include "connection.h"
 #include "item.h"
+#include "journal.h"
 #include "log.h"
 #include "map.h"
+#include "market.h"
 #include "names.h"
 #include "port.h"
 #include "port_type.h"
 #include "planet.h"
 #include "planet_type.h"
 #include "player.h"
+#include "port_update.h"
+#include "price.h"
 #include "ptrlist.h"
+#include "route.h"
 #include "server.h"
 #include "ship.h"
 #include "star.h"
@@ -33,7 +38,6 @@
 void player_free(struct player *player)
 {
 	free(player->name);
-	cli_tree_destroy(&player->cli);
 
 	struct ship *s, *_s;
 	list_for_each_entry_safe(s, _s, &player->ships, list) {
@@ -73,7 +77,7 @@ static char cmd_map_help[] = "Display map";
 static void player_showsystem(struct player *player, struct system *system)
 {
 	struct system *t;
-	struct list_head *lh;
+	unsigned long lh;
 	struct star *sol;
 	struct planet *planet;
 	char buf[10];
@@ -92,7 +96,7 @@ static void player_showsystem(struct player *player, struct system *system)
 			stellar_lum[sol->lum], sol->temp, sol->hab,
 			hundreths(sol->lumval, buf, sizeof(buf)));
 
-	if (!list_empty(&system->planets.list)) {
+	if (ptrlist_len(&system->planets)) {
 		player_talk(player, "Planets:\n");
 		ptrlist_for_each_entry(planet, &system->planets, lh) {
 			player_talk(player,
@@ -106,7 +110,7 @@ static void player_showsystem(struct player *player, struct system *system)
 		player_talk(player, "System does not have any planets.\n");
 	}
 
-	if (!list_empty(&system->links.list)) {
+	if (ptrlist_len(&system->links)) {
 		player_talk(player, "This system has hyperspace links to\n");
 		ptrlist_for_each_entry(t, &system->links, lh)
 			player_talk(player, "  %s\n", t->name);
@@ -119,8 +123,8 @@ static void player_showsystem(struct player *player, struct system *system)
 
 	player_talk(player, "Systems within 50 lys are:\n");
 	get_neighbouring_systems(&neigh, system, 50 * TICK_PER_LY);
-	ptrlist_sort(&neigh, system, cmp_system_distances);
-	if (!list_empty(&neigh.list)) {
+	sort_systems_by_distance(&neigh, system);
+	if (ptrlist_len(&neigh)) {
 		ptrlist_for_each_entry(t, &neigh, lh) {
 			if (t != system)
 				player_talk(player, "  %s at %.1f ly\n", t->name,
@@ -160,7 +164,7 @@ static void player_describe_port(struct player *player, struct port *port)
 static void player_showplanet(struct player *player, struct planet *planet)
 {
 	struct port *port;
-	struct list_head *lh;
+	unsigned long lh;
 	if (planet->gname)
 		player_talk(player, "Planet %s (%s) in system %s",
 			planet->gname, planet->name, planet->system->name);
@@ -174,7 +178,7 @@ static void player_showplanet(struct player *player, struct planet *planet)
 		planet->dia*100, planet->dist, planet->type->atmo,
 		planet_life_desc[planet->life]);
 
-	if (!list_empty(&planet->ports.list)) {
+	if (ptrlist_len(&planet->ports)) {
 		player_talk(player, "Ports:\n");
 		ptrlist_for_each_entry(port, &planet->ports, lh) {
 			player_talk(player, "  ");
@@ -184,7 +188,7 @@ static void player_showplanet(struct player *player, struct planet *planet)
 		player_talk(player, "No ports.\n");
 	}
 
-	if (!list_empty(&planet->stations.list)) {
+	if (ptrlist_len(&planet->stations)) {
 		player_talk(player, "Orbital stations:\n");
 		ptrlist_for_each_entry(port, &planet->stations, lh) {
 			player_talk(player, "  ");
@@ -198,10 +202,17 @@ static void player_showplanet(struct player *player, struct planet *planet)
 static int cmd_help(void *ptr, char *param)
 {
 	struct player *player = ptr;
-	/* FIXME: This should use conn_send instead of writing directly to the fd */
-	FILE *f = fdopen(dup(player->conn->peerfd), "w");
-	cli_print_help(f, &player->cli);
+	char *help = NULL;
+	size_t len = 0;
+
+	FILE *f = open_memstream(&help, &len);
+	if (!f)
+		return 0;
+	cli_print_help(f, player->cli);
 	fclose(f);
+
+	player_talk(player, "%s", help);
+	free(help);
 	return 0;
 }
 static char cmd_help_help[] = "Short help on available commands";
@@ -257,7 +268,7 @@ static int cmd_hyper(void *ptr, char *param)
 	int ok = 0;
 	struct system *tmp;
 	struct system *pos = ship->pos;
-	struct list_head *lh;
+	unsigned long lh;
 	ptrlist_for_each_entry(tmp, &pos->links, lh) {
 		if (tmp == system) {
 			ok = 1;
@@ -418,14 +429,16 @@ static int cmd_trade(void *ptr, char *param)
 	assert(ship->postype == PORT);
 	struct port *port = ship->pos;
 
-	pthread_rwlock_rdlock(&port->items_lock);
+	pthread_rwlock_wrlock(&port->items_lock);
+	port_catch_up(port);
 
-	struct cargo *c;
+	struct port_stock *stock = &port->stock;
 	player_talk(player, "%-26s %-12s %-12s %-12s %-12s\n",
 			"Item", "In stock", "Max stock", "Daily change", "Price");
-	list_for_each_entry(c, &port->items, list) {
+	for (unsigned int i = 0; i < stock->len; i++) {
 		player_talk(player, "%-26.26s %-12ld %-12ld %-12ld %-12ld\n",
-				c->item->name, c->amount, c->max, c->daily_change, c->price);
+				stock->item[i]->name, stock->amount[i], stock->max[i],
+				stock->daily_change[i], stock->price[i]);
 	}
 
 	pthread_rwlock_unlock(&port->items_lock);
@@ -481,38 +494,57 @@ static int cmd_buy(void *ptr, char *param)
 		goto syntax_err;
 
 	pthread_rwlock_wrlock(&port->items_lock);
+	port_catch_up(port);
+	pthread_rwlock_wrlock(&ship->cargo_lock);
 
-	struct cargo *c = st_lookup_string(&port->item_names, name);
-	if (!c) {
-		pthread_rwlock_unlock(&port->items_lock);
+	long i = port_item_index(port, name);
+	if (i < 0) {
 		player_talk(player, "%s does not supply %s\n", port->name, name);
-		return 0;
+		goto unlock;
 	}
-
-	if (c->price) {
-		amount = MIN(amount, player->credits / c->price);
+	struct port_stock *stock = &port->stock;
+	struct item *item = stock->item[i];
+
+	/* The price depends on the amount, so it must be known beforehand */
+	amount = MIN(amount, stock->amount[i]);
+	struct cargo *cargo = st_lookup_string(&ship->cargo_names, item->name);
+	if (cargo)
+		amount = MIN(amount, cargo->max - cargo->amount);
+	if (amount) {
+		amount = price_affordable(stock, i, amount, player->credits);
 		if (!amount) {
-			pthread_rwlock_unlock(&port->items_lock);
-			player_talk(player, "You cannot afford any %s\n", c->item->name);
-			return 0;
+			player_talk(player, "You cannot afford any %s\n", item->name);
+			goto unlock;
 		}
 	}
+	long price = price_buy(stock, i, amount);
 
-	pthread_rwlock_wrlock(&ship->cargo_lock);
-
-	amount = move_cargo_to_ship(ship, c, amount);
-	long price = amount * c->price;
-	player->credits -= price;
+	amount = move_cargo_to_ship(ship, item, &stock->amount[i], amount);
+	if (amount < 0) {
+		player_talk(player, "Could not load %s onto %s\n", item->name, ship->name);
+		goto unlock;
+	}
+	if (amount) {
+		player->credits -= price;
+		journal_trade(port, i, player, ship, amount, price);
+		price_update(stock);
+		market_update_port(port);
+	}
 
 	pthread_rwlock_unlock(&ship->cargo_lock);
 	pthread_rwlock_unlock(&port->items_lock);
 
 	if (amount)
 		player_talk(player, "Bought %ld %s from %s for %ld credits\n",
-				amount, c->item->name, port->name, price);
+				amount, item->name, port->name, price);
 	else
-		player_talk(player, "Cannot buy any %s\n", c->item->name);
+		player_talk(player, "Cannot buy any %s\n", item->name);
+
+	return 0;
 
+unlock:
+	pthread_rwlock_unlock(&ship->cargo_lock);
+	pthread_rwlock_unlock(&port->items_lock);
 	return 0;
 
 syntax_err:
@@ -538,32 +570,49 @@ static int cmd_sell(void *ptr, char *param)
 		goto syntax_err;
 
 	pthread_rwlock_wrlock(&port->items_lock);
+	port_catch_up(port);
 	pthread_rwlock_wrlock(&ship->cargo_lock);
 
-	if (!st_lookup_string(&ship->cargo_names, name)) {
+	struct cargo *cargo = st_lookup_string(&ship->cargo_names, name);
+	if (!cargo) {
 		player_talk(player, "You don't have any %s\n", name);
 		goto unlock;
 	}
 
-	struct cargo *c = st_lookup_string(&port->item_names, name);
-	if (!c) {
+	long i = port_item_index(port, name);
+	if (i < 0) {
 		player_talk(player, "%s does not accept %s\n", port->name, name);
 		goto unlock;
 	}
+	struct port_stock *stock = &port->stock;
+	struct item *item = stock->item[i];
 	long price;
 
-	amount = move_cargo_from_ship(ship, c, amount);
-	price = amount * c->price;
-	player->credits += price;
+	/* The price depends on the amount, so it must be known beforehand */
+	amount = MIN(amount, cargo->amount);
+	amount = MIN(amount, stock->max[i] - stock->amount[i]);
+	price = price_sell(stock, i, amount);
+
+	amount = move_cargo_from_ship(ship, item, &stock->amount[i], stock->max[i], amount);
+	if (amount < 0) {
+		player_talk(player, "Could not unload %s from %s\n", item->name, ship->name);
+		goto unlock;
+	}
+	if (amount) {
+		player->credits += price;
+		journal_trade(port, i, player, ship, -amount, -price);
+		price_update(stock);
+		market_update_port(port);
+	}
 
 	pthread_rwlock_unlock(&port->items_lock);
 	pthread_rwlock_unlock(&ship->cargo_lock);
 
 	if (amount)
 		player_talk(player, "Sold %ld %s to %s for %ld credits\n",
-				amount, c->item->name, port->name, price);
+				amount, item->name, port->name, price);
 	else
-		player_talk(player, "Cannot sell any %s\n", c->item->name);
+		player_talk(player, "Cannot sell any %s\n", item->name);
 
 	return 0;
 
@@ -640,20 +689,40 @@ static struct system* current_player_system(struct player *player)
 }
 
 #define DEF_PORT_RADIUS "50"
+#define MAX_PORT_RADIUS 100000		/* In light years, farther than any universe reaches */
+
+/*
+ * Parses a radius in light years given by the player and returns it in
+ * ticks, or -1 after telling the player what is wrong with it.
+ */
+static long parse_radius(struct player *player, const char * const param)
+{
+	long dist;
+
+	if (str_to_long((param ? param : DEF_PORT_RADIUS), &dist)) {
+		player_talk(player, "error: radius is not numeric\n");
+		return -1;
+	}
+	if (dist <= 0 || dist > MAX_PORT_RADIUS) {
+		player_talk(player, "error: radius must be between 1 and %d lys\n", MAX_PORT_RADIUS);
+		return -1;
+	}
+
+	return dist * TICK_PER_LY;
+}
+
 static int cmd_ports(void *_player, char *param)
 {
-	struct list_head *lh;
+	unsigned long lh;
 	struct ptrlist neigh;
 	struct port *port;
 	struct player *player = _player;
 	struct system *origin = current_player_system(player);
 	long dist;
 
-	if (str_to_long((param ? param : DEF_PORT_RADIUS), &dist)) {
-		player_talk(player, "error: radius is not numeric\n");
+	dist = parse_radius(player, param);
+	if (dist < 0)
 		return 0;
-	}
-	dist *= TICK_PER_LY;
 
 	ptrlist_init(&neigh);
 	get_neighbouring_ports(&neigh, origin, dist);
@@ -681,34 +750,155 @@ end:
 }
 static char cmd_ports_help[] = "List ports within radius; if none is specified, default is " DEF_PORT_RADIUS;
 
-void player_go(struct player *player, enum postype postype, void *pos)
+static unsigned long route_length(const struct system *origin, const struct ptrlist * const route)
+{
+	unsigned long lh, total = 0;
+	struct system *system;
+
+	ptrlist_for_each_entry(system, route, lh) {
+		total += system_distance(origin, system);
+		origin = system;
+	}
+
+	return total;
+}
+
+static int show_route(struct player *player, char *param, const enum route_metric metric)
 {
+	unsigned long lh, cost, distance, total = 0;
+	struct ptrlist route;
+	struct system *origin = current_player_system(player);
+	struct system *dest, *system, *prev = origin;
+	int r;
+
+	if (!param) {
+		player_talk(player, "Route to where?\n");
+		return 1;
+	}
+
+	pthread_rwlock_rdlock(&univ.systemnames_lock);
+	dest = st_lookup_string(&univ.systemnames, param);
+	pthread_rwlock_unlock(&univ.systemnames_lock);
+
+	if (dest == NULL) {
+		player_talk(player, "System not found.\n");
+		return 1;
+	}
+
+	if (dest == origin) {
+		player_talk(player, "You are already in %s.\n", dest->name);
+		return 0;
+	}
+
+	ptrlist_init(&route);
+	r = route_find(&route, origin, dest, metric, &cost);
+	if (r < 0) {
+		player_talk(player, "error: out of memory\n");
+		goto end;
+	} else if (r > 0) {
+		player_talk(player, "No hyperspace route to %s found.\n", dest->name);
+		goto end;
+	}
+
+	player_talk(player, "Route to %s (%lu jumps, %.1f lys)\n"
+			"%-26s %-9s %-9s\n",
+			dest->name, ptrlist_len(&route), route_length(origin, &route) / (double)TICK_PER_LY,
+			"System", "Light yrs", "Total");
+
+	ptrlist_for_each_entry(system, &route, lh) {
+		distance = system_distance(prev, system);
+		total += distance;
+		player_talk(player, "%-26s %9.1f %9.1f\n", system->name,
+				distance / (double)TICK_PER_LY, total / (double)TICK_PER_LY);
+		prev = system;
+	}
+
+end:
+	ptrlist_free(&route);
+	return 0;
+}
+
+static int cmd_route(void *_player, char *param)
+{
+	return show_route(_player, param, ROUTE_DISTANCE);
+}
+static char cmd_route_help[] = "Show the shortest way by hyperspace to system";
+
+static int cmd_hops(void *_player, char *param)
+{
+	return show_route(_player, param, ROUTE_JUMPS);
+}
+static char cmd_hops_help[] = "Show the way by hyperspace to system with the fewest jumps";
+
+static long free_capacity(struct ship *ship)
+{
+	long capacity = ship->type->carry_weight;
+	struct cargo *c;
+
+	pthread_rwlock_rdlock(&ship->cargo_lock);
+	list_for_each_entry(c, &ship->cargo, list)
+		capacity -= c->amount * c->item->weight;
+	pthread_rwlock_unlock(&ship->cargo_lock);
+
+	return MAX(capacity, 0);
+}
+
+#define BESTROUTE_TRADES 10
+static int cmd_bestroute(void *_player, char *param)
+{
+	struct market_trade trades[BESTROUTE_TRADES];
+	struct player *player = _player;
+	struct system *origin = current_player_system(player);
+	unsigned int num;
+	long dist, capacity;
+
 	assert(player->postype == SHIP);
 	struct ship *ship = player->pos;
-	switch (ship->postype) {
-	case SYSTEM:
-		cli_rm_cmd(&player->cli, "go");
-		cli_rm_cmd(&player->cli, "map");
-		cli_rm_cmd(&player->cli, "jump");
-		cli_rm_cmd(&player->cli, "dock");
-		cli_rm_cmd(&player->cli, "orbit");
-		break;
-	case PORT:
-		cli_rm_cmd(&player->cli, "buy");
-		cli_rm_cmd(&player->cli, "leave");
-		cli_rm_cmd(&player->cli, "sell");
-		cli_rm_cmd(&player->cli, "trade");
-		break;
-	case PLANET:
-		cli_rm_cmd(&player->cli, "dock");
-		cli_rm_cmd(&player->cli, "leave");
-		break;
-	case NONE:
-		break;
-	default:
-		bug("I don't know where player %s with connection %p is\n", player->name, player->conn);
+
+	dist = parse_radius(player, param);
+	if (dist < 0)
+		return 0;
+
+	capacity = free_capacity(ship);
+	num = market_best_trades(origin, dist, capacity, player->credits,
+			trades, BESTROUTE_TRADES);
+
+	if (!num) {
+		player_talk(player, "There are no profitable trades within %ld lys\n",
+				dist / TICK_PER_LY);
+		return 0;
 	}
 
+	player_talk(player, "Best trades within %ld lys for %ld credits and %ld free capacity\n"
+			"%-16s %-20s %-20s %8s %10s %9s %10s\n",
+			dist / TICK_PER_LY, player->credits, capacity,
+			"Item", "Buy at", "Sell at", "Amount", "Profit", "Light yrs", "Per ly");
+
+	for (unsigned int i = 0; i < num; i++)
+		player_talk(player, "%-16.16s %-20.20s %-20.20s %8ld %10ld %9.1f %10.1f\n",
+				trades[i].item->name, trades[i].from->name, trades[i].to->name,
+				trades[i].amount, trades[i].profit,
+				trades[i].distance / (double)TICK_PER_LY,
+				trades[i].profit / MAX(trades[i].distance / (double)TICK_PER_LY, 1.0));
+
+	return 0;
+}
+static char cmd_bestroute_help[] = "List the most profitable trades per light year within radius; if none is specified, default is " DEF_PORT_RADIUS;
+
+/*
+ * All players share one command tree for each kind of location. The commands
+ * available everywhere are added to every tree, so that moving only means
+ * pointing player->cli to another tree and abbreviations are matched against
+ * all commands the player can use. The player is given to the commands by
+ * player_run_cmd().
+ */
+static struct st_node player_cli[PLANET + 1];
+
+void player_go(struct player *player, enum postype postype, void *pos)
+{
+	assert(player->postype == SHIP);
+	struct ship *ship = player->pos;
+
 	if (ship_go(ship, postype, pos))
 		player_talk(player, "You're not allowed to go there from here.\n");
 	else
@@ -716,21 +906,9 @@ void player_go(struct player *player, enum postype postype, void *pos)
 
 	switch (ship->postype) {
 	case SYSTEM:
-		cli_add_cmd(&player->cli, "go", cmd_hyper, player, cmd_hyper_help);
-		cli_add_cmd(&player->cli, "map", cmd_map, player, cmd_map_help);
-		cli_add_cmd(&player->cli, "jump", cmd_jump, player, cmd_jump_help);
-		cli_add_cmd(&player->cli, "dock", cmd_dock, player, cmd_dock_help);
-		cli_add_cmd(&player->cli, "orbit", cmd_orbit, player, cmd_orbit_help);
-		break;
 	case PORT:
-		cli_add_cmd(&player->cli, "buy", cmd_buy, player, cmd_buy_help);
-		cli_add_cmd(&player->cli, "leave", cmd_leave_port, player, cmd_leave_port_help);
-		cli_add_cmd(&player->cli, "sell", cmd_sell, player, cmd_sell_help);
-		cli_add_cmd(&player->cli, "trade", cmd_trade, player, cmd_trade_help);
-		break;
 	case PLANET:
-		cli_add_cmd(&player->cli, "dock", cmd_dock, player, cmd_dock_help);
-		cli_add_cmd(&player->cli, "leave", cmd_leave_planet, player, cmd_leave_planet_help);
+		player->cli = &player_cli[ship->postype];
 		break;
 	case NONE:
 		/* Fall through to default as NONE is only valid right after init */
@@ -739,6 +917,64 @@ void player_go(struct player *player, enum postype postype, void *pos)
 	}
 }
 
+static int add_global_cmds(struct st_node *root)
+{
+	int r = 0;
+
+	r |= cli_add_cmd(root, "help", cmd_help, NULL, cmd_help_help);
+	r |= cli_add_cmd(root, "inventory", cmd_inventory, NULL, cmd_inventory_help);
+	r |= cli_add_cmd(root, "quit", cmd_quit, NULL, cmd_quit_help);
+	r |= cli_add_cmd(root, "look", cmd_look, NULL, cmd_look_help);
+	r |= cli_add_cmd(root, "ships", cmd_show_ships, NULL, cmd_show_ships_help);
+	r |= cli_add_cmd(root, "ports", cmd_ports, NULL, cmd_ports_help);
+	r |= cli_add_cmd(root, "route", cmd_route, NULL, cmd_route_help);
+	r |= cli_add_cmd(root, "hops", cmd_hops, NULL, cmd_hops_help);
+	r |= cli_add_cmd(root, "bestroute", cmd_bestroute, NULL, cmd_bestroute_help);
+
+	return r;
+}
+
+int player_cli_init()
+{
+	struct st_node *root;
+	int r = 0;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(player_cli); i++) {
+		st_init(&player_cli[i]);
+		r |= add_global_cmds(&player_cli[i]);
+	}
+
+	root = &player_cli[SYSTEM];
+	r |= cli_add_cmd(root, "go", cmd_hyper, NULL, cmd_hyper_help);
+	r |= cli_add_cmd(root, "map", cmd_map, NULL, cmd_map_help);
+	r |= cli_add_cmd(root, "jump", cmd_jump, NULL, cmd_jump_help);
+	r |= cli_add_cmd(root, "dock", cmd_dock, NULL, cmd_dock_help);
+	r |= cli_add_cmd(root, "orbit", cmd_orbit, NULL, cmd_orbit_help);
+
+	root = &player_cli[PORT];
+	r |= cli_add_cmd(root, "buy", cmd_buy, NULL, cmd_buy_help);
+	r |= cli_add_cmd(root, "leave", cmd_leave_port, NULL, cmd_leave_port_help);
+	r |= cli_add_cmd(root, "sell", cmd_sell, NULL, cmd_sell_help);
+	r |= cli_add_cmd(root, "trade", cmd_trade, NULL, cmd_trade_help);
+
+	root = &player_cli[PLANET];
+	r |= cli_add_cmd(root, "dock", cmd_dock, NULL, cmd_dock_help);
+	r |= cli_add_cmd(root, "leave", cmd_leave_planet, NULL, cmd_leave_planet_help);
+
+	return r;
+}
+
+void player_cli_free()
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(player_cli); i++)
+		cli_tree_destroy(&player_cli[i]);
+}
+
+int player_run_cmd(struct player *player, const char * const cmd)
+{
+	return cli_run_cmd_on(player->cli, cmd, player);
+}
+
 int player_init(struct player *player)
 {
 	memset(player, 0, sizeof(*player));
@@ -747,15 +983,8 @@ int player_init(struct player *player)
 		return -1;
 
 	INIT_LIST_HEAD(&player->list);
-	INIT_LIST_HEAD(&player->cli);
 	INIT_LIST_HEAD(&player->ships);
-
-	cli_add_cmd(&player->cli, "help", cmd_help, player, cmd_help_help);
-	cli_add_cmd(&player->cli, "inventory", cmd_inventory, player, cmd_inventory_help);
-	cli_add_cmd(&player->cli, "quit", cmd_quit, player, cmd_quit_help);
-	cli_add_cmd(&player->cli, "look", cmd_look, player, cmd_look_help);
-	cli_add_cmd(&player->cli, "ships", cmd_show_ships, player, cmd_show_ships_help);
-	cli_add_cmd(&player->cli, "ports", cmd_ports, player, cmd_ports_help);
+	player->cli = &player_cli[NONE];
 
 	return 0;
 }
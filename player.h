@@ -3,6 +3,7 @@
 
 #include "list.h"
 #include "ship.h"
+#include "stringtree.h"
 
 struct player {
 	char *name;
@@ -11,10 +12,14 @@ struct player {
 	void *pos;
 	struct list_head ships;
 	struct list_head list;
-	struct list_head cli;
+	const struct st_node *cli;
 	struct connection *conn;
 };
 
+int player_cli_init();
+void player_cli_free();
+int player_run_cmd(struct player *player, const char * const cmd);
+
 int player_init(struct player *player);
 void player_free(struct player *player);
 void player_talk(struct player *player, char *format, ...);
@@ -12,8 +12,47 @@
 #include "mtrandom.h"
 #include "planet.h"
 #include "planet_type.h"
+#include "price.h"
 #include "universe.h"
 
+static void stock_free(struct port_stock *stock)
+{
+	/* All arrays are in one allocation, see port_stock_alloc() */
+	free(stock->amount);
+	memset(stock, 0, sizeof(*stock));
+}
+
+/*
+ * The arrays of a stock are allocated together, with the ones the economy
+ * update goes through every tick first, so that updating a port touches
+ * as few cache lines as possible. The requirements are rounded up to a
+ * whole number of longs to keep the arrays after them aligned.
+ */
+int port_stock_alloc(struct port_stock *stock, const unsigned int len, const unsigned int num_req)
+{
+	const size_t reqs = (len + 1 + num_req) * sizeof(unsigned int);
+	const size_t req_longs = (reqs + sizeof(long) - 1) / sizeof(long);
+	long *longs;
+
+	longs = calloc(7 * len + req_longs + len, sizeof(long));
+	if (!longs)
+		return -1;
+
+	stock->len = len;
+	stock->amount = longs;
+	stock->max = longs + len;
+	stock->daily_change = longs + 2 * len;
+	stock->req_start = (unsigned int*)(longs + 3 * len);
+	stock->req = stock->req_start + len + 1;
+	stock->price = longs + 3 * len + req_longs;
+	stock->base_price = stock->price + len;
+	stock->inverse_max = stock->price + 2 * len;
+	stock->demand = stock->price + 3 * len;
+	stock->item = (struct item**)(stock->price + 4 * len);
+
+	return 0;
+}
+
 void port_free(struct port *b)
 {
 	if (b->name) {
@@ -21,12 +60,7 @@ void port_free(struct port *b)
 		free(b->name);
 	}
 
-	struct cargo *c, *_c;
-	list_for_each_entry_safe(c, _c, &b->items, list) {
-		list_del(&c->list);
-		cargo_free(c);
-		free(c);
-	}
+	stock_free(&b->stock);
 
 	pthread_rwlock_destroy(&b->items_lock);
 	st_destroy(&b->item_names, ST_DONT_FREE_DATA);
@@ -34,61 +68,99 @@ void port_free(struct port *b)
 	free(b);
 }
 
-static void port_init(struct port *port)
+void port_init(struct port *port)
 {
 	memset(port, 0, sizeof(*port));
-	INIT_LIST_HEAD(&port->items);
 	pthread_rwlock_init(&port->items_lock, NULL);
-	INIT_LIST_HEAD(&port->item_names);
+	st_init(&port->item_names);
 	ptrlist_init(&port->players);
 }
 
+/*
+ * Returns the index of an item in port->stock, or -1 if the port doesn't
+ * trade in it.
+ */
+long port_item_index(struct port *port, const char * const name)
+{
+	struct item **item = st_lookup_string(&port->item_names, name);
+
+	if (!item)
+		return -1;
+
+	return item - port->stock.item;
+}
+
 #define PORT_CARGO_RANDOMNESS 0.5
+static void add_stock_item(struct port *port, const unsigned int i, const struct cargo * const port_cargo)
+{
+	struct port_stock *stock = &port->stock;
+	long amount;
+
+	stock->item[i] = port_cargo->item;
+	stock->max[i] = port_cargo->max * (1 - PORT_CARGO_RANDOMNESS)
+		+ mtrandom_ulong(port_cargo->max * PORT_CARGO_RANDOMNESS * 2);
+	stock->daily_change[i] = port_cargo->daily_change * (1 - PORT_CARGO_RANDOMNESS)
+		+ mtrandom_long(port_cargo->daily_change * PORT_CARGO_RANDOMNESS * 2);
+
+	amount = mtrandom_ulong(stock->max[i]);
+	if (amount > 10)
+		amount = pow(5, log10(amount));
+	stock->amount[i] = amount;
+}
+
 static int port_genesis(struct port *port, struct planet *planet)
 {
+	struct port_stock *stock = &port->stock;
+	unsigned int len = 0, num_req = 0, i, r;
+
 	port->planet = planet;
 	port->system = planet->system;
 	port->type = ptrlist_random(&planet->type->port_types);
 	port->docks = 1; /* FIXME */
 
-	struct cargo *port_cargo, *cargo, *req;
-	struct list_head *lh;
+	struct cargo *port_cargo, *req;
+	unsigned long lh;
 	list_for_each_entry(port_cargo, &port->type->items, list) {
-		cargo = malloc(sizeof(*cargo));
-		if (!cargo)
-			goto err;
-		cargo_init(cargo);
+		len++;
+		num_req += ptrlist_len(&port_cargo->requires);
+	}
 
-		cargo->item = port_cargo->item;
-		cargo->max = port_cargo->max * (1 - PORT_CARGO_RANDOMNESS)
-			+ mtrandom_ulong(port_cargo->max * PORT_CARGO_RANDOMNESS * 2);
-		cargo->daily_change = port_cargo->daily_change * (1 - PORT_CARGO_RANDOMNESS)
-			+ mtrandom_long(port_cargo->daily_change * PORT_CARGO_RANDOMNESS * 2);
-		cargo->price = port_cargo->item->base_price;
+	if (port_stock_alloc(stock, len, num_req))
+		goto err;
 
-		cargo->amount = mtrandom_ulong(cargo->max);
-		if (cargo->amount > 10)
-			cargo->amount = pow(5, log10(cargo->amount));
+	/*
+	 * Items without requirements go first, so they can all be updated
+	 * together. We can't fill in the requirements before all the port
+	 * items are registered in the string tree or we wouldn't be able to
+	 * look them up.
+	 */
+	i = 0;
+	list_for_each_entry(port_cargo, &port->type->items, list) {
+		if (!ptrlist_len(&port_cargo->requires))
+			add_stock_item(port, i++, port_cargo);
+	}
+	stock->num_plain = i;
+	list_for_each_entry(port_cargo, &port->type->items, list) {
+		if (ptrlist_len(&port_cargo->requires))
+			add_stock_item(port, i++, port_cargo);
+	}
 
-		if (st_add_string(&port->item_names, cargo->item->name, cargo))
+	for (i = 0; i < stock->len; i++) {
+		if (st_add_string(&port->item_names, stock->item[i]->name, &stock->item[i]))
 			goto err;
-
-		list_add(&cargo->list, &port->items);
 	}
 
-	/*
-	 * We can't copy the requirement lists before all the port items are constructed
-	 * and registered in the string tree or we wouldn't be able to look them up.
-	 */
-	list_for_each_entry(port_cargo, &port->type->items, list) {
-		cargo = st_lookup_string(&port->item_names, port_cargo->item->name);
+	r = 0;
+	for (i = 0; i < stock->len; i++) {
+		stock->req_start[i] = r;
+		port_cargo = st_lookup_string(&port->type->item_names, stock->item[i]->name);
 		ptrlist_for_each_entry(req, &port_cargo->requires, lh)
-			ptrlist_push(&cargo->requires, st_lookup_string(&port->item_names, req->item->name));
+			stock->req[r++] = port_item_index(port, req->item->name);
 	}
+	stock->req_start[i] = r;
 
-	port->name = create_unique_name(&univ.avail_port_names);
-
-	list_add(&port->list, &univ.ports);
+	price_init(stock);
+	price_update(stock);
 
 	return 0;
 
@@ -113,21 +185,38 @@ void port_populate_planet(struct planet* planet)
 		num = 0;
 	}
 
-	pthread_rwlock_wrlock(&univ.portnames_lock);
-
 	for (int i = 0; i < num; i++) {
 		b = malloc(sizeof(*b));
 		if (!b)
-			goto unlock;
+			return;
 		port_init(b);
-		if (port_genesis(b, planet)) {
-			free(b);
-			goto unlock;
-		}
+		if (port_genesis(b, planet))
+			return;
 		ptrlist_push(&planet->ports, b);
-		st_add_string(&univ.portnames, b->name, b);
 	}
+}
+
+/*
+ * Names the port and adds it to the universe. This is done separately from
+ * creating the port, so that ports can be created in parallel but still be
+ * named in the same order every time.
+ */
+int port_register(struct port *port)
+{
+	port->name = create_unique_name(&univ.avail_port_names);
+	if (!port->name)
+		return -1;
+
+	pthread_rwlock_wrlock(&univ.ports_lock);
+	if (ptrlist_push(&univ.ports, port)) {
+		pthread_rwlock_unlock(&univ.ports_lock);
+		return -1;
+	}
+	pthread_rwlock_unlock(&univ.ports_lock);
 
-unlock:
+	pthread_rwlock_wrlock(&univ.portnames_lock);
+	st_add_string(&univ.portnames, port->name, port);
 	pthread_rwlock_unlock(&univ.portnames_lock);
+
+	return 0;
 }
@@ -2,11 +2,38 @@
 #define _HAS_PORT_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "list.h"
 #include "parseconfig.h"
 #include "planet.h"
 #include "port_type.h"
 #include "ptrlist.h"
+#include "stringtree.h"
+
+struct item;
+struct market_port;
+
+/*
+ * The items of a port are stored as one array per property, so the economy
+ * update can go through all amounts without following pointers. Items that
+ * don't require anything come first, followed by the ones that do. Item i
+ * requires the items with the indices req[req_start[i]] up to, but not
+ * including, req[req_start[i + 1]].
+ */
+struct port_stock {
+	unsigned int len;
+	unsigned int num_plain;		/* Items without requirements */
+	struct item **item;
+	long *amount;
+	long *max;
+	long *daily_change;
+	long *price;
+	long *base_price;
+	long *inverse_max;		/* See price.c */
+	long *demand;			/* How full the region is, see price.c */
+	unsigned int *req_start;
+	unsigned int *req;
+};
 
 struct port {
 	char *name;
@@ -14,14 +41,20 @@ struct port {
 	int docks;
 	struct planet *planet;
 	struct system *system;
-	struct list_head items;
+	struct port_stock stock;
 	pthread_rwlock_t items_lock;
-	struct list_head item_names;
+	struct st_node item_names;	/* Points into stock.item */
 	struct ptrlist players;
-	struct list_head list;
+	unsigned long updated_tick;	/* Last economy tick applied to items */
+	uint64_t journal_seq;		/* Last journal record applied to items */
+	struct market_port *market;	/* Its items in the market index */
 };
 
+void port_init(struct port *port);
+int port_stock_alloc(struct port_stock *stock, const unsigned int len, const unsigned int num_req);
 void port_populate_planet(struct planet* planet);
+int port_register(struct port *port);
+long port_item_index(struct port *port, const char * const name);
 
 void port_free(struct port *b);
 
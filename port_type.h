@@ -2,6 +2,7 @@
 #define _HAS_PORT_TYPE_H
 
 #include "list.h"
+#include "stringtree.h"
 #include "universe.h"
 
 enum port_zone {
@@ -19,7 +20,7 @@ struct port_type {
 	char *desc;
 	struct list_head list;
 	struct list_head items;
-	struct list_head item_names;
+	struct st_node item_names;
 	int zones[PORT_ZONE_NUM];
 };
 
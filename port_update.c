@@ -4,18 +4,24 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include "port.h"
-#include "cargo.h"
+#include "common.h"
 #include "item.h"
 #include "log.h"
+#include "market.h"
+#include "port_update.h"
+#include "price.h"
+#include "ptrlist.h"
 #include "universe.h"
 
 #define PORT_UPDATE_INTERVAL 10		/* in seconds, no larger than once a day */
 
 #define SECONDS_PER_DAY (24 * 60 * 60)
 #define PORT_UPDATE_FRACTION (SECONDS_PER_DAY / PORT_UPDATE_INTERVAL)
+#define PORT_PRICE_TICKS 6		/* Ticks between price updates */
 
 pthread_t thread;
 int terminate;
@@ -24,83 +30,328 @@ pthread_condattr_t termination_attr;
 pthread_cond_t termination_cond;
 pthread_mutex_t termination_lock;
 
-static void update_port(struct port *port, uint32_t iteration)
+/*
+ * The ports are updated by a pool of threads. The thread driving the ticks
+ * works on the tick as well, so a pool of n threads has n - 1 helpers.
+ * Ports are claimed PORT_UPDATE_CHUNK at a time from a shared index, which
+ * spreads the work evenly even if some ports have more items than others.
+ *
+ * A tick must be done before the next one is due. Threads stop claiming
+ * ports when the deadline has passed, and the next tick starts with the
+ * ports that were left, so every port is updated in turn even if the pool
+ * can't keep up. The ports that were left catch up on the ticks they missed
+ * when they are updated.
+ */
+#define PORT_UPDATE_CHUNK 256
+
+struct port_update_pool {
+	pthread_t *helpers;
+	unsigned int num_helpers;
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	int terminate;
+	unsigned long generation;	/* Incremented for every tick */
+	unsigned int running;		/* Helpers still working on this tick */
+
+	unsigned long tick;
+	struct timespec deadline;
+	unsigned long offset;		/* Index of the first port in this tick */
+	unsigned long num_ports;
+	unsigned long next;		/* Next port to claim, counted from offset */
+	unsigned long updated;
+
+	pthread_mutex_t stats_lock;
+	struct port_update_stats stats;
+};
+
+static struct port_update_pool pool;
+
+static enum port_update_mode mode;
+static struct timespec epoch;
+/*
+ * The economy goes on from the last tick applied to any port, so that ticks
+ * saved in snapshots and the journal still mean the same after a restart.
+ * No time passes in the economy while the server isn't running.
+ */
+static unsigned long first_tick;
+
+/*
+ * How much of daily_change is produced from the start until tick. The change
+ * between two ticks is the difference, which spreads the fractions of a unit
+ * evenly over the day no matter how many ticks are done at once.
+ */
+static long produced(const long daily_change, const unsigned long tick)
 {
-	struct cargo *cargo;
-	long change, mod, fraction_iteration;
+	return daily_change * (long)tick / PORT_UPDATE_FRACTION;
+}
 
-	pthread_rwlock_wrlock(&port->items_lock);
+/*
+ * Adds change to n amounts, keeping them between zero and max, a vector of
+ * amounts at a time. Comparisons give vectors of all ones (-1) where they
+ * are true, which select the lanes to keep.
+ */
+static void add_within_limits(long * restrict amount, const long * restrict max,
+		const long * restrict change, const unsigned long n)
+{
+	unsigned long i = 0;
+
+	for (; i + LONG_VECTOR_LEN <= n; i += LONG_VECTOR_LEN) {
+		const long_vector m = LONG_VECTOR_AT(max + i);
+		long_vector a = LONG_VECTOR_AT(amount + i) + LONG_VECTOR_AT(change + i);
+		long_vector over;
+
+		a &= ~(a < 0);
+		over = a > m;
+		LONG_VECTOR_AT(amount + i) = (a & ~over) | (m & over);
+	}
+
+	for (; i < n; i++) {
+		long a = amount[i] + change[i];
+
+		a = a < 0 ? 0 : a;
+		amount[i] = a > max[i] ? max[i] : a;
+	}
+}
+
+#define PORT_UPDATE_BATCH 64
+
+/*
+ * Brings the stock of a port up to tick. Ports that have missed ticks are
+ * caught up in a single step, so a port left alone for a long time costs
+ * no more to update than one updated every tick. port->items_lock must be
+ * held for writing.
+ */
+void port_catch_up_to(struct port *port, const unsigned long tick)
+{
+	struct port_stock *stock = &port->stock;
+	long changes[PORT_UPDATE_BATCH];
+	long change, *req;
+	unsigned long n;
+	unsigned int i, r;
 
-	list_for_each_entry(cargo, &port->items, list) {
-		if (!cargo->daily_change)
+	if (port->updated_tick >= tick)
+		return;
+
+	for (unsigned long start = 0; start < stock->num_plain; start += PORT_UPDATE_BATCH) {
+		n = MIN(PORT_UPDATE_BATCH, stock->num_plain - start);
+
+		for (i = 0; i < n; i++)
+			changes[i] = produced(stock->daily_change[start + i], tick)
+				- produced(stock->daily_change[start + i], port->updated_tick);
+
+		add_within_limits(stock->amount + start, stock->max + start, changes, n);
+	}
+
+	for (i = stock->num_plain; i < stock->len; i++) {
+		if (!stock->daily_change[i])
 			continue;
 
-		change = cargo->daily_change / PORT_UPDATE_FRACTION;
-		mod = cargo->daily_change % PORT_UPDATE_FRACTION;
-		fraction_iteration = PORT_UPDATE_FRACTION / cargo->daily_change;
+		change = produced(stock->daily_change[i], tick)
+			- produced(stock->daily_change[i], port->updated_tick);
 
-		if (mod && fraction_iteration && iteration % fraction_iteration == 0) {
-			if (cargo->daily_change > 0)
-				change++;
-			else if (cargo->daily_change < 0)
-				change--;
-		}
+		if (change < 0 && stock->amount[i] < -change)
+			change = -stock->amount[i];
+		else if (change > 0 && stock->max[i] - stock->amount[i] < change)
+			change = stock->max[i] - stock->amount[i];
 
-		if (change < 0 && cargo->amount < -change)
-			change = -cargo->amount;
-		else if (change > 0 && cargo->max - cargo->amount < change)
-			change = cargo->max - cargo->amount;
-
-		struct cargo *req;
-		struct list_head *lh;
-		ptrlist_for_each_entry(req, &cargo->requires, lh) {
-			if (change > 0 && req->amount < change)
-				change = req->amount;
-			else if (change < 0 && req->amount < -change)
-				change = -req->amount;
+		for (r = stock->req_start[i]; r < stock->req_start[i + 1]; r++) {
+			req = &stock->amount[stock->req[r]];
+			if (change > 0 && *req < change)
+				change = *req;
+			else if (change < 0 && *req < -change)
+				change = -*req;
 		}
 
-		cargo->amount += change;
+		stock->amount[i] += change;
 
-		if (change < 0) {
-			ptrlist_for_each_entry(req, &cargo->requires, lh)
-				req->amount += change;
-		} else {
-			ptrlist_for_each_entry(req, &cargo->requires, lh)
-				req->amount -= change;
+		for (r = stock->req_start[i]; r < stock->req_start[i + 1]; r++) {
+			if (change < 0)
+				stock->amount[stock->req[r]] += change;
+			else
+				stock->amount[stock->req[r]] -= change;
 		}
 	}
 
+	/*
+	 * Amounts change slowly, so prices are only brought up to date every
+	 * few ticks, which keeps the tick as fast as it was before prices
+	 * changed at all. Trades update prices at once.
+	 */
+	if (tick / PORT_PRICE_TICKS != port->updated_tick / PORT_PRICE_TICKS)
+		price_update(stock);
+
+	port->updated_tick = tick;
+
+	market_update_port(port);
+}
+
+/*
+ * Brings the stock of a port up to tick, as a periodic update does.
+ */
+void port_update(struct port *port, const unsigned long tick)
+{
+	pthread_rwlock_wrlock(&port->items_lock);
+	port_catch_up_to(port, tick);
 	pthread_rwlock_unlock(&port->items_lock);
 }
 
-static void update_all_ports(uint32_t iteration)
+/*
+ * In lazy mode, ports are only updated when someone looks at them. The
+ * caller must hold port->items_lock for writing.
+ */
+void port_catch_up(struct port *port)
 {
-	struct port *port;
+	struct timespec now;
 
-	list_for_each_entry(port, &univ.ports, list)
-		update_port(port, iteration);
+	if (mode != PORT_UPDATE_LAZY)
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return;
+
+	port_catch_up_to(port, first_tick + (now.tv_sec - epoch.tv_sec) / PORT_UPDATE_INTERVAL + 1);
+}
+
+static int deadline_passed(const struct timespec * const deadline)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+
+	return now.tv_sec > deadline->tv_sec ||
+		(now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static unsigned long usec_between(const struct timespec * const start,
+		const struct timespec * const end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void update_ports(void)
+{
+	unsigned long first, last, updated = 0;
+
+	while (!deadline_passed(&pool.deadline)) {
+		first = __sync_fetch_and_add(&pool.next, PORT_UPDATE_CHUNK);
+		if (first >= pool.num_ports)
+			break;
+		last = MIN(first + PORT_UPDATE_CHUNK, pool.num_ports);
+
+		for (unsigned long i = first; i < last; i++)
+			port_update(ptrlist_entry(&univ.ports, (pool.offset + i) % pool.num_ports),
+					pool.tick);
+
+		updated += last - first;
+	}
+
+	__sync_add_and_fetch(&pool.updated, updated);
+}
+
+static void* port_update_helper(void *ptr)
+{
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.terminate && pool.generation == generation)
+			pthread_cond_wait(&pool.start_cond, &pool.lock);
+		if (pool.terminate)
+			break;
+		generation = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		update_ports();
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+			pthread_cond_signal(&pool.done_cond);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void record_tick(const struct timespec * const start, const struct timespec * const end,
+		const unsigned long num_ports, const unsigned long updated)
+{
+	const unsigned long usec = usec_between(start, end);
+	struct port_update_stats *stats = &pool.stats;
+
+	pthread_mutex_lock(&pool.stats_lock);
+	stats->ticks++;
+	stats->num_ports = num_ports;
+	stats->last_usec = usec;
+	stats->total_usec += usec;
+	stats->max_usec = MAX(stats->max_usec, usec);
+	if (updated < num_ports) {
+		stats->overruns++;
+		stats->deferred += num_ports - updated;
+	}
+	pthread_mutex_unlock(&pool.stats_lock);
+
+	if (updated < num_ports)
+		log_printfn(LOG_PORT_UPDATE, "tick missed its deadline after %lu ms, %lu of %lu ports deferred",
+				usec / 1000, num_ports - updated, num_ports);
+}
+
+static void update_all_ports(const unsigned long tick, const struct timespec * const deadline)
+{
+	struct timespec start, end;
+	unsigned long num_ports, updated;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start))
+		return;
+
+	pthread_rwlock_rdlock(&univ.ports_lock);
+
+	pthread_mutex_lock(&pool.lock);
+	num_ports = ptrlist_len(&univ.ports);
+	if (pool.offset >= num_ports)
+		pool.offset = 0;
+	pool.num_ports = num_ports;
+	pool.tick = tick;
+	pool.deadline = *deadline;
+	pool.next = 0;
+	pool.updated = 0;
+	pool.running = pool.num_helpers;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	update_ports();
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running)
+		pthread_cond_wait(&pool.done_cond, &pool.lock);
+	updated = pool.updated;
+	if (num_ports)
+		pool.offset = (pool.offset + updated) % num_ports;
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_rwlock_unlock(&univ.ports_lock);
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &end))
+		record_tick(&start, &end, num_ports, updated);
 }
 
 static void* port_update_worker(void *ptr)
 {
 	struct timespec next, now;
-	uint32_t iteration = 0;
+	unsigned long tick = first_tick;
 
 	if (clock_gettime(CLOCK_MONOTONIC, &next))
 		goto clock_err;
+	now = next;
 
 	do {
-		pthread_rwlock_rdlock(&univ.ports_lock);
-		update_all_ports(iteration);
-		pthread_rwlock_unlock(&univ.ports_lock);
-
-		iteration++;
-		if (iteration >= PORT_UPDATE_FRACTION)
-			iteration = 0;
-
 		next.tv_sec += PORT_UPDATE_INTERVAL;
 
+		tick++;
+		update_all_ports(tick, &next);
+
 		do {
 			pthread_mutex_lock(&termination_lock);
 			if (terminate) {
@@ -115,6 +366,13 @@ static void* port_update_worker(void *ptr)
 
 		} while (!terminate && now.tv_sec < next.tv_sec);
 
+		/*
+		 * Don't try to catch up on ticks if we've fallen behind, that
+		 * would only make the following ticks miss their deadlines too.
+		 */
+		if (now.tv_sec > next.tv_sec)
+			next = now;
+
 	} while (!terminate);
 
 	return NULL;
@@ -124,15 +382,109 @@ clock_err:
 	return NULL;
 }
 
-int start_updating_ports(void)
+void port_update_get_stats(struct port_update_stats *stats)
+{
+	pthread_mutex_lock(&pool.stats_lock);
+	*stats = pool.stats;
+	pthread_mutex_unlock(&pool.stats_lock);
+}
+
+static void stop_helpers(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.terminate = 1;
+	pthread_cond_broadcast(&pool.start_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (unsigned int i = 0; i < pool.num_helpers; i++)
+		pthread_join(pool.helpers[i], NULL);
+
+	free(pool.helpers);
+	pool.helpers = NULL;
+	pool.num_helpers = 0;
+}
+
+static int start_helpers(const unsigned int num)
+{
+	pool.helpers = malloc(num * sizeof(*pool.helpers));
+	if (num && !pool.helpers)
+		return -1;
+
+	for (pool.num_helpers = 0; pool.num_helpers < num; pool.num_helpers++) {
+		if (pthread_create(&pool.helpers[pool.num_helpers], NULL, port_update_helper, NULL)) {
+			stop_helpers();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int init_pool(void)
+{
+	memset(&pool, 0, sizeof(pool));
+
+	if (pthread_mutex_init(&pool.lock, NULL))
+		goto err;
+	if (pthread_cond_init(&pool.start_cond, NULL))
+		goto err_free_lock;
+	if (pthread_cond_init(&pool.done_cond, NULL))
+		goto err_free_start;
+	if (pthread_mutex_init(&pool.stats_lock, NULL))
+		goto err_free_done;
+
+	return 0;
+
+err_free_done:
+	pthread_cond_destroy(&pool.done_cond);
+err_free_start:
+	pthread_cond_destroy(&pool.start_cond);
+err_free_lock:
+	pthread_mutex_destroy(&pool.lock);
+err:
+	return -1;
+}
+
+static void free_pool(void)
+{
+	pthread_mutex_destroy(&pool.stats_lock);
+	pthread_cond_destroy(&pool.done_cond);
+	pthread_cond_destroy(&pool.start_cond);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+/*
+ * Starts updating ports. In periodic mode, all ports are updated every
+ * PORT_UPDATE_INTERVAL seconds by num_threads threads in total.
+ */
+int start_updating_ports(const enum port_update_mode update_mode, const unsigned int num_threads)
 {
 	sigset_t old, new;
+	struct port *port;
+	unsigned long lh;
+
+	mode = update_mode;
+	if (clock_gettime(CLOCK_MONOTONIC, &epoch))
+		goto err;
+
+	first_tick = 0;
+	ptrlist_for_each_entry(port, &univ.ports, lh)
+		first_tick = MAX(first_tick, port->updated_tick);
+
+	if (mode == PORT_UPDATE_LAZY) {
+		log_printfn(LOG_PORT_UPDATE, "updating %lu ports lazily when they are traded with",
+				ptrlist_len(&univ.ports));
+		return 0;
+	}
 
 	sigfillset(&new);
 
-	if (pthread_condattr_init(&termination_attr))
+	if (init_pool())
 		goto err;
 
+	if (pthread_condattr_init(&termination_attr))
+		goto err_free_pool;
+
 	if (pthread_condattr_setclock(&termination_attr, CLOCK_MONOTONIC))
 		goto err_free_attr;
 
@@ -145,36 +497,53 @@ int start_updating_ports(void)
 	if (pthread_sigmask(SIG_SETMASK, &new, &old))
 		goto err_free_mutex;
 
+	if (start_helpers(MAX(num_threads, 1) - 1))
+		goto err_restore_sigmask;
+
 	if (pthread_create(&thread, NULL, port_update_worker, NULL))
-		goto err_free_cond;
+		goto err_stop_helpers;
 
 	if (pthread_sigmask(SIG_SETMASK, &old, NULL))
 		goto err_cancel_thread;
 
+	log_printfn(LOG_PORT_UPDATE, "updating %lu ports every %d seconds using %u threads",
+			ptrlist_len(&univ.ports), PORT_UPDATE_INTERVAL, pool.num_helpers + 1);
+
 	return 0;
 
 err_cancel_thread:
 	pthread_cancel(thread);
-err_free_cond:
+	pthread_join(thread, NULL);
+err_stop_helpers:
+	stop_helpers();
+err_restore_sigmask:
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 	pthread_cond_destroy(&termination_cond);
 err_free_mutex:
 	pthread_mutex_destroy(&termination_lock);
 err_free_attr:
 	pthread_condattr_destroy(&termination_attr);
+err_free_pool:
+	free_pool();
 err:
 	return -1;
 }
 
 void stop_updating_ports(void)
 {
+	if (mode == PORT_UPDATE_LAZY)
+		return;
+
 	pthread_mutex_lock(&termination_lock);
 	terminate = 1;
 	pthread_cond_signal(&termination_cond);
 	pthread_mutex_unlock(&termination_lock);
 
 	pthread_join(thread, NULL);
+	stop_helpers();
 
 	pthread_cond_destroy(&termination_cond);
 	pthread_condattr_destroy(&termination_attr);
 	pthread_mutex_destroy(&termination_lock);
+	free_pool();
 }
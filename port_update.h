@@ -1,7 +1,28 @@
 #ifndef _HAS_PORT_UPDATE_H
 #define _HAS_PORT_UPDATE_H
 
-int start_updating_ports(void);
+struct port;
+
+enum port_update_mode {
+	PORT_UPDATE_PERIODIC,
+	PORT_UPDATE_LAZY
+};
+
+struct port_update_stats {
+	unsigned long ticks;
+	unsigned long overruns;		/* Ticks that missed their deadline */
+	unsigned long deferred;		/* Port updates skipped by those ticks */
+	unsigned long num_ports;	/* Ports in the last tick */
+	unsigned long last_usec;
+	unsigned long max_usec;
+	unsigned long total_usec;
+};
+
+int start_updating_ports(const enum port_update_mode update_mode, const unsigned int num_threads);
 void stop_updating_ports(void);
+void port_catch_up(struct port *port);
+void port_catch_up_to(struct port *port, const unsigned long tick);
+void port_update(struct port *port, const unsigned long tick);
+void port_update_get_stats(struct port_update_stats *stats);
 
 #endif
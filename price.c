@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include "common.h"
+#include "item.h"
+#include "port.h"
+#include "price.h"
+
+/*
+ * The price of an item at a port follows how full the port is, and how
+ * full the ports around it are. An empty port asks twice the base price of
+ * the item and a full one half of it, in a straight line between. How full
+ * the region is, i.e. the cell of the port in the market index, counts as
+ * much as the port itself, so a port surrounded by ports that have plenty
+ * of an item can't ask much for it.
+ *
+ * Fills are fractions of PRICE_ONE. To keep divisions out of the port tick,
+ * every max has an inverse computed once, and the fill is the amount times
+ * the inverse, shifted down. The region's fill in stock->demand is kept up
+ * to date by the market index, see market_update_port().
+ *
+ * Prices change with every unit bought or sold, so the price of a large
+ * order is the sum of the prices of every unit. As prices fall in a
+ * straight line, that is the number of units times the average of the
+ * prices of the first and the last unit.
+ */
+#define PRICE_SHIFT 10
+#define PRICE_ONE (1L << PRICE_SHIFT)
+#define PRICE_INVERSE_SHIFT 32
+#define PRICE_EMPTY (2 * PRICE_ONE)	/* Of the base price */
+#define PRICE_FULL (PRICE_ONE / 2)
+#define PRICE_LOCAL_WEIGHT (PRICE_ONE / 2)
+
+/*
+ * Returns the inverse of max to pass to price_fill(), which is 0 if max is.
+ */
+long price_inverse(const long max)
+{
+	if (max <= 0)
+		return 0;
+
+	return (PRICE_ONE << PRICE_INVERSE_SHIFT) / max;
+}
+
+/*
+ * Returns how full a stock of amount out of the max that inverse was
+ * computed from is, as a fraction of PRICE_ONE. amount must be no more
+ * than max.
+ */
+long price_fill(const long amount, const long inverse)
+{
+	return (amount * inverse) >> PRICE_INVERSE_SHIFT;
+}
+
+static long unit_price(const long base_price, const long fill, const long demand)
+{
+	const long f = (fill * PRICE_LOCAL_WEIGHT + demand * (PRICE_ONE - PRICE_LOCAL_WEIGHT)) >> PRICE_SHIFT;
+
+	return (base_price * (PRICE_EMPTY - (((PRICE_EMPTY - PRICE_FULL) * f) >> PRICE_SHIFT))) >> PRICE_SHIFT;
+}
+
+/*
+ * Computes the prices of n items, a vector of items at a time, the same
+ * way as unit_price().
+ */
+static void compute_prices(long * restrict price, const long * restrict base_price,
+		const long * restrict amount, const long * restrict inverse,
+		const long * restrict demand, const unsigned long n)
+{
+	unsigned long i = 0;
+
+	for (; i + LONG_VECTOR_LEN <= n; i += LONG_VECTOR_LEN) {
+		const long_vector fill = (LONG_VECTOR_AT(amount + i) * LONG_VECTOR_AT(inverse + i))
+			>> PRICE_INVERSE_SHIFT;
+		const long_vector f = (fill * PRICE_LOCAL_WEIGHT
+				+ LONG_VECTOR_AT(demand + i) * (PRICE_ONE - PRICE_LOCAL_WEIGHT)) >> PRICE_SHIFT;
+
+		LONG_VECTOR_AT(price + i) = (LONG_VECTOR_AT(base_price + i)
+				* (PRICE_EMPTY - (((PRICE_EMPTY - PRICE_FULL) * f) >> PRICE_SHIFT))) >> PRICE_SHIFT;
+	}
+
+	for (; i < n; i++)
+		price[i] = unit_price(base_price[i], price_fill(amount[i], inverse[i]), demand[i]);
+}
+
+/*
+ * Sets up the pricing of a stock whose items, amounts and maxes have been
+ * filled in, but leaves the prices alone. Until the market index says
+ * otherwise, the region is taken to be as full as the port.
+ */
+void price_init(struct port_stock *stock)
+{
+	for (unsigned int i = 0; i < stock->len; i++) {
+		stock->base_price[i] = stock->item[i]->base_price;
+		stock->inverse_max[i] = price_inverse(stock->max[i]);
+		stock->demand[i] = price_fill(stock->amount[i], stock->inverse_max[i]);
+	}
+}
+
+/*
+ * Brings the prices of a stock up to date with the amounts. The caller
+ * must hold the items_lock of the port for writing.
+ */
+void price_update(struct port_stock *stock)
+{
+	compute_prices(stock->price, stock->base_price, stock->amount, stock->inverse_max,
+			stock->demand, stock->len);
+}
+
+static long price_at(const struct port_stock * const stock, const unsigned int i, const long amount)
+{
+	return unit_price(stock->base_price[i], price_fill(amount, stock->inverse_max[i]),
+			stock->demand[i]);
+}
+
+/*
+ * Returns what amount of item i costs to buy from the port, which must have
+ * at least that many. The caller must hold the items_lock of the port.
+ */
+long price_buy(const struct port_stock * const stock, const unsigned int i, const long amount)
+{
+	const long level = stock->amount[i];
+
+	if (amount <= 0)
+		return 0;
+
+	return amount * (price_at(stock, i, level) + price_at(stock, i, level - amount + 1)) / 2;
+}
+
+/*
+ * Returns what the port pays for amount of item i, which it must have room
+ * for. Every unit is sold at the price the port would ask for it once it
+ * has it, so buying and selling the same units back doesn't make a profit.
+ * The caller must hold the items_lock of the port.
+ */
+long price_sell(const struct port_stock * const stock, const unsigned int i, const long amount)
+{
+	const long level = stock->amount[i];
+
+	if (amount <= 0)
+		return 0;
+
+	return amount * (price_at(stock, i, level + 1) + price_at(stock, i, level + amount)) / 2;
+}
+
+/*
+ * Returns how many of item i, up to amount and what the port has, can be
+ * bought for credits. The caller must hold the items_lock of the port.
+ */
+long price_affordable(const struct port_stock * const stock, const unsigned int i,
+		const long amount, const long credits)
+{
+	long lo = 0, hi = MIN(amount, stock->amount[i]), mid;
+
+	if (price_buy(stock, i, hi) <= credits)
+		return hi;
+
+	/* lo is always affordable and hi never is */
+	while (lo + 1 < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (price_buy(stock, i, mid) <= credits)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
@@ -0,0 +1,17 @@
+#ifndef _HAS_PRICE_H
+#define _HAS_PRICE_H
+
+struct port_stock;
+
+long price_inverse(const long max);
+long price_fill(const long amount, const long inverse);
+
+void price_init(struct port_stock *stock);
+void price_update(struct port_stock *stock);
+
+long price_buy(const struct port_stock * const stock, const unsigned int i, const long amount);
+long price_sell(const struct port_stock * const stock, const unsigned int i, const long amount);
+long price_affordable(const struct port_stock * const stock, const unsigned int i,
+		const long amount, const long credits);
+
+#endif
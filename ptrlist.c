@@ -2,85 +2,99 @@
 #include <string.h>
 #include <assert.h>
 #include "common.h"
-#include "list.h"
 #include "mtrandom.h"
 #include "ptrlist.h"
 
+#define PTRLIST_MINSIZE 8
+
 int ptrlist_init(struct ptrlist *l)
 {
 	memset(l, 0, sizeof(*l));
 
-	INIT_LIST_HEAD(&l->list);
-
 	return 0;
 }
 
 void ptrlist_free(struct ptrlist *l)
 {
 	assert(l != NULL);
-	struct ptrlist *e, *_e;
 
-	list_for_each_entry_safe(e, _e, &l->list, list) {
-		list_del(&e->list);
-		free(e);
+	free(l->elems);
+	ptrlist_init(l);
+}
+
+/*
+ * Makes room for one more element at the end of the array, either by moving
+ * the elements down over the space left by pulled elements or by doubling
+ * the size of the array.
+ */
+static int make_room(struct ptrlist *l)
+{
+	unsigned long size;
+	void **ptr;
+
+	if (l->start + l->len < l->alloc)
+		return 0;
+
+	if (l->start && l->start >= l->alloc / 2) {
+		memmove(l->elems, l->elems + l->start, l->len * sizeof(*l->elems));
+		l->start = 0;
+		return 0;
 	}
 
-	l->len = 0;
+	size = MAX(l->alloc * 2, PTRLIST_MINSIZE);
+	ptr = realloc(l->elems, size * sizeof(*l->elems));
+	if (!ptr)
+		return -1;
+
+	l->elems = ptr;
+	l->alloc = size;
+
+	return 0;
 }
 
 int ptrlist_push(struct ptrlist *l, void *e)
 {
-	struct ptrlist *nl;
 	assert(l != NULL);
 
-	nl = malloc(sizeof(*nl));
-	if (!nl)
+	if (make_room(l))
 		return -1;
-	ptrlist_init(nl);
 
-	nl->data = e;
-	list_add_tail(&nl->list, &l->list);
+	l->elems[l->start + l->len] = e;
 	l->len++;
 	return 0;
 }
 
 void* ptrlist_pull(struct ptrlist * const l)
 {
-	struct ptrlist *e;
 	void *data;
 
 	assert(l != NULL);
 
-	if (list_empty(&l->list))
+	if (!l->len)
 		return NULL;
 
-	e = list_entry(l->list.next, struct ptrlist, list);
-	list_del_init(&e->list);
+	data = l->elems[l->start];
 	l->len--;
-	data = e->data;
-
-	free(e);
+	l->start = l->len ? l->start + 1 : 0;
 
 	return data;
 }
 
-struct ptrlist* ptrlist_get(const struct ptrlist * const l, const unsigned long n)
+void** ptrlist_get(const struct ptrlist * const l, const unsigned long n)
 {
 	assert(l != NULL);
-	struct list_head *ptr;
-	unsigned long i = 0;
-	list_for_each(ptr, &l->list) {
-		if (i == n)
-			return list_entry(ptr, struct ptrlist, list);
-		i++;
-	}
 
-	return NULL;
+	if (n >= l->len)
+		return NULL;
+
+	return &l->elems[l->start + n];
 }
 
 void* ptrlist_entry(const struct ptrlist * const l, const unsigned long n)
 {
-	return ptrlist_get(l, n)->data;
+	assert(n < l->len);
+
+	return l->elems[l->start + n];
 }
 
 unsigned long ptrlist_len(const struct ptrlist * const l)
@@ -98,14 +112,18 @@ void* ptrlist_random(const struct ptrlist * const l)
 
 void ptrlist_rm(struct ptrlist *l, const unsigned long n)
 {
-	struct ptrlist *e;
+	void **e;
 
 	assert(l != NULL);
-	assert(!list_empty(&l->list));
+	assert(n < l->len);
+
+	if (n == 0) {
+		ptrlist_pull(l);
+		return;
+	}
 
-	e = ptrlist_get(l, n);
-	list_del(&e->list);
-	free(e);
+	e = &l->elems[l->start + n];
+	memmove(e, e + 1, (l->len - n - 1) * sizeof(*e));
 
 	l->len--;
 }
@@ -116,67 +134,127 @@ void ptrlist_rm(struct ptrlist *l, const unsigned long n)
  * equal to, or less than the second argument.
  */
 
-static void merge_lists(struct ptrlist *left, struct ptrlist *right,
-		void *data, size_t lenl, size_t lenr,
-		int (*cmp)(const void*, const void*, void*))
+static void merge_runs(void **dst, void **src, const size_t len, const size_t chunk,
+		void *data, int (*cmp)(const void*, const void*, void*))
 {
-	struct ptrlist *next;
-	struct ptrlist *target = list_entry(left->list.prev, struct ptrlist, list);
-
-	while (lenl || lenr) {
-		if (!lenl || (lenr && cmp(left->data, right->data, data) > 0)) {
-			next = list_entry(right->list.next, struct ptrlist, list);
-			list_move(&right->list, &target->list);
-			target = right;
-			right = next;
-			lenr--;
-		} else {
-			next = list_entry(left->list.next, struct ptrlist, list);
-			list_move(&left->list, &target->list);
-			target = left;
-			left = next;
-			lenl--;
+	for (size_t left = 0; left < len; left += 2 * chunk) {
+		size_t right = MIN(left + chunk, len);
+		size_t end = MIN(left + 2 * chunk, len);
+		size_t l = left, r = right;
+
+		for (size_t i = left; i < end; i++) {
+			if (l < right && (r >= end || cmp(src[l], src[r], data) <= 0))
+				dst[i] = src[l++];
+			else
+				dst[i] = src[r++];
 		}
 	}
 }
 
-static void merge_chunk(struct ptrlist * const l,
-		void *data, const size_t chunk,
-		int (*cmp)(const void*, const void*, void*))
+/*
+ * Only used if we can't get memory for the merge sort. Sorts in place.
+ */
+static void insertion_sort(void **elems, const size_t len,
+		void *data, int (*cmp)(const void*, const void*, void*))
 {
-	struct ptrlist *left = ptrlist_get(l, 0);
-	struct ptrlist *right = left;
-	struct ptrlist *next = left;
-	size_t lenl, lenr;
-
-	while (next != l) {
-		for (lenl = 0; lenl < chunk && right != l; lenl++)
-			right = list_entry(right->list.next, struct ptrlist, list);
-
-		next = right;
-		for (lenr = 0; lenr < chunk && next != l; lenr++)
-			next = list_entry(next->list.next, struct ptrlist, list);
+	for (size_t i = 1; i < len; i++) {
+		void *e = elems[i];
+		size_t j;
 
-		merge_lists(left, right, data, lenl, lenr, cmp);
-
-		left = next;
-		right = next;
+		for (j = i; j > 0 && cmp(elems[j - 1], e, data) > 0; j--)
+			elems[j] = elems[j - 1];
+		elems[j] = e;
 	}
 }
 
+/*
+ * Stable bottom-up merge sort, bouncing between the list and a temporary
+ * array of the same size.
+ */
 void ptrlist_sort(struct ptrlist * const l, void *data,
 		int (*cmp)(const void*, const void*, void*))
 {
 	assert(l);
 	const size_t len = ptrlist_len(l);
+	void **elems, **tmp, **swap;
 
 	if (len < 2)
 		return;
 
+	elems = &l->elems[l->start];
+	tmp = malloc(len * sizeof(*tmp));
+	if (!tmp) {
+		insertion_sort(elems, len, data, cmp);
+		return;
+	}
+
 	/*
 	 * chunk < len also handles lists of lengths not evenly divisible
 	 * by 2, in contrast to chunk < len / 2
 	 */
-	for (size_t chunk = 1; chunk < len; chunk *= 2)
-		merge_chunk(l, data, chunk, cmp);
+	void **src = elems, **dst = tmp;
+	for (size_t chunk = 1; chunk < len; chunk *= 2) {
+		merge_runs(dst, src, len, chunk, data, cmp);
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != elems)
+		memcpy(elems, src, len * sizeof(*elems));
+
+	free(tmp);
+}
+
+struct sort_key {
+	unsigned long key;
+	unsigned long idx;
+	void *ptr;
+};
+
+static int cmp_sort_keys(const void *_a, const void *_b)
+{
+	const struct sort_key *a = _a;
+	const struct sort_key *b = _b;
+
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+
+	return a->idx < b->idx ? -1 : a->idx > b->idx;
+}
+
+/*
+ * Sorts the list in ascending order of key(element, data). The key is only
+ * calculated once per element, which makes this a lot cheaper than
+ * ptrlist_sort() when the key is expensive. Equal keys keep their order.
+ */
+int ptrlist_sort_by_key(struct ptrlist * const l, void *data,
+		unsigned long (*key)(const void*, void*))
+{
+	assert(l);
+	const size_t len = ptrlist_len(l);
+	void **elems = &l->elems[l->start];
+	struct sort_key *keys;
+
+	if (len < 2)
+		return 0;
+
+	keys = malloc(len * sizeof(*keys));
+	if (!keys)
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		keys[i].key = key(elems[i], data);
+		keys[i].idx = i;
+		keys[i].ptr = elems[i];
+	}
+
+	qsort(keys, len, sizeof(*keys), cmp_sort_keys);
+
+	for (size_t i = 0; i < len; i++)
+		elems[i] = keys[i].ptr;
+
+	free(keys);
+
+	return 0;
 }
@@ -1,12 +1,15 @@
 #ifndef _HAS_PTRLIST_H
 #define _HAS_PTRLIST_H
 
-#include "list.h"
-
+/*
+ * A list of pointers kept in a single growable array. Elements are removed
+ * from the front by moving start forward, so pulling is cheap as well.
+ */
 struct ptrlist {
-	void *data;
-	struct list_head list;
+	void **elems;
+	unsigned long start;
 	unsigned long len;
+	unsigned long alloc;
 };
 
 int ptrlist_init(struct ptrlist *l);
@@ -14,25 +17,25 @@ void ptrlist_free(struct ptrlist *l);
 
 int ptrlist_push(struct ptrlist *l, void *e);
 void* ptrlist_pull(struct ptrlist * const l);
-struct ptrlist* ptrlist_get(const struct ptrlist * const l, const unsigned long n);
+void** ptrlist_get(const struct ptrlist * const l, const unsigned long n);
 void* ptrlist_entry(const struct ptrlist * const l, const unsigned long n);
 unsigned long ptrlist_len(const struct ptrlist * const l);
 void* ptrlist_random(const struct ptrlist * const l);
 void ptrlist_rm(struct ptrlist *l, const unsigned long n);
 void ptrlist_sort(struct ptrlist * const l, void *data,
 		int (*cmp)(const void*, const void*, void*));
-
-#define ptrlist_data(pos)	\
-	list_entry((pos), struct ptrlist, list)->data
+int ptrlist_sort_by_key(struct ptrlist * const l, void *data,
+		unsigned long (*key)(const void*, void*));
 
 /*
  * @iter:	variable used as iterator
- * @head:	struct list_head of the list
- * @pos:	junk list_head
+ * @head:	struct ptrlist to iterate over
+ * @pos:	unsigned long used as index
  */
 #define ptrlist_for_each_entry(iter, head, pos)				\
-	for (pos = (head)->list.next, (iter) = ptrlist_data(pos);	\
-		pos != &(head)->list;					\
-		pos = pos->next, (iter) = ptrlist_data(pos))
+	for ((pos) = 0;							\
+		(pos) < (head)->len &&					\
+		(((iter) = (head)->elems[(head)->start + (pos)]), 1);	\
+		(pos)++)
 
 #endif
@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "landmark.h"
+#include "log.h"
+#include "ptrlist.h"
+#include "route.h"
+#include "system.h"
+#include "universe.h"
+
+/*
+ * Routes are found with A* over the hyperspace links. The distance left to
+ * the destination is estimated from the landmark tables, see landmark.c,
+ * and for distances in light years also as the straight distance. The
+ * search state lives in arrays indexed by system->idx that every thread
+ * keeps between searches, and they are only reallocated when the universe
+ * has grown. Rather than clearing the nodes before every search, each
+ * search has its own generation number, and a node from an older
+ * generation hasn't been seen yet.
+ */
+
+struct route_node {
+	unsigned long cost;		/* Shortest distance from the origin so far */
+	unsigned long prev;		/* The system jumped here from */
+	unsigned int gen;		/* Search the other fields belong to */
+	int done;			/* cost is the shortest distance there is */
+};
+
+struct route_open {
+	unsigned long estimate;		/* cost and distance left to destination */
+	unsigned long idx;
+};
+
+struct route_scratch {
+	struct route_node *nodes;
+	unsigned long num_nodes;
+	struct route_open *heap;	/* Binary heap on estimate */
+	unsigned long heap_len;
+	unsigned long heap_alloc;
+	unsigned int gen;
+};
+
+#define HEAP_INITIAL_ALLOC 64
+
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t scratch_key;
+static __thread struct route_scratch scratch;
+
+static void free_scratch(void *_s)
+{
+	struct route_scratch *s = _s;
+
+	free(s->nodes);
+	free(s->heap);
+	memset(s, 0, sizeof(*s));
+}
+
+static void create_scratch_key()
+{
+	if (pthread_key_create(&scratch_key, free_scratch))
+		die("%s", "Failed creating route thread key");
+}
+
+static int prepare_scratch(struct route_scratch * const s, const unsigned long num_systems)
+{
+	struct route_node *nodes;
+
+	if (num_systems > s->num_nodes) {
+		pthread_once(&scratch_once, create_scratch_key);
+
+		nodes = realloc(s->nodes, num_systems * sizeof(*nodes));
+		if (!nodes)
+			return -1;
+
+		memset(&nodes[s->num_nodes], 0, (num_systems - s->num_nodes) * sizeof(*nodes));
+		s->nodes = nodes;
+		s->num_nodes = num_systems;
+
+		/* Frees the scratch space when the thread exits */
+		pthread_setspecific(scratch_key, s);
+	}
+
+	s->heap_len = 0;
+	if (++s->gen == 0) {
+		for (unsigned long i = 0; i < s->num_nodes; i++)
+			s->nodes[i].gen = 0;
+		s->gen = 1;
+	}
+
+	return 0;
+}
+
+static int heap_push(struct route_scratch * const s, const unsigned long estimate,
+		const unsigned long idx)
+{
+	struct route_open *heap;
+	unsigned long alloc, i, parent;
+
+	if (s->heap_len == s->heap_alloc) {
+		alloc = s->heap_alloc ? s->heap_alloc * 2 : HEAP_INITIAL_ALLOC;
+		heap = realloc(s->heap, alloc * sizeof(*heap));
+		if (!heap)
+			return -1;
+		s->heap = heap;
+		s->heap_alloc = alloc;
+	}
+
+	for (i = s->heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (s->heap[parent].estimate <= estimate)
+			break;
+		s->heap[i] = s->heap[parent];
+	}
+	s->heap[i].estimate = estimate;
+	s->heap[i].idx = idx;
+
+	return 0;
+}
+
+static unsigned long heap_pop(struct route_scratch * const s)
+{
+	const unsigned long top = s->heap[0].idx;
+	const struct route_open last = s->heap[--s->heap_len];
+	unsigned long i, child;
+
+	for (i = 0; (child = 2 * i + 1) < s->heap_len; i = child) {
+		if (child + 1 < s->heap_len && s->heap[child + 1].estimate < s->heap[child].estimate)
+			child++;
+		if (last.estimate <= s->heap[child].estimate)
+			break;
+		s->heap[i] = s->heap[child];
+	}
+	s->heap[i] = last;
+
+	return top;
+}
+
+static int add_route(struct ptrlist * const route, const struct route_scratch * const s,
+		const struct system * const from, const struct system * const to)
+{
+	const unsigned long first = ptrlist_len(route);
+	unsigned long i, j;
+	void **a, **b, *tmp;
+
+	for (i = to->idx; i != from->idx; i = s->nodes[i].prev) {
+		if (ptrlist_push(route, ptrlist_entry(&univ.systems, i)))
+			return -1;
+	}
+
+	/* The systems were added from the destination and back */
+	for (i = first, j = ptrlist_len(route); i + 1 < j; i++, j--) {
+		a = ptrlist_get(route, i);
+		b = ptrlist_get(route, j - 1);
+		tmp = *a;
+		*a = *b;
+		*b = tmp;
+	}
+
+	return 0;
+}
+
+static unsigned long estimate(const struct system * const from, const struct system * const to,
+		const enum route_metric metric)
+{
+	const unsigned long bound = landmarks_bound(&univ.landmarks, from, to, metric);
+
+	if (metric == ROUTE_JUMPS)
+		return bound;
+
+	return MAX(bound, system_distance(from, to));
+}
+
+/*
+ * Searches from the origin until the destination is done, or until every
+ * system that can be reached is if there is no destination. Returns 0 when
+ * done, 1 if the destination can't be reached and -1 if out of memory. As
+ * the estimate may be a little too high, a system is searched again if a
+ * shorter way there is found after it is done.
+ */
+static int search(struct route_scratch * const s, const struct system * const from,
+		const struct system * const to, const enum route_metric metric)
+{
+	struct route_node *node, *next;
+	struct system *system, *link;
+	unsigned long idx, cost, lh;
+
+	if (prepare_scratch(s, ptrlist_len(&univ.systems)))
+		return -1;
+
+	assert(from->idx < s->num_nodes && ptrlist_entry(&univ.systems, from->idx) == from);
+	assert(!to || (to->idx < s->num_nodes && ptrlist_entry(&univ.systems, to->idx) == to));
+
+	if (to && !landmarks_connected(&univ.landmarks, from, to))
+		return 1;
+
+	node = &s->nodes[from->idx];
+	node->cost = 0;
+	node->prev = from->idx;
+	node->gen = s->gen;
+	node->done = 0;
+	if (heap_push(s, to ? estimate(from, to, metric) : 0, from->idx))
+		return -1;
+
+	while (s->heap_len) {
+		idx = heap_pop(s);
+		node = &s->nodes[idx];
+		if (node->done)
+			continue;
+		node->done = 1;
+
+		if (to && idx == to->idx)
+			return 0;
+
+		system = ptrlist_entry(&univ.systems, idx);
+		ptrlist_for_each_entry(link, &system->links, lh) {
+			next = &s->nodes[link->idx];
+			cost = node->cost + (metric == ROUTE_JUMPS ? 1 : system_distance(system, link));
+
+			if (next->gen == s->gen && next->cost <= cost)
+				continue;
+
+			next->cost = cost;
+			next->prev = idx;
+			next->gen = s->gen;
+			next->done = 0;
+			if (heap_push(s, cost + (to ? estimate(link, to, metric) : 0), link->idx))
+				return -1;
+		}
+	}
+
+	return to ? 1 : 0;
+}
+
+/*
+ * Finds the shortest way by hyperspace from one system to another, either
+ * in light years or in jumps. The systems to jump to, ending with to, are
+ * added to route and the length of the route is stored in cost. Returns 0
+ * if a route was found, 1 if to can't be reached from from and -1 if out
+ * of memory.
+ */
+int route_find(struct ptrlist * const route, const struct system * const from,
+		const struct system * const to, const enum route_metric metric,
+		unsigned long *cost)
+{
+	struct route_scratch * const s = &scratch;
+	int r;
+
+	r = search(s, from, to, metric);
+	if (r)
+		return r;
+
+	*cost = s->nodes[to->idx].cost;
+	return add_route(route, s, from, to);
+}
+
+/*
+ * Stores the length of the shortest way from the origin to every system in
+ * cost, indexed by system->idx, or ULONG_MAX if there is no way there.
+ * Returns -1 if out of memory.
+ */
+int route_costs(const struct system * const from, const enum route_metric metric,
+		unsigned long * const cost)
+{
+	struct route_scratch * const s = &scratch;
+
+	if (search(s, from, NULL, metric))
+		return -1;
+
+	for (unsigned long i = 0; i < ptrlist_len(&univ.systems); i++)
+		cost[i] = s->nodes[i].gen == s->gen ? s->nodes[i].cost : ULONG_MAX;
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _HAS_ROUTE_H
+#define _HAS_ROUTE_H
+
+#include "ptrlist.h"
+
+struct system;
+
+enum route_metric {
+	ROUTE_DISTANCE,
+	ROUTE_JUMPS
+};
+
+int route_find(struct ptrlist * const route, const struct system * const from,
+		const struct system * const to, const enum route_metric metric,
+		unsigned long *cost);
+int route_costs(const struct system * const from, const enum route_metric metric,
+		unsigned long * const cost);
+
+#endif
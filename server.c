@@ -24,11 +24,23 @@
 #include "connection.h"
 
 static int signfdw, signfdr;
-static struct ev_loop *loop;
 
 static struct conn_data conn_data;
-static struct list_head conn_list;
-pthread_rwlock_t conn_list_lock;
+
+/*
+ * Every server loop runs its own event loop in its own thread, with its own
+ * listening sockets and its own set of connections. The main server thread
+ * does not touch any peer sockets, it only relays messages to the loops.
+ */
+struct server_loop {
+	pthread_t thread;
+	struct ev_loop *loop;
+	int fd[2];
+	ev_io msg_watcher;
+	int reuseport;
+	struct list_head conn_list;
+	pthread_rwlock_t conn_list_lock;
+};
 
 struct socket_list {
 	int fd;
@@ -41,37 +53,35 @@ struct watcher_list {
 	struct list_head list;
 };
 
+/*
+ * The server loop drops its reference to the connection here. If a worker
+ * is still busy with a command for this connection, the worker frees it
+ * when it is done instead, so we never have to wait for it.
+ */
 static void disconnect_peer(struct ev_loop *loop, struct connection *conn)
 {
-	struct connection *c, *_c;
+	struct server_loop *sl = ev_userdata(loop);
 	log_printfn(LOG_SERVER, "now terminating connection %x", conn->id);
 
+	conn->terminate = 1;
+
 	ev_io_stop(loop, &conn->data_watcher);
+	ev_io_stop(loop, &conn->write_watcher);
 	ev_async_stop(loop, &conn->kill_watcher);
+	ev_async_stop(loop, &conn->flush_watcher);
 
-	/*
-	 * Remember: The locking in this function needs to be synchronized
-	 * with the locking in connection_worker() to avoid nasty races in case
-	 * a connection is terminated when connection_worker() is just starting.
-	 */
-
-	pthread_mutex_lock(&conn_data.workers_lock);
-	list_for_each_entry_safe(c, _c, &conn_data.work_items, work) {
-		if (c == conn)
-			list_del_init(&c->work);
-	}
-	pthread_mutex_unlock(&conn_data.workers_lock);
-
-	while (conn->worker);
-	pthread_mutex_lock(&conn->worker_lock);
+	conn_cancel_work(&conn_data, conn);
 
-	pthread_rwlock_wrlock(&conn_list_lock);
+	pthread_rwlock_wrlock(&sl->conn_list_lock);
 	list_del(&conn->list);
-	pthread_rwlock_unlock(&conn_list_lock);
+	pthread_rwlock_unlock(&sl->conn_list_lock);
+
+	/* Last words such as "Bye!" are sent if the peer accepts them right away */
+	conn_queue_send_buffer(conn);
+	conn_write_queued(conn);
 
 	log_printfn(LOG_SERVER, "connection %x successfully terminated", conn->id);
-	connection_free(conn);
-	free(conn);
+	conn_put(conn);
 }
 
 void server_disconnect_cb(struct ev_loop *loop, struct ev_async *w, int revents)
@@ -87,56 +97,74 @@ void server_disconnect_nicely(struct connection *conn)
 
 	log_printfn(LOG_SERVER, "asking nicely to terminate connection %x", conn->id);
 	conn->terminate = 1;
-	ev_async_send(loop, &conn->kill_watcher);
+	ev_async_send(conn->loop, &conn->kill_watcher);
 }
 
 static void disconnect_peers(struct ev_loop *loop)
 {
+	struct server_loop *sl = ev_userdata(loop);
 	struct connection *cd, *_cd;
 
-	list_for_each_entry_safe(cd, _cd, &conn_list, list) {
+	list_for_each_entry_safe(cd, _cd, &sl->conn_list, list) {
 		conn_send(cd, "Server is shutting down, you are being disconnected.\n");
 		disconnect_peer(loop, cd);
 	}
 }
 
+/*
+ * Reading from a peer is stopped while it is paused, throttled or has too
+ * many commands queued, and restarted once none of those apply.
+ */
+static void resume_reading(struct ev_loop * const loop, struct connection * const conn)
+{
+	if (!conn->paused && !conn->throttled && !conn->backlogged)
+		ev_io_start(loop, &conn->data_watcher);
+}
+
 static void server_handlesignal(struct ev_loop *loop, struct signal *msg, char *data)
 {
+	struct server_loop *sl = ev_userdata(loop);
 	struct connection *cd;
 	log_printfn(LOG_SERVER, "received signal %d", msg->type);
 	switch (msg->type) {
 	case MSG_TERM:
-		/* This will break all event loops, especially the main server loop in server_main() */
+		/* This will break this server loop, making loop_main() clean up and return */
 		ev_unloop(EV_A_ EVUNLOOP_ALL);
 		break;
 	case MSG_WALL:
 		log_printfn(LOG_SERVER, "walling all users: %s", data);
-		pthread_rwlock_rdlock(&conn_list_lock);
-		list_for_each_entry(cd, &conn_list, list)
+		pthread_rwlock_rdlock(&sl->conn_list_lock);
+		list_for_each_entry(cd, &sl->conn_list, list) {
 			conn_send(cd, "\nMessage to all connected users:\n"
 					"%s"
 					"\nEnd of message.\n", data);
-		pthread_rwlock_unlock(&conn_list_lock);
+			conn_flush(cd);
+		}
+		pthread_rwlock_unlock(&sl->conn_list_lock);
 		break;
 	case MSG_PAUSE:
 		log_printfn(LOG_SERVER, "pausing the entire universe");
-		pthread_rwlock_rdlock(&conn_list_lock);
-		list_for_each_entry(cd, &conn_list, list) {
+		pthread_rwlock_rdlock(&sl->conn_list_lock);
+		list_for_each_entry(cd, &sl->conn_list, list) {
+			cd->paused = 1;
 			ev_io_stop(loop, &cd->data_watcher);
 			conn_send(cd, "\nYou have been paused by God. This might mean the whole universe is currently on hold\n"
 					"or just you. Anything you enter at the prompt will queue up until you are resumed.\n");
+			conn_flush(cd);
 		}
-		pthread_rwlock_unlock(&conn_list_lock);
+		pthread_rwlock_unlock(&sl->conn_list_lock);
 		break;
 	case MSG_CONT:
 		/* FIXME: CONT */
 		log_printfn(LOG_SERVER, "universe continuing");
-		pthread_rwlock_rdlock(&conn_list_lock);
-		list_for_each_entry(cd, &conn_list, list) {
-			ev_io_start(loop, &cd->data_watcher);
+		pthread_rwlock_rdlock(&sl->conn_list_lock);
+		list_for_each_entry(cd, &sl->conn_list, list) {
+			cd->paused = 0;
+			resume_reading(loop, cd);
 			conn_send(cd, "\nYou have been resumed, feel free to play away!\n");
+			conn_flush(cd);
 		}
-		pthread_rwlock_unlock(&conn_list_lock);
+		pthread_rwlock_unlock(&sl->conn_list_lock);
 		break;
 	default:
 		log_printfn(LOG_SERVER, "unknown message received: %d", msg->type);
@@ -157,7 +185,7 @@ static void server_preparesocket(struct addrinfo **servinfo)
 }
 
 #define SERVER_MAX_PENDING_CONNECTIONS 16
-static int setupsocket(struct addrinfo *p)
+static int setupsocket(struct addrinfo *p, const int reuseport)
 {
 	int fd;
 
@@ -169,6 +197,12 @@ static int setupsocket(struct addrinfo *p)
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
 		goto err;
 
+#ifdef SO_REUSEPORT
+	/* Lets every server loop bind its own socket to the same port */
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)))
+		goto err;
+#endif
+
 	/* This will fail on newer BSDs since they turned off IPv4->IPv6 mapping.
 	 * That's perfectly OK but we can't check the exit status. */
 	if (p->ai_family == AF_INET6)
@@ -204,7 +238,7 @@ static void close_and_free_sockets(struct list_head *sockets)
 	}
 }
 
-static int initialize_server_sockets(struct list_head *sockets)
+static int initialize_server_sockets(struct list_head *sockets, const int reuseport)
 {
 	struct addrinfo *servinfo, *p;
 	server_preparesocket(&servinfo);
@@ -214,7 +248,7 @@ static int initialize_server_sockets(struct list_head *sockets)
 	/* We want to bind to all valid combinations returned by getaddrinfo()
 	 * to make sure we support IPv4 and IPv6 */
 	for (p = servinfo; p != NULL; p = p->ai_next) {
-		fd = setupsocket(p);
+		fd = setupsocket(p, reuseport);
 		if (fd < 0)
 			continue;
 
@@ -253,8 +287,39 @@ static char* pretty_print_peer(char * const out, const size_t len, const struct
 	return out;
 }
 
+static void loop_msg_cb(struct ev_loop * const loop, ev_io * const w, const int revents)
+{
+	struct server_loop *sl = w->data;
+	struct signal msg;
+	char *data;
+
+	read(sl->fd[0], &msg, sizeof(msg));
+	if (msg.cnt > 0) {
+		data = alloca(msg.cnt);
+		read(sl->fd[0], data, msg.cnt);	/* FIXME: Validate the number of bytes */
+	} else {
+		data = NULL;
+	}
+
+	server_handlesignal(loop, &msg, data);
+}
+
+static void relay_signal(struct server * const server, struct signal *msg, char *data)
+{
+	struct server_loop *sl;
+
+	for (unsigned int i = 0; i < server->num_loops; i++) {
+		sl = &server->loops[i];
+		if (write(sl->fd[1], msg, sizeof(*msg)) < 1)
+			bug("%s", "server loop signalling fd is closed");
+		if (msg->cnt && write(sl->fd[1], data, msg->cnt) < 1)
+			bug("%s", "server loop signalling fd is closed");
+	}
+}
+
 static void server_msg_cb(struct ev_loop * const loop, ev_io * const w, const int revents)
 {
+	struct server *server = w->data;
 	struct signal msg;
 	char *data;
 
@@ -266,30 +331,110 @@ static void server_msg_cb(struct ev_loop * const loop, ev_io * const w, const in
 		data = NULL;
 	}
 
-	server_handlesignal(loop, &msg, data);
+	relay_signal(server, &msg, data);
+
+	/* The server loops terminate by themselves when they get the relayed message */
+	if (msg.type == MSG_TERM)
+		ev_unloop(EV_A_ EVUNLOOP_ALL);
 }
 
-static void receive_peer_data(struct connection * data)
+static void receive_peer_data(struct ev_loop * const loop, struct connection * data)
 {
-	read_into_buffer(data->peerfd, &data->recv);
+	char *line;
+	long queued = 0;
+
+	if (read_into_buffer(data->peerfd, &data->recv)) {
+		log_printfn(LOG_SERVER, "read error or hangup on connection %x", data->id);
+		server_disconnect_nicely(data);
+		return;
+	}
+
+	do {
+		if (buffer_extract_line(&data->recv, &line)) {
+			log_printfn(LOG_SERVER, "out of memory when receiving on connection %x", data->id);
+			server_disconnect_nicely(data);
+			return;
+		}
+
+		if (!line)
+			break;
 
-	if (!buffer_terminate_line(&data->recv)) {
-		printf("debug: received \"%s\" on socket\n", data->recv.buf);
-		
-		conn_do_work(&conn_data, data);
+		queued = conn_queue_cmd(&conn_data, data, line);
+		if (queued < 0) {
+			free(line);
+			log_printfn(LOG_SERVER, "out of memory when receiving on connection %x", data->id);
+			server_disconnect_nicely(data);
+			return;
+		}
+	} while (1);
 
-		buffer_reset(&data->recv);
+	if (queued >= CONN_MAX_QUEUED_CMDS) {
+		data->backlogged = 1;
+		ev_io_stop(loop, &data->data_watcher);
 	}
 }
 
 static void got_new_peer_data(struct ev_loop * const loop, ev_io * const w, const int revents)
 {
 	struct connection *data = (struct connection*)w->data;
-	receive_peer_data(data);
+	receive_peer_data(loop, data);
+}
+
+/*
+ * Writes whatever is queued for the peer and keeps the write watcher running
+ * until the queue is empty. Peers that don't keep up with reading their
+ * output are throttled, and eventually disconnected.
+ */
+static void write_queued_data(struct ev_loop * const loop, struct connection * const conn)
+{
+	ssize_t left;
+
+	left = conn_write_queued(conn);
+	if (left < 0) {
+		log_printfn(LOG_SERVER, "send error (connection %x), terminating connection", conn->id);
+		server_disconnect_nicely(conn);
+		return;
+	}
+
+	if (left > CONN_SEND_MAX) {
+		log_printfn(LOG_SERVER, "connection %x is not reading its data, terminating connection", conn->id);
+		server_disconnect_nicely(conn);
+		return;
+	}
+
+	if (left)
+		ev_io_start(loop, &conn->write_watcher);
+	else
+		ev_io_stop(loop, &conn->write_watcher);
+
+	if (!conn->throttled && left > CONN_SEND_HIGH_WATER) {
+		conn->throttled = 1;
+		ev_io_stop(loop, &conn->data_watcher);
+	} else if (conn->throttled && left < CONN_SEND_LOW_WATER) {
+		conn->throttled = 0;
+		resume_reading(loop, conn);
+	}
+
+	/* Workers flush after every command, so this is where backlogs drain */
+	if (conn->backlogged && conn_cmds_queued(conn) <= CONN_MAX_QUEUED_CMDS / 2) {
+		conn->backlogged = 0;
+		resume_reading(loop, conn);
+	}
+}
+
+static void peer_writable_cb(struct ev_loop * const loop, ev_io * const w, const int revents)
+{
+	write_queued_data(loop, w->data);
+}
+
+static void server_flush_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+	write_queued_data(loop, w->data);
 }
 
 int server_accept_connection(struct ev_loop * const loop, int fd)
 {
+	struct server_loop *sl = ev_userdata(loop);
 	int r;
 	struct connection *cd;
 	struct sockaddr_storage peer_addr;
@@ -314,22 +459,35 @@ int server_accept_connection(struct ev_loop * const loop, int fd)
 		}
 	}
 
+	if (fcntl(cd->peerfd, F_SETFL, O_NONBLOCK) < 0) {
+		r = errno;
+		log_printfn(LOG_SERVER, "could not make socket non-blocking: %s", strerror(errno));
+		goto err_free;
+	}
+
 	socklen_t len = sizeof(cd->sock);
 	getpeername(cd->peerfd, (struct sockaddr*)&cd->sock, &len);
 	pretty_print_peer(cd->peer, sizeof(cd->peer), cd->sock);
 	log_printfn(LOG_SERVER, "new connection %x from %s", cd->id, cd->peer);
 
-	pthread_rwlock_wrlock(&conn_list_lock);
+	cd->loop = loop;
+
+	pthread_rwlock_wrlock(&sl->conn_list_lock);
 
-	list_add_tail(&cd->list, &conn_list);
+	list_add_tail(&cd->list, &sl->conn_list);
 	ev_io_init(&cd->data_watcher, got_new_peer_data, cd->peerfd, EV_READ);
+	ev_io_init(&cd->write_watcher, peer_writable_cb, cd->peerfd, EV_WRITE);
 	ev_async_init(&cd->kill_watcher, server_disconnect_cb);
+	ev_async_init(&cd->flush_watcher, server_flush_cb);
 	cd->data_watcher.data = cd;
+	cd->write_watcher.data = cd;
 	cd->kill_watcher.data = cd;
+	cd->flush_watcher.data = cd;
 
-	pthread_rwlock_unlock(&conn_list_lock);
+	pthread_rwlock_unlock(&sl->conn_list_lock);
 
 	ev_async_start(loop, &cd->kill_watcher);
+	ev_async_start(loop, &cd->flush_watcher);
 
 	log_printfn(LOG_SERVER, "serving new connection %x", cd->id);
 	if (conn_fulfixinit(cd)) {
@@ -343,11 +501,12 @@ int server_accept_connection(struct ev_loop * const loop, int fd)
 	return 0;
 
 err_stop:
-	pthread_rwlock_wrlock(&conn_list_lock);
+	pthread_rwlock_wrlock(&sl->conn_list_lock);
 	list_del(&cd->list);
 	ev_async_stop(loop, &cd->kill_watcher);
-	close(cd->peerfd);
-	pthread_rwlock_unlock(&conn_list_lock);
+	ev_async_stop(loop, &cd->flush_watcher);
+	ev_io_stop(loop, &cd->write_watcher);
+	pthread_rwlock_unlock(&sl->conn_list_lock);
 
 err_free:
 	connection_free(cd);
@@ -429,47 +588,175 @@ err:
 	return -1;
 }
 
-static void* server_main(void *_server)
+static void* loop_main(void *_sl)
 {
-	struct server *server = _server;
-	ev_io msg_watcher;
-	loop = EV_DEFAULT;
+	struct server_loop *sl = _sl;
 	LIST_HEAD(sockets);
 	LIST_HEAD(watchers);
 
-	INIT_LIST_HEAD(&conn_list);
-	pthread_rwlock_init(&conn_list_lock, NULL);
+	initialize_server_sockets(&sockets, sl->reuseport);
+	if (list_empty(&sockets))
+		die("%s", "server failed to bind");
+
+	start_server_watchers(&watchers, sl->loop, &sockets);
+	if (list_empty(&watchers))
+		die("%s", "server failed to create watchers");
+
+	ev_run(sl->loop, 0);
+
+	ev_io_stop(sl->loop, &sl->msg_watcher);
+
+	disconnect_peers(sl->loop);
+	stop_and_free_server_watchers(&watchers, sl->loop);
+	close_and_free_sockets(&sockets);
+
+	return NULL;
+}
+
+static void free_server_loop(struct server_loop * const sl)
+{
+	ev_loop_destroy(sl->loop);
+	close(sl->fd[0]);
+	close(sl->fd[1]);
+	pthread_rwlock_destroy(&sl->conn_list_lock);
+}
+
+static int start_server_loop(struct server_loop * const sl, const int reuseport)
+{
+	sigset_t old, new;
+
+	sigfillset(&new);
+
+	memset(sl, 0, sizeof(*sl));
+	INIT_LIST_HEAD(&sl->conn_list);
+	sl->reuseport = reuseport;
+
+	if (pthread_rwlock_init(&sl->conn_list_lock, NULL))
+		goto err;
+
+	if (pipe(sl->fd) != 0)
+		goto err_lock;
+
+	sl->loop = ev_loop_new(EVFLAG_AUTO | EVFLAG_NOSIGMASK);
+	if (!sl->loop)
+		goto err_close;
+	ev_set_userdata(sl->loop, sl);
+
+	ev_io_init(&sl->msg_watcher, loop_msg_cb, sl->fd[0], EV_READ);
+	sl->msg_watcher.data = sl;
+	ev_io_start(sl->loop, &sl->msg_watcher);
+
+	if (pthread_sigmask(SIG_SETMASK, &new, &old))
+		goto err_loop;
+
+	if (pthread_create(&sl->thread, NULL, loop_main, sl))
+		goto err_loop;
+
+	if (pthread_sigmask(SIG_SETMASK, &old, NULL)) {
+		pthread_cancel(sl->thread);
+		goto err_loop;
+	}
+
+	return 0;
+
+err_loop:
+	ev_io_stop(sl->loop, &sl->msg_watcher);
+	ev_loop_destroy(sl->loop);
+err_close:
+	close(sl->fd[0]);
+	close(sl->fd[1]);
+err_lock:
+	pthread_rwlock_destroy(&sl->conn_list_lock);
+err:
+	return -1;
+}
+
+static void join_server_loops(struct server * const server)
+{
+	for (unsigned int i = 0; i < server->num_loops; i++)
+		pthread_join(server->loops[i].thread, NULL);
+}
+
+/*
+ * Workers may still be finishing commands for disconnected peers when the
+ * server loops have terminated, so the loops must not be freed before all
+ * workers have been shut down.
+ */
+static void free_server_loops(struct server * const server)
+{
+	for (unsigned int i = 0; i < server->num_loops; i++)
+		free_server_loop(&server->loops[i]);
+
+	free(server->loops);
+	server->loops = NULL;
+}
+
+static int start_server_loops(struct server * const server)
+{
+	unsigned int i;
+	int reuseport = (server->num_loops > 1);
+	struct signal msg = {
+		.cnt = 0,
+		.type = MSG_TERM
+	};
+
+	server->loops = malloc(server->num_loops * sizeof(*server->loops));
+	if (!server->loops)
+		return -1;
+
+	for (i = 0; i < server->num_loops; i++) {
+		if (start_server_loop(&server->loops[i], reuseport))
+			goto err;
+	}
+
+	return 0;
+
+err:
+	server->num_loops = i;
+	relay_signal(server, &msg, NULL);
+	join_server_loops(server);
+	free_server_loops(server);
+	return -1;
+}
+
+static void* server_main(void *_server)
+{
+	struct server *server = _server;
+	ev_io msg_watcher;
+	struct ev_loop *loop = EV_DEFAULT;
 
 	signfdr = server->fd[0];
 	signfdw = server->fd[1];
 
-	if (conndata_init(&conn_data))
+#ifndef SO_REUSEPORT
+	if (server->num_loops > 1) {
+		log_printfn(LOG_SERVER, "SO_REUSEPORT is not supported, using a single server loop");
+		server->num_loops = 1;
+	}
+#endif
+
+	if (conndata_init(&conn_data, server->num_workers))
 		die("%s", "failed initializing connection data structures");
 
-	if (start_updating_ports())
+	if (start_updating_ports(server->economy, server->num_workers))
 		die("%s", "failed starting port update thread");
 
-	initialize_server_sockets(&sockets);
-	if (list_empty(&sockets))
-		die("%s", "server failed to bind");
-
-	start_server_watchers(&watchers, loop, &sockets);
-	if (list_empty(&watchers))
-		die("%s", "server failed to create watchers");
+	if (start_server_loops(server))
+		die("%s", "failed starting server loops");
 
 	ev_io_init(&msg_watcher, server_msg_cb, signfdr, EV_READ);
+	msg_watcher.data = server;
 
 	ev_io_start(loop, &msg_watcher);
 
-	log_printfn(LOG_SERVER, "server is up waiting for connections on port %s", SERVER_PORT);
+	log_printfn(LOG_SERVER, "server is up waiting for connections on port %s using %u server loops and %u workers",
+			SERVER_PORT, server->num_loops, server->num_workers);
 
 	ev_run(loop, 0);
 
 	ev_io_stop(loop, &msg_watcher);
 
-	disconnect_peers(loop);
-	stop_and_free_server_watchers(&watchers, loop);
-	close_and_free_sockets(&sockets);
+	join_server_loops(server);
 	stop_updating_ports();
 
 	/*
@@ -478,18 +765,24 @@ static void* server_main(void *_server)
 	 */
 
 	conn_shutdown(&conn_data);
+	free_server_loops(server);
 	conn_destroy(&conn_data);
 
-	struct connection *cd, *tmp;
-	list_for_each_entry_safe(cd, tmp, &conn_list, list) {
-		list_del(&cd->list);
-		connection_free(cd);
-		free(cd);
-	}
-
 	return NULL;
 }
 
+void initialize_server(struct server * const server)
+{
+	long cpus;
+
+	memset(server, 0, sizeof(*server));
+	server->num_loops = SERVER_DEFAULT_LOOPS;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	server->num_workers = cpus > 0 ? cpus : SERVER_DEFAULT_WORKERS;
+	server->economy = PORT_UPDATE_PERIODIC;
+}
+
 int start_server(struct server * const server)
 {
 	sigset_t old, new;
@@ -3,10 +3,20 @@
 
 #include <pthread.h>
 #include "connection.h"
+#include "port_update.h"
+
+#define SERVER_DEFAULT_LOOPS 1
+#define SERVER_DEFAULT_WORKERS 4	/* If the number of cores is unknown */
+
+struct server_loop;
 
 struct server {
 	pthread_t thread;
 	int fd[2];
+	unsigned int num_loops;
+	unsigned int num_workers;
+	enum port_update_mode economy;
+	struct server_loop *loops;
 };
 
 struct signal {
@@ -13,7 +13,7 @@ static void ship_init(struct ship *ship)
 	memset(ship, 0, sizeof(*ship));
 	INIT_LIST_HEAD(&ship->list);
 	INIT_LIST_HEAD(&ship->cargo);
-	INIT_LIST_HEAD(&ship->cargo_names);
+	st_init(&ship->cargo_names);
 	pthread_rwlock_init(&ship->cargo_lock, NULL);
 }
 
@@ -66,7 +66,7 @@ err:
 	return -1;
 }
 
-static struct cargo* new_cargo_to_ship(struct ship * const ship, const struct cargo const * cargo)
+static struct cargo* new_cargo_to_ship(struct ship * const ship, struct item * const item)
 {
 	struct cargo *ship_cargo;
 
@@ -75,9 +75,9 @@ static struct cargo* new_cargo_to_ship(struct ship * const ship, const struct ca
 		return NULL;
 
 	cargo_init(ship_cargo);
-	ship_cargo->item = cargo->item;
+	ship_cargo->item = item;
 	ship_cargo->max = LONG_MAX; /* FIXME */
-	if (st_add_string(&ship->cargo_names, cargo->item->name, ship_cargo)) {
+	if (st_add_string(&ship->cargo_names, item->name, ship_cargo)) {
 		cargo_free(ship_cargo);
 		free(ship_cargo);
 		return NULL;
@@ -89,49 +89,52 @@ static struct cargo* new_cargo_to_ship(struct ship * const ship, const struct ca
 }
 
 /*
+ * Moves up to amount of item from stock to the ship.
  * Must be called with the appropriate locks (i.e. ship->cargo_lock) held
  */
-int move_cargo_to_ship(struct ship * const ship, struct cargo * const cargo, long amount)
+int move_cargo_to_ship(struct ship * const ship, struct item * const item, long * const stock, long amount)
 {
-	assert(cargo->amount >= 0);
+	assert(*stock >= 0);
 
-	struct cargo *ship_cargo = st_lookup_string(&ship->cargo_names, cargo->item->name);
+	struct cargo *ship_cargo = st_lookup_string(&ship->cargo_names, item->name);
 	if (!ship_cargo) {
-		ship_cargo = new_cargo_to_ship(ship, cargo);
+		ship_cargo = new_cargo_to_ship(ship, item);
 		if (!ship_cargo)
 			return -1;
 	}
 	assert(ship_cargo->amount <= ship_cargo->max);
 
-	amount = MIN(amount, cargo->amount);
+	amount = MIN(amount, *stock);
 	amount = MIN(amount, ship_cargo->max - ship_cargo->amount);
 
-	cargo->amount -= amount;
+	*stock -= amount;
 	ship_cargo->amount += amount;
 
 	return amount;
 }
 
 /*
+ * Moves up to amount of item from the ship to stock, which can hold max.
  * Must be called with the appropriate locks (i.e. ship->cargo_lock) held
  */
-int move_cargo_from_ship(struct ship * const ship, struct cargo * const cargo, long amount)
+int move_cargo_from_ship(struct ship * const ship, struct item * const item, long * const stock,
+		const long max, long amount)
 {
 	struct cargo *ship_cargo;
 
-	assert(cargo->amount >= 0);
-	assert(cargo->amount <= cargo->max);
-	ship_cargo = st_lookup_string(&ship->cargo_names, cargo->item->name);
+	assert(*stock >= 0);
+	assert(*stock <= max);
+	ship_cargo = st_lookup_string(&ship->cargo_names, item->name);
 	assert(ship_cargo);
 
 	amount = MIN(amount, ship_cargo->amount);
-	amount = MIN(amount, cargo->max - cargo->amount);
+	amount = MIN(amount, max - *stock);
 
 	ship_cargo->amount -= amount;
-	cargo->amount += amount;
+	*stock += amount;
 
 	if (!ship_cargo->amount) {
-		st_rm_string(&ship->cargo_names, cargo->item->name);
+		st_rm_string(&ship->cargo_names, item->name);
 		list_del(&ship_cargo->list);
 		cargo_free(ship_cargo);
 		free(ship_cargo);
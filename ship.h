@@ -5,6 +5,7 @@
 #include "cargo.h"
 #include "list.h"
 #include "ship_type.h"
+#include "stringtree.h"
 
 enum postype {
 	NONE,
@@ -22,7 +23,7 @@ struct ship {
 	void *pos;
 	pthread_rwlock_t cargo_lock;
 	struct list_head cargo;
-	struct list_head cargo_names;
+	struct st_node cargo_names;
 	struct list_head list;
 };
 
@@ -35,7 +36,8 @@ int new_ship_to_player(struct ship_type *ship_type, struct player *player);
 /*
  * Must be called with the appropriate locks (i.e. ship->cargo_lock) held
  */
-int move_cargo_to_ship(struct ship * const ship, struct cargo * const cargo, long amount);
-int move_cargo_from_ship(struct ship * const ship, struct cargo * const cargo, long amount);
+int move_cargo_to_ship(struct ship * const ship, struct item * const item, long * const stock, long amount);
+int move_cargo_from_ship(struct ship * const ship, struct item * const item, long * const stock,
+		const long max, long amount);
 
 #endif
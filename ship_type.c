@@ -41,7 +41,7 @@ static int set_carry_weight(struct ship_type *type, struct config *conf)
 	return 0;
 }
 
-static int build_command_tree(struct list_head *root)
+static int build_command_tree(struct st_node *root)
 {
 	if (st_add_string(root, "carryweight", set_carry_weight))
 		return -1;
@@ -54,7 +54,7 @@ static int build_command_tree(struct list_head *root)
 int load_ships_from_file(const char * const file, struct universe * const universe)
 {
 	struct list_head conf_root = LIST_HEAD_INIT(conf_root);
-	struct list_head cmd_root = LIST_HEAD_INIT(cmd_root);
+	struct st_node cmd_root = ST_ROOT_INIT;
 	struct config *conf, *child;
 	struct ship_type *sh_type;
 	int (*func)(struct ship_type*, struct config*);
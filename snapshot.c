@@ -0,0 +1,1133 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "civ.h"
+#include "common.h"
+#include "item.h"
+#include "landmark.h"
+#include "log.h"
+#include "planet.h"
+#include "planet_type.h"
+#include "port.h"
+#include "port_type.h"
+#include "port_update.h"
+#include "price.h"
+#include "ptrlist.h"
+#include "star.h"
+#include "stringtree.h"
+#include "system.h"
+#include "universe.h"
+
+/*
+ * A snapshot is a header followed by a number of sections, each an array of
+ * fixed size records. Objects refer to each other by index and to strings by
+ * offset into the string section, where offset 0 is the empty string and
+ * means NULL. Types, items and civilizations come from the config files and
+ * are referred to by name.
+ *
+ * The stars and planets of a system, the ports of a planet and the items of
+ * a port are stored next to each other, so the owner only needs to know the
+ * first one and how many there are.
+ *
+ * The landmark tables, see landmark.c, are stored as they are, as they are
+ * indexed by the position of the systems in the snapshot.
+ *
+ * Snapshots are only meant to be loaded on the machine that saved them, so
+ * everything is stored in native byte order.
+ */
+#define SNAPSHOT_MAGIC "YASTGSNP"
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAP_NONE UINT32_MAX
+#define SNAP_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+enum snap_sections {
+	SNAP_SYSTEMS,
+	SNAP_LINKS,
+	SNAP_STARS,
+	SNAP_PLANETS,
+	SNAP_PORTS,
+	SNAP_STOCK,
+	SNAP_REQS,
+	SNAP_CIVS,
+	SNAP_LANDMARKS,
+	SNAP_COMPONENTS,
+	SNAP_LANDMARK_DISTANCES,
+	SNAP_LANDMARK_JUMPS,
+	SNAP_STRINGS,
+	SNAP_SECTION_NUM
+};
+
+struct snap_section {
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	int64_t created;
+	uint64_t inhabited_systems;
+	uint64_t id;
+	uint64_t journal_seq;
+	struct snap_section sections[SNAP_SECTION_NUM];
+};
+
+struct snap_system {
+	uint64_t name, gname;
+	int64_t x, y;
+	uint64_t r;
+	double phi;
+	int32_t hab;
+	uint32_t hablow, habhigh;
+	uint32_t owner;			/* Index of the civ, or SNAP_NONE */
+	uint32_t first_star, num_stars;
+	uint32_t first_planet, num_planets;
+	uint32_t first_link, num_links;
+};
+
+struct snap_star {
+	uint64_t name;
+	int32_t cls, lum, hab;
+	uint32_t lumval, hablow, habhigh, temp;
+	uint32_t pad;
+};
+
+struct snap_planet {
+	uint64_t name, gname;
+	uint64_t type;
+	uint32_t dia, dist, life;
+	uint32_t first_port, num_ports;
+	uint32_t pad;
+};
+
+struct snap_port {
+	uint64_t name;
+	uint64_t type;
+	int32_t docks;
+	uint32_t first_stock, num_stock, num_plain;
+	uint32_t first_req, num_req;
+	uint64_t journal_seq;
+	uint64_t updated_tick;
+};
+
+struct snap_stock {
+	uint64_t item;
+	int64_t amount, max, daily_change, price;
+	uint32_t req_start;		/* Relative to the port's first_req */
+	uint32_t pad;
+};
+
+struct snap_civ {
+	uint64_t name;
+	uint32_t home;
+	int32_t power;
+};
+
+static const size_t record_size[SNAP_SECTION_NUM] = {
+	[SNAP_SYSTEMS] = sizeof(struct snap_system),
+	[SNAP_LINKS] = sizeof(uint32_t),
+	[SNAP_STARS] = sizeof(struct snap_star),
+	[SNAP_PLANETS] = sizeof(struct snap_planet),
+	[SNAP_PORTS] = sizeof(struct snap_port),
+	[SNAP_STOCK] = sizeof(struct snap_stock),
+	[SNAP_REQS] = sizeof(uint32_t),
+	[SNAP_CIVS] = sizeof(struct snap_civ),
+	[SNAP_LANDMARKS] = sizeof(uint32_t),
+	[SNAP_COMPONENTS] = sizeof(uint32_t),
+	[SNAP_LANDMARK_DISTANCES] = sizeof(uint32_t),
+	[SNAP_LANDMARK_JUMPS] = sizeof(uint32_t),
+	[SNAP_STRINGS] = 1,
+};
+
+struct snap_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+struct system_index {
+	const struct system *system;
+	uint32_t idx;
+};
+
+struct snap_writer {
+	struct snap_buf sections[SNAP_SECTION_NUM];
+	struct system_index *index;
+	unsigned long num_systems;
+	struct universe *u;
+	uint64_t journal_seq;
+	int err;			/* Out of memory while adding something */
+};
+
+static void* buf_append(struct snap_buf *buf, const size_t size)
+{
+	size_t alloc;
+	void *ptr;
+
+	if (buf->len + size > buf->alloc) {
+		alloc = MAX(buf->alloc * 2, buf->len + size);
+		alloc = MAX(alloc, 4096);
+		ptr = realloc(buf->data, alloc);
+		if (!ptr)
+			return NULL;
+		buf->data = ptr;
+		buf->alloc = alloc;
+	}
+
+	ptr = buf->data + buf->len;
+	memset(ptr, 0, size);
+	buf->len += size;
+
+	return ptr;
+}
+
+static uint32_t section_len(struct snap_writer *w, const enum snap_sections s)
+{
+	return w->sections[s].len / record_size[s];
+}
+
+static void* add_record(struct snap_writer *w, const enum snap_sections s)
+{
+	void *ptr;
+
+	ptr = buf_append(&w->sections[s], record_size[s]);
+	if (!ptr)
+		w->err = 1;
+
+	return ptr;
+}
+
+/*
+ * Returns the offset of the string in the string section, or 0 for NULL
+ * and if we're out of memory, which also sets w->err.
+ */
+static uint64_t add_string(struct snap_writer *w, const char * const string)
+{
+	struct snap_buf *buf = &w->sections[SNAP_STRINGS];
+	size_t len;
+	char *ptr;
+
+	if (!string)
+		return 0;
+
+	len = strlen(string) + 1;
+	ptr = buf_append(buf, len);
+	if (!ptr) {
+		w->err = 1;
+		return 0;
+	}
+	memcpy(ptr, string, len);
+
+	return ptr - buf->data;
+}
+
+static int cmp_system_index(const void *_a, const void *_b)
+{
+	const struct system_index *a = _a;
+	const struct system_index *b = _b;
+
+	if (a->system < b->system)
+		return -1;
+	else if (a->system > b->system)
+		return 1;
+	else
+		return 0;
+}
+
+static uint32_t system_idx(struct snap_writer *w, const struct system * const s)
+{
+	struct system_index key = { .system = s };
+	struct system_index *found;
+
+	if (!s)
+		return SNAP_NONE;
+
+	found = bsearch(&key, w->index, w->num_systems, sizeof(*w->index), cmp_system_index);
+	return found ? found->idx : SNAP_NONE;
+}
+
+static uint32_t civ_idx(struct snap_writer *w, const struct civ * const c)
+{
+	struct civ *civ;
+	uint32_t i = 0;
+
+	if (!c)
+		return SNAP_NONE;
+
+	list_for_each_entry(civ, &w->u->civs, list) {
+		if (civ == c)
+			return i;
+		i++;
+	}
+
+	return SNAP_NONE;
+}
+
+static int save_port(struct snap_writer *w, struct port *port)
+{
+	struct snap_port *sp;
+	struct snap_stock *ss;
+	struct port_stock *stock = &port->stock;
+	uint32_t *req;
+
+	sp = add_record(w, SNAP_PORTS);
+	if (!sp)
+		return -1;
+	sp->name = add_string(w, port->name);
+	sp->type = add_string(w, port->type->name);
+	sp->docks = port->docks;
+
+	pthread_rwlock_wrlock(&port->items_lock);
+	port_catch_up(port);
+
+	sp->first_stock = section_len(w, SNAP_STOCK);
+	sp->num_stock = stock->len;
+	sp->num_plain = stock->num_plain;
+	sp->first_req = section_len(w, SNAP_REQS);
+	sp->num_req = stock->req_start[stock->len];
+	sp->journal_seq = port->journal_seq;
+	sp->updated_tick = port->updated_tick;
+
+	for (unsigned int i = 0; i < stock->len; i++) {
+		ss = add_record(w, SNAP_STOCK);
+		if (!ss)
+			goto err;
+		ss->item = add_string(w, stock->item[i]->name);
+		ss->amount = stock->amount[i];
+		ss->max = stock->max[i];
+		ss->daily_change = stock->daily_change[i];
+		ss->price = stock->price[i];
+		ss->req_start = stock->req_start[i];
+	}
+
+	for (unsigned int i = 0; i < sp->num_req; i++) {
+		req = add_record(w, SNAP_REQS);
+		if (!req)
+			goto err;
+		*req = stock->req[i];
+	}
+
+	pthread_rwlock_unlock(&port->items_lock);
+	return 0;
+
+err:
+	pthread_rwlock_unlock(&port->items_lock);
+	return -1;
+}
+
+static int save_planet(struct snap_writer *w, struct planet *planet)
+{
+	struct snap_planet *sp;
+
+	sp = add_record(w, SNAP_PLANETS);
+	if (!sp)
+		return -1;
+	sp->name = add_string(w, planet->name);
+	sp->gname = add_string(w, planet->gname);
+	sp->type = add_string(w, planet->type->name);
+	sp->dia = planet->dia;
+	sp->dist = planet->dist;
+	sp->life = planet->life;
+
+	return 0;
+}
+
+static int save_system(struct snap_writer *w, struct system *s)
+{
+	struct snap_system *ss;
+	struct snap_star *sst;
+	struct snap_planet *sp;
+	struct star *star;
+	struct planet *planet;
+	struct port *port;
+	struct system *link;
+	uint32_t *l, first_planet;
+	unsigned long lh, li;
+
+	ss = add_record(w, SNAP_SYSTEMS);
+	if (!ss)
+		return -1;
+	ss->name = add_string(w, s->name);
+	ss->gname = add_string(w, s->gname);
+	ss->x = s->x;
+	ss->y = s->y;
+	ss->r = s->r;
+	ss->phi = s->phi;
+	ss->hab = s->hab;
+	ss->hablow = s->hablow;
+	ss->habhigh = s->habhigh;
+	ss->owner = civ_idx(w, s->owner);
+
+	ss->first_star = section_len(w, SNAP_STARS);
+	ss->num_stars = ptrlist_len(&s->stars);
+	ptrlist_for_each_entry(star, &s->stars, lh) {
+		sst = add_record(w, SNAP_STARS);
+		if (!sst)
+			return -1;
+		sst->name = add_string(w, star->name);
+		sst->cls = star->cls;
+		sst->lum = star->lum;
+		sst->hab = star->hab;
+		sst->lumval = star->lumval;
+		sst->hablow = star->hablow;
+		sst->habhigh = star->habhigh;
+		sst->temp = star->temp;
+	}
+
+	first_planet = section_len(w, SNAP_PLANETS);
+	ss->first_planet = first_planet;
+	ss->num_planets = ptrlist_len(&s->planets);
+	ptrlist_for_each_entry(planet, &s->planets, lh) {
+		if (save_planet(w, planet))
+			return -1;
+	}
+
+	/* Records may have moved when the sections grew */
+	ptrlist_for_each_entry(planet, &s->planets, lh) {
+		sp = (struct snap_planet*)w->sections[SNAP_PLANETS].data + first_planet + lh;
+		sp->first_port = section_len(w, SNAP_PORTS);
+		sp->num_ports = ptrlist_len(&planet->ports);
+		ptrlist_for_each_entry(port, &planet->ports, li) {
+			if (save_port(w, port))
+				return -1;
+		}
+	}
+
+	ss = (struct snap_system*)w->sections[SNAP_SYSTEMS].data + section_len(w, SNAP_SYSTEMS) - 1;
+	ss->first_link = section_len(w, SNAP_LINKS);
+	ss->num_links = ptrlist_len(&s->links);
+	ptrlist_for_each_entry(link, &s->links, lh) {
+		l = add_record(w, SNAP_LINKS);
+		if (!l)
+			return -1;
+		*l = system_idx(w, link);
+	}
+
+	return 0;
+}
+
+static int save_civs(struct snap_writer *w)
+{
+	struct snap_civ *sc;
+	struct civ *c;
+
+	list_for_each_entry(c, &w->u->civs, list) {
+		sc = add_record(w, SNAP_CIVS);
+		if (!sc)
+			return -1;
+		sc->name = add_string(w, c->name);
+		sc->home = system_idx(w, c->home);
+		sc->power = c->power;
+	}
+
+	return 0;
+}
+
+static int add_table(struct snap_writer *w, const enum snap_sections s,
+		const uint32_t * const table, const size_t len)
+{
+	void *ptr;
+
+	if (!len)
+		return 0;
+
+	ptr = buf_append(&w->sections[s], len * record_size[s]);
+	if (!ptr)
+		return -1;
+	memcpy(ptr, table, len * record_size[s]);
+
+	return 0;
+}
+
+static int save_landmarks(struct snap_writer *w)
+{
+	const struct landmarks * const lm = &w->u->landmarks;
+
+	/* Without tables for all systems, they are built again when loading */
+	if (lm->num_systems != w->num_systems)
+		return 0;
+
+	if (add_table(w, SNAP_LANDMARKS, lm->systems, lm->num) ||
+			add_table(w, SNAP_COMPONENTS, lm->component, lm->num_systems) ||
+			add_table(w, SNAP_LANDMARK_DISTANCES, lm->distance, lm->num * lm->num_systems) ||
+			add_table(w, SNAP_LANDMARK_JUMPS, lm->jumps, lm->num * lm->num_systems))
+		return -1;
+
+	return 0;
+}
+
+static int write_snapshot(struct snap_writer *w, FILE *f)
+{
+	static const char padding[8];
+	struct snap_header header;
+	uint64_t offset;
+	size_t len;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.created = w->u->created;
+	header.inhabited_systems = w->u->inhabited_systems;
+	header.id = w->u->id;
+	header.journal_seq = w->journal_seq;
+
+	offset = sizeof(header);
+	for (int i = 0; i < SNAP_SECTION_NUM; i++) {
+		header.sections[i].offset = offset;
+		header.sections[i].count = w->sections[i].len / record_size[i];
+		offset += SNAP_ALIGN(w->sections[i].len);
+	}
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		return -1;
+
+	for (int i = 0; i < SNAP_SECTION_NUM; i++) {
+		len = w->sections[i].len;
+		if (len && fwrite(w->sections[i].data, len, 1, f) != 1)
+			return -1;
+		if (SNAP_ALIGN(len) != len && fwrite(padding, SNAP_ALIGN(len) - len, 1, f) != 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Saves the universe to file. The snapshot is written to a temporary file
+ * and synced first, so an existing snapshot is only replaced by a complete
+ * one, and the new one is on disk when this returns.
+ * journal_seq is the last journal record appended before saving started,
+ * which the snapshot includes.
+ */
+int snapshot_save(struct universe * const u, const char * const file, const uint64_t journal_seq)
+{
+	struct snap_writer w;
+	struct system *s;
+	unsigned long lh;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int r = -1;
+
+	memset(&w, 0, sizeof(w));
+	w.u = u;
+	w.journal_seq = journal_seq;
+
+	/* The empty string at offset 0 is NULL */
+	if (!buf_append(&w.sections[SNAP_STRINGS], 1))
+		goto out;
+
+	w.num_systems = ptrlist_len(&u->systems);
+	w.index = malloc(MAX(w.num_systems, 1) * sizeof(*w.index));
+	if (!w.index)
+		goto out;
+	ptrlist_for_each_entry(s, &u->systems, lh) {
+		w.index[lh].system = s;
+		w.index[lh].idx = lh;
+	}
+	qsort(w.index, w.num_systems, sizeof(*w.index), cmp_system_index);
+
+	if (save_civs(&w))
+		goto out;
+
+	ptrlist_for_each_entry(s, &u->systems, lh) {
+		if (save_system(&w, s))
+			goto out;
+	}
+
+	if (save_landmarks(&w))
+		goto out;
+
+	/* A string that didn't fit would be saved as NULL */
+	if (w.err)
+		goto out;
+
+	if (asprintf(&tmp, "%s.tmp", file) < 0) {
+		tmp = NULL;
+		goto out;
+	}
+
+	f = fopen(tmp, "w");
+	if (!f)
+		goto out;
+
+	if (write_snapshot(&w, f))
+		goto out;
+
+	if (fflush(f) || fsync(fileno(f)))
+		goto out;
+
+	if (fclose(f)) {
+		f = NULL;
+		goto out;
+	}
+	f = NULL;
+
+	if (rename(tmp, file) || sync_dir_of(file))
+		goto out;
+
+	log_printfn(LOG_MAIN, "saved universe with %lu systems to %s", w.num_systems, file);
+	r = 0;
+
+out:
+	if (f)
+		fclose(f);
+	if (r && tmp)
+		unlink(tmp);
+	free(tmp);
+	free(w.index);
+	for (int i = 0; i < SNAP_SECTION_NUM; i++)
+		free(w.sections[i].data);
+
+	return r;
+}
+
+struct snap_reader {
+	const char *data;
+	size_t size;
+	const struct snap_header *header;
+	const void *sections[SNAP_SECTION_NUM];
+	uint64_t counts[SNAP_SECTION_NUM];
+	struct system **systems;
+	struct universe *u;
+};
+
+#define SNAP_RECORDS(r, s, type) ((const type*)(r)->sections[s])
+
+/*
+ * Checks that count records starting with first are within section s.
+ */
+static int in_section(const struct snap_reader *r, const enum snap_sections s,
+		const uint64_t first, const uint64_t count)
+{
+	return first <= r->counts[s] && count <= r->counts[s] - first;
+}
+
+/*
+ * Returns the string at offset, or NULL if offset is 0 or invalid.
+ */
+static const char* snap_string(const struct snap_reader *r, const uint64_t offset)
+{
+	if (!offset || offset >= r->counts[SNAP_STRINGS])
+		return NULL;
+
+	return (const char*)r->sections[SNAP_STRINGS] + offset;
+}
+
+static int snap_strdup(const struct snap_reader *r, const uint64_t offset, char **string)
+{
+	const char *s = snap_string(r, offset);
+
+	if (!s) {
+		*string = NULL;
+		return 0;
+	}
+
+	*string = strdup(s);
+	return *string ? 0 : -1;
+}
+
+static int check_header(struct snap_reader *r)
+{
+	const struct snap_header *h = (const struct snap_header*)r->data;
+	uint64_t size;
+
+	if (r->size < sizeof(*h))
+		return -1;
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)))
+		return -1;
+	if (h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER)
+		return -1;
+
+	for (int i = 0; i < SNAP_SECTION_NUM; i++) {
+		if (h->sections[i].offset % 8 || h->sections[i].offset > r->size)
+			return -1;
+		if (h->sections[i].count > (r->size - h->sections[i].offset) / record_size[i])
+			return -1;
+
+		r->sections[i] = r->data + h->sections[i].offset;
+		r->counts[i] = h->sections[i].count;
+	}
+
+	/* All strings must be terminated within the string section */
+	size = r->counts[SNAP_STRINGS];
+	if (!size || ((const char*)r->sections[SNAP_STRINGS])[size - 1] != '\0')
+		return -1;
+
+	r->header = h;
+
+	return 0;
+}
+
+static struct planet_type* find_planet_type(struct universe * const u, const char * const name)
+{
+	struct planet_type *type;
+
+	if (!name)
+		return NULL;
+
+	list_for_each_entry(type, &u->planet_types, list) {
+		if (!strcmp(type->name, name))
+			return type;
+	}
+
+	return NULL;
+}
+
+static int load_port(struct snap_reader *r, const struct snap_port * const sp,
+		struct planet *planet, struct port **portp)
+{
+	const struct snap_stock *ss;
+	const uint32_t *req;
+	struct port_stock *stock;
+	struct port *port;
+	const char *type;
+
+	if (!in_section(r, SNAP_STOCK, sp->first_stock, sp->num_stock) ||
+			!in_section(r, SNAP_REQS, sp->first_req, sp->num_req) ||
+			sp->num_plain > sp->num_stock)
+		return -1;
+
+	port = malloc(sizeof(*port));
+	if (!port)
+		return -1;
+	port_init(port);
+	*portp = port;
+
+	port->planet = planet;
+	port->system = planet->system;
+	port->docks = sp->docks;
+	port->journal_seq = sp->journal_seq;
+	port->updated_tick = sp->updated_tick;
+
+	type = snap_string(r, sp->type);
+	port->type = type ? st_lookup_exact(&r->u->port_type_names, type) : NULL;
+	if (!port->type) {
+		log_printfn(LOG_MAIN, "snapshot refers to unknown port type \"%s\"", type ? type : "");
+		return -1;
+	}
+
+	if (snap_strdup(r, sp->name, &port->name) || !port->name)
+		return -1;
+
+	stock = &port->stock;
+	if (port_stock_alloc(stock, sp->num_stock, sp->num_req))
+		return -1;
+	stock->num_plain = sp->num_plain;
+
+	ss = SNAP_RECORDS(r, SNAP_STOCK, struct snap_stock) + sp->first_stock;
+	for (unsigned int i = 0; i < stock->len; i++) {
+		const char *item = snap_string(r, ss[i].item);
+
+		stock->item[i] = item ? st_lookup_exact(&r->u->item_names, item) : NULL;
+		if (!stock->item[i]) {
+			log_printfn(LOG_MAIN, "snapshot refers to unknown item \"%s\"", item ? item : "");
+			return -1;
+		}
+		if (ss[i].req_start > sp->num_req || (i && ss[i].req_start < stock->req_start[i - 1]))
+			return -1;
+		if (ss[i].amount < 0 || ss[i].amount > ss[i].max)
+			return -1;
+
+		stock->amount[i] = ss[i].amount;
+		stock->max[i] = ss[i].max;
+		stock->daily_change[i] = ss[i].daily_change;
+		stock->price[i] = ss[i].price;
+		stock->req_start[i] = ss[i].req_start;
+
+		if (st_add_string(&port->item_names, stock->item[i]->name, &stock->item[i]))
+			return -1;
+	}
+	stock->req_start[stock->len] = sp->num_req;
+	if (stock->len && stock->req_start[stock->len - 1] > sp->num_req)
+		return -1;
+
+	req = SNAP_RECORDS(r, SNAP_REQS, uint32_t) + sp->first_req;
+	for (unsigned int i = 0; i < sp->num_req; i++) {
+		if (req[i] >= stock->len)
+			return -1;
+		stock->req[i] = req[i];
+	}
+
+	price_init(stock);
+
+	return 0;
+}
+
+static int load_planet(struct snap_reader *r, const struct snap_planet * const sp,
+		struct system *s, struct planet **planetp)
+{
+	const struct snap_port *ports;
+	struct planet *planet;
+	struct port *port;
+
+	if (!in_section(r, SNAP_PORTS, sp->first_port, sp->num_ports))
+		return -1;
+
+	planet = malloc(sizeof(*planet));
+	if (!planet)
+		return -1;
+	planet_init(planet);
+	*planetp = planet;
+
+	planet->system = s;
+	planet->dia = sp->dia;
+	planet->dist = sp->dist;
+	planet->life = sp->life;
+
+	planet->type = find_planet_type(r->u, snap_string(r, sp->type));
+	if (!planet->type) {
+		log_printfn(LOG_MAIN, "snapshot refers to unknown planet type \"%s\"",
+				snap_string(r, sp->type) ? snap_string(r, sp->type) : "");
+		return -1;
+	}
+
+	if (snap_strdup(r, sp->name, &planet->name) || !planet->name)
+		return -1;
+	if (snap_strdup(r, sp->gname, &planet->gname))
+		return -1;
+
+	ports = SNAP_RECORDS(r, SNAP_PORTS, struct snap_port) + sp->first_port;
+	for (unsigned int i = 0; i < sp->num_ports; i++) {
+		port = NULL;
+		if (load_port(r, &ports[i], planet, &port)) {
+			if (port)
+				port_free(port);
+			return -1;
+		}
+		if (ptrlist_push(&planet->ports, port)) {
+			port_free(port);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int load_system(struct snap_reader *r, const struct snap_system * const ss, struct system *s)
+{
+	const struct snap_star *stars;
+	const struct snap_planet *planets;
+	const uint32_t *links;
+	struct star *star;
+	struct planet *planet;
+
+	if (!in_section(r, SNAP_STARS, ss->first_star, ss->num_stars) ||
+			!in_section(r, SNAP_PLANETS, ss->first_planet, ss->num_planets) ||
+			!in_section(r, SNAP_LINKS, ss->first_link, ss->num_links))
+		return -1;
+
+	if (snap_strdup(r, ss->name, &s->name) || !s->name)
+		return -1;
+	if (snap_strdup(r, ss->gname, &s->gname))
+		return -1;
+
+	s->x = ss->x;
+	s->y = ss->y;
+	s->r = ss->r;
+	s->phi = ss->phi;
+	s->hab = ss->hab;
+	s->hablow = ss->hablow;
+	s->habhigh = ss->habhigh;
+
+	stars = SNAP_RECORDS(r, SNAP_STARS, struct snap_star) + ss->first_star;
+	for (unsigned int i = 0; i < ss->num_stars; i++) {
+		star = malloc(sizeof(*star));
+		if (!star)
+			return -1;
+		memset(star, 0, sizeof(*star));
+
+		if (snap_strdup(r, stars[i].name, &star->name) || ptrlist_push(&s->stars, star)) {
+			free(star->name);
+			free(star);
+			return -1;
+		}
+
+		star->cls = stars[i].cls;
+		star->lum = stars[i].lum;
+		star->hab = stars[i].hab;
+		star->lumval = stars[i].lumval;
+		star->hablow = stars[i].hablow;
+		star->habhigh = stars[i].habhigh;
+		star->temp = stars[i].temp;
+	}
+
+	planets = SNAP_RECORDS(r, SNAP_PLANETS, struct snap_planet) + ss->first_planet;
+	for (unsigned int i = 0; i < ss->num_planets; i++) {
+		planet = NULL;
+		if (load_planet(r, &planets[i], s, &planet)) {
+			if (planet)
+				planet_free(planet);
+			return -1;
+		}
+		if (ptrlist_push(&s->planets, planet)) {
+			planet_free(planet);
+			return -1;
+		}
+	}
+
+	links = SNAP_RECORDS(r, SNAP_LINKS, uint32_t) + ss->first_link;
+	for (unsigned int i = 0; i < ss->num_links; i++) {
+		if (links[i] >= r->counts[SNAP_SYSTEMS])
+			return -1;
+		if (ptrlist_push(&s->links, r->systems[links[i]]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct civ* find_civ(struct universe * const u, const char * const name)
+{
+	struct civ *c;
+
+	if (!name)
+		return NULL;
+
+	list_for_each_entry(c, &u->civs, list) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * Civilizations are loaded from the config files, the snapshot only says
+ * where they live.
+ */
+static int load_civs(struct snap_reader *r, struct civ **civs)
+{
+	const struct snap_civ *sc = SNAP_RECORDS(r, SNAP_CIVS, struct snap_civ);
+	const char *name;
+
+	for (uint64_t i = 0; i < r->counts[SNAP_CIVS]; i++) {
+		name = snap_string(r, sc[i].name);
+		civs[i] = find_civ(r->u, name);
+		if (!civs[i]) {
+			log_printfn(LOG_MAIN, "snapshot refers to unknown civilization \"%s\", ignoring it",
+					name ? name : "");
+			continue;
+		}
+
+		if (sc[i].home != SNAP_NONE && sc[i].home >= r->counts[SNAP_SYSTEMS])
+			return -1;
+
+		civs[i]->power = sc[i].power;
+		civs[i]->home = sc[i].home == SNAP_NONE ? NULL : r->systems[sc[i].home];
+	}
+
+	return 0;
+}
+
+static int add_to_universe(struct universe * const u, struct system *s)
+{
+	struct planet *planet;
+	struct port *port;
+	unsigned long lh, li;
+
+	s->idx = ptrlist_len(&u->systems);
+	if (ptrlist_push(&u->systems, s))
+		return -1;
+	if (system_move(s, s->x, s->y))
+		return -1;
+	st_add_string(&u->systemnames, s->name, s);
+
+	ptrlist_for_each_entry(planet, &s->planets, lh) {
+		st_add_string(&u->planetnames, planet->name, planet);
+		if (planet->gname)
+			st_add_string(&u->planetnames, planet->gname, planet);
+
+		ptrlist_for_each_entry(port, &planet->ports, li) {
+			if (ptrlist_push(&u->ports, port))
+				return -1;
+			st_add_string(&u->portnames, port->name, port);
+		}
+	}
+
+	if (s->owner)
+		ptrlist_push(&s->owner->systems, s);
+
+	return 0;
+}
+
+static int load_universe(struct snap_reader *r)
+{
+	const struct snap_system *ss = SNAP_RECORDS(r, SNAP_SYSTEMS, struct snap_system);
+	const uint64_t num = r->counts[SNAP_SYSTEMS];
+	struct civ **civs = NULL;
+	uint64_t i = 0;
+
+	/*
+	 * All systems are allocated first, so that links can be fixed up
+	 * while loading them.
+	 */
+	r->systems = calloc(MAX(num, 1), sizeof(*r->systems));
+	civs = calloc(MAX(r->counts[SNAP_CIVS], 1), sizeof(*civs));
+	if (!r->systems || !civs)
+		goto err;
+
+	for (i = 0; i < num; i++) {
+		r->systems[i] = malloc(sizeof(*r->systems[i]));
+		if (!r->systems[i])
+			goto err;
+		system_init(r->systems[i]);
+	}
+
+	if (load_civs(r, civs))
+		goto err;
+
+	for (i = 0; i < num; i++) {
+		if (load_system(r, &ss[i], r->systems[i]))
+			goto err;
+
+		if (ss[i].owner != SNAP_NONE) {
+			if (ss[i].owner >= r->counts[SNAP_CIVS])
+				goto err;
+			r->systems[i]->owner = civs[ss[i].owner];
+		}
+	}
+
+	pthread_rwlock_wrlock(&r->u->systemnames_lock);
+	pthread_rwlock_wrlock(&r->u->planetnames_lock);
+	pthread_rwlock_wrlock(&r->u->portnames_lock);
+	pthread_rwlock_wrlock(&r->u->ports_lock);
+
+	for (i = 0; i < num; i++) {
+		if (add_to_universe(r->u, r->systems[i]))
+			break;
+	}
+
+	pthread_rwlock_unlock(&r->u->ports_lock);
+	pthread_rwlock_unlock(&r->u->portnames_lock);
+	pthread_rwlock_unlock(&r->u->planetnames_lock);
+	pthread_rwlock_unlock(&r->u->systemnames_lock);
+
+	/* Systems already in the universe are freed along with it */
+	if (i < num) {
+		i++;
+		goto err;
+	}
+
+	r->u->created = r->header->created;
+	r->u->inhabited_systems = r->header->inhabited_systems;
+	r->u->id = r->header->id;
+	r->u->journal_seq = r->header->journal_seq;
+
+	free(civs);
+	free(r->systems);
+
+	return 0;
+
+err:
+	for (; r->systems && i < num; i++) {
+		if (r->systems[i])
+			system_free(r->systems[i]);
+	}
+	free(civs);
+	free(r->systems);
+	return -1;
+}
+
+static int load_landmarks(struct snap_reader *r)
+{
+	struct landmarks * const lm = &r->u->landmarks;
+	const uint64_t num_systems = r->counts[SNAP_SYSTEMS];
+	const uint64_t num = r->counts[SNAP_LANDMARKS];
+	const uint32_t *systems = SNAP_RECORDS(r, SNAP_LANDMARKS, uint32_t);
+
+	if (!r->counts[SNAP_COMPONENTS]) {
+		log_printfn(LOG_MAIN, "snapshot has no landmarks, picking new ones");
+		return landmarks_build(lm, LANDMARKS_NUM);
+	}
+
+	if (r->counts[SNAP_COMPONENTS] != num_systems || num > num_systems ||
+			r->counts[SNAP_LANDMARK_DISTANCES] != num * num_systems ||
+			r->counts[SNAP_LANDMARK_JUMPS] != num * num_systems)
+		return -1;
+
+	for (uint64_t i = 0; i < num; i++) {
+		if (systems[i] >= num_systems)
+			return -1;
+	}
+
+	if (landmarks_alloc(lm, num, num_systems))
+		return -1;
+
+	memcpy(lm->systems, systems, num * sizeof(*lm->systems));
+	memcpy(lm->component, r->sections[SNAP_COMPONENTS], num_systems * sizeof(*lm->component));
+	memcpy(lm->distance, r->sections[SNAP_LANDMARK_DISTANCES], num * num_systems * sizeof(*lm->distance));
+	memcpy(lm->jumps, r->sections[SNAP_LANDMARK_JUMPS], num * num_systems * sizeof(*lm->jumps));
+
+	return 0;
+}
+
+/*
+ * Loads a universe saved by snapshot_save(). The config files must have been
+ * loaded already, as the snapshot refers to types, items and civilizations
+ * by name.
+ */
+int snapshot_load(struct universe * const u, const char * const file)
+{
+	struct snap_reader r;
+	struct stat st;
+	void *data;
+	int fd, ret = -1;
+
+	memset(&r, 0, sizeof(r));
+	r.u = u;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		log_printfn(LOG_MAIN, "could not open snapshot %s: %s", file, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || !st.st_size) {
+		log_printfn(LOG_MAIN, "could not read snapshot %s", file);
+		goto close;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		log_printfn(LOG_MAIN, "could not map snapshot %s: %s", file, strerror(errno));
+		goto close;
+	}
+
+	r.data = data;
+	r.size = st.st_size;
+
+	if (check_header(&r)) {
+		log_printfn(LOG_MAIN, "%s is not a valid snapshot", file);
+		goto unmap;
+	}
+
+	if (load_universe(&r)) {
+		log_printfn(LOG_MAIN, "snapshot %s is corrupt or doesn't match the config files", file);
+		goto unmap;
+	}
+
+	if (load_landmarks(&r)) {
+		log_printfn(LOG_MAIN, "snapshot %s has corrupt landmark tables", file);
+		goto unmap;
+	}
+
+	log_printfn(LOG_MAIN, "loaded universe with %lu systems and %lu ports from %s",
+			ptrlist_len(&u->systems), ptrlist_len(&u->ports), file);
+	ret = 0;
+
+unmap:
+	munmap(data, st.st_size);
+close:
+	close(fd);
+	return ret;
+}
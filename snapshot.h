@@ -0,0 +1,9 @@
+#ifndef _HAS_SNAPSHOT_H
+#define _HAS_SNAPSHOT_H
+
+#include "universe.h"
+
+int snapshot_save(struct universe * const u, const char * const file, const uint64_t journal_seq);
+int snapshot_load(struct universe * const u, const char * const file);
+
+#endif
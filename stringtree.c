@@ -4,86 +4,107 @@
 #include <stringtree.h>
 #include "common.h"
 
-struct char_list {
-	char c;
-	struct list_head list;
-};
+#define ST_MIN_CHILDREN 2
 
 void st_init(struct st_node * const node)
 {
 	assert(node);
 
 	memset(node, 0, sizeof(*node));
-
-	INIT_LIST_HEAD(&node->children);
-	INIT_LIST_HEAD(&node->list);
 }
 
-void st_destroy(struct list_head * const root, const enum st_free_data do_free_data)
+static void free_children(struct st_node * const node, const enum st_free_data do_free_data)
 {
-	struct st_node *node, *_node;
+	for (unsigned int i = 0; i < node->len; i++) {
+		free_children(&node->children[i], do_free_data);
+		if (do_free_data == ST_DO_FREE_DATA)
+			free(node->children[i].data);
+	}
+
+	free(node->children);
+}
 
+void st_destroy(struct st_node * const root, const enum st_free_data do_free_data)
+{
 	assert(root);
 
-	list_for_each_entry_safe(node, _node, root, list) {
-		if (!list_empty(&node->children))
-			st_destroy(&node->children, do_free_data);
-		list_del(&node->list);
-		if (do_free_data == ST_DO_FREE_DATA)
-			free(node->data);
-		free(node);
-	}
+	free_children(root, do_free_data);
+	st_init(root);
 }
 
-static int _st_add_string(struct list_head * const root, char *string, void *data)
+/*
+ * Returns the index of the child for c, or if there is no such child,
+ * the index where it should be inserted.
+ */
+static unsigned int child_index(const struct st_node * const node, const char c)
 {
-	struct st_node *new_node, *prev_node;
-
-	new_node = NULL;
-	list_for_each_entry(prev_node, root, list) {
-		if (prev_node->c == string[0])
-			new_node = prev_node;
-		if (prev_node->c >= string[0])
-			break;
+	unsigned int lo = 0, hi = node->len, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (node->children[mid].c < c)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (!new_node) {
-		new_node = malloc(sizeof(*new_node));
-		if (!new_node)
-			return -1;
+	return lo;
+}
 
-		st_init(new_node);
-		new_node->c = string[0];
+static struct st_node* find_child(const struct st_node * const node, const char c)
+{
+	unsigned int i = child_index(node, c);
 
-		list_add_tail(&new_node->list, &prev_node->list);
-	}
+	if (i < node->len && node->children[i].c == c)
+		return &node->children[i];
 
-	if (string[1] == '\0') {
-		new_node->data = data;
-		return 0;
-	} else {
-		return st_add_string(&new_node->children, string + 1, data);
-	}
+	return NULL;
 }
 
-int st_add_string(struct list_head * const root, const char *_string, void *data)
+static struct st_node* add_child(struct st_node * const node, const char c)
 {
-	char *string;
-	int r;
+	unsigned int i = child_index(node, c);
+	struct st_node *ptr;
+	unsigned int size;
 
-	if (!root || !_string || _string[0] == '\0')
-		return -1;
+	if (i < node->len && node->children[i].c == c)
+		return &node->children[i];
+
+	if (node->len == node->alloc) {
+		size = MAX(node->alloc * 2, ST_MIN_CHILDREN);
+		ptr = realloc(node->children, size * sizeof(*ptr));
+		if (!ptr)
+			return NULL;
+		node->children = ptr;
+		node->alloc = size;
+	}
+
+	memmove(&node->children[i + 1], &node->children[i],
+			(node->len - i) * sizeof(*node->children));
+	node->len++;
 
-	string = strdup(_string);
-	if (!string)
+	st_init(&node->children[i]);
+	node->children[i].c = c;
+
+	return &node->children[i];
+}
+
+int st_add_string(struct st_node * const root, const char *string, void *data)
+{
+	struct st_node *node = root;
+
+	if (!root || !string || string[0] == '\0')
 		return -1;
 
-	downcase_valid(string);
+	for (; *string; string++) {
+		node = add_child(node, DOWNCASE_VALID(*string));
+		if (!node)
+			return -1;
+	}
 
-	r = _st_add_string(root, string, data);
+	node->data = data;
 
-	free(string);
-	return r;
+	return 0;
 }
 
 /*
@@ -92,20 +113,22 @@ int st_add_string(struct list_head * const root, const char *_string, void *data
  * it will return NULL. This is useful for implementing matching the shortest
  * unique string for a set of strings.
  */
-static int _get_the_only_child(const struct list_head * const root, struct st_node **unique)
+static int _get_the_only_child(const struct st_node * const root, const struct st_node **unique)
 {
-	struct st_node *node;
+	const struct st_node *node;
 	int r;
 
-	list_for_each_entry(node, root, list) {
+	for (unsigned int i = 0; i < root->len; i++) {
+		node = &root->children[i];
+
 		if (node->data) {
 			if (!*unique)
 				*unique = node;
 			else
 				return -1;
 		}
-		if (!list_empty(&node->children)) {
-			r = _get_the_only_child(&node->children, unique);
+		if (node->len) {
+			r = _get_the_only_child(node, unique);
 			if (r)
 				return r;
 		}
@@ -114,61 +137,45 @@ static int _get_the_only_child(const struct list_head * const root, struct st_no
 	return 0;
 }
 
-static void* get_the_only_child(const struct list_head * const root)
+static struct st_node* get_the_only_child(const struct st_node * const root)
 {
-	struct st_node *node = NULL;
+	const struct st_node *node = NULL;
 	int r;
 
 	r = _get_the_only_child(root, &node);
 	if (r)
 		return NULL;
 
-	return node;
+	return (struct st_node*)node;
 }
 
-static struct st_node* find_node(const struct list_head * const root, const char * const string, const int exact_match_only)
+static struct st_node* find_node(const struct st_node * const root, const char *string, const int exact_match_only)
 {
-	struct st_node *node;
-
-	list_for_each_entry(node, root, list) {
-		if (node->c < string[0])
-			continue;
-
-		if (node->c > string[0])
-			return NULL;
-
-		if (string[1] != '\0')
-			return find_node(&node->children, string + 1, exact_match_only);
+	struct st_node *node = (struct st_node*)root;
 
-		if (node->data)
-			return node;
+	if (!root || !string || string[0] == '\0')
+		return NULL;
 
-		if (exact_match_only)
+	for (; *string; string++) {
+		node = find_child(node, DOWNCASE_VALID(*string));
+		if (!node)
 			return NULL;
-		else
-			return get_the_only_child(&node->children);
 	}
 
-	return NULL;
+	if (node->data)
+		return node;
+
+	if (exact_match_only)
+		return NULL;
+	else
+		return get_the_only_child(node);
 }
 
-void* st_lookup_string(const struct list_head * const root, const char * const _string)
+void* st_lookup_string(const struct st_node * const root, const char * const string)
 {
 	struct st_node *node;
-	char *string;
-
-	if (!root || !_string || _string[0] == '\0')
-		return NULL;
-
-	string = strdup(_string);
-	if (!string)
-		return NULL;
-
-	downcase_valid(string);
 
 	node = find_node(root, string, 0);
-
-	free(string);
 	if (!node)
 		return NULL;
 
@@ -176,23 +183,11 @@ void* st_lookup_string(const struct list_head * const root, const char * const _
 }
 
 
-void* st_lookup_exact(const struct list_head * const root, const char * const _string)
+void* st_lookup_exact(const struct st_node * const root, const char * const string)
 {
 	struct st_node *node;
-	char *string;
-
-	if (!root || !_string || _string[0] == '\0')
-		return NULL;
-
-	string = strdup(_string);
-	if (!string)
-		return NULL;
-
-	downcase_valid(string);
 
 	node = find_node(root, string, 1);
-
-	free(string);
 	if (!node)
 		return NULL;
 
@@ -205,24 +200,12 @@ void* st_lookup_exact(const struct list_head * const root, const char * const _s
  * This is a feature for trees where it is likely the nodes will be reused
  * later on and we want to keep the calls to malloc() and free() down.
  */
-void* st_rm_string(struct list_head * const root, const char * const _string)
+void* st_rm_string(struct st_node * const root, const char * const string)
 {
 	void *data;
 	struct st_node *node;
-	char *string;
-
-	if (!root || !_string || _string[0] == '\0')
-		return NULL;
-
-	string = strdup(_string);
-	if (!string)
-		return NULL;
-
-	downcase_valid(string);
 
 	node = find_node(root, string, 1);
-
-	free(string);
 	if (!node)
 		return NULL;
 
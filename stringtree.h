@@ -1,58 +1,62 @@
 #ifndef _HAS_STRINGTREE_H
 #define _HAS_STRINGTREE_H
 
-#include "list.h"
 
 /*
- * The st_node structs will look somewhat like this for the strings "test" and "tert"
- * Dashes boxes represent one st_node struct while dotted boxes is a struct list_head.
- * If a struct parameter is not listed, assume it is 0 or NULL.
- * The "->" arrows represents a linked list relationship.
+ * A trie of strings, where each st_node holds its children in an array
+ * sorted on the character. The st_node structs will look somewhat like this
+ * for the strings "test" and "tert". Boxes are st_node structs and brackets
+ * are children arrays. If a struct parameter is not listed, assume it is 0
+ * or NULL.
  *
- * +......+  +---------+
- * . root .->| c = 't' |
- * +......+  +---------+
- *                |
- *                | children
- *                |
- *           +---------+
- *           | c = 'e' |
- *           +---------+
- *                |
- *                | children
- *                |
- *           +---------+   list    +---------+
- *           | c = 's' |---------->| c = 'r' |
- *           +---------+           +---------+
- *                |                     |
- *                | children            | children
- *                |                     |
- *           +------------------+ +----------------------+
- *           | c = 't'          | | c = 't'              |
- *           | data = a_pointer | | data = other_pointer |
- *           +------------------+ +----------------------+
+ * +------+
+ * | root |
+ * +------+
+ *    |
+ *    | children
+ *    |
+ * [ c = 't' ]
+ *      |
+ *      | children
+ *      |
+ * [ c = 'e' ]
+ *      |
+ *      | children
+ *      |
+ * [ c = 'r'            ,  c = 's'          ]
+ *      |                     |
+ *      | children            | children
+ *      |                     |
+ * [ c = 't'              ] [ c = 't'          ]
+ * [ data = other_pointer ] [ data = a_pointer ]
+ *
+ * All strings are case folded while walking the trie, see DOWNCASE_VALID().
+ * An empty root is a zeroed st_node, so ST_ROOT_INIT or st_init() can be used.
  */
 
 struct st_node {
 	char c;
+	unsigned short len;
+	unsigned short alloc;
 	void *data;
-	struct list_head children;
-	struct list_head list;
+	struct st_node *children;
 };
 
+#define ST_ROOT_INIT { 0 }
+
 enum st_free_data {
 	ST_DONT_FREE_DATA,
 	ST_DO_FREE_DATA
 };
 
 void st_init(struct st_node * const node);
-void st_destroy(struct list_head * const root, const enum st_free_data do_free_data);
+void st_destroy(struct st_node * const root, const enum st_free_data do_free_data);
 
-int st_add_string(struct list_head * const root, const char *_string, void *data);
+int st_add_string(struct st_node * const root, const char *_string, void *data);
 
-void* st_lookup_string(const struct list_head * const root, const char * const string);
-void* st_lookup_exact(const struct list_head * const root, const char * const string);
+void* st_lookup_string(const struct st_node * const root, const char * const string);
+void* st_lookup_exact(const struct st_node * const root, const char * const string);
 
-void* st_rm_string(struct list_head * const root, const char * const string);
+void* st_rm_string(struct st_node * const root, const char * const string);
 
 #endif
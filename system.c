@@ -10,6 +10,7 @@
 #include "planet.h"
 #include "port.h"
 #include "ptrlist.h"
+#include "grid.h"
 #include "parseconfig.h"
 #include "star.h"
 
@@ -18,7 +19,6 @@ void system_init(struct system *s)
 	memset(s, 0, sizeof(*s));
 	s->phi = 0.0;
 
-	rb_init_node(&s->x_rbtree);
 	ptrlist_init(&s->stars);
 	ptrlist_init(&s->planets);
 	ptrlist_init(&s->ports);
@@ -28,7 +28,7 @@ void system_init(struct system *s)
 }
 
 void system_free(struct system *s) {
-	struct list_head *lh;
+	unsigned long lh;
 	struct star *sol;
 	struct planet *planet;
 	struct port *port;
@@ -56,7 +56,7 @@ void system_free(struct system *s) {
 int system_create(struct system *s, char *name)
 {
 	struct star *sol;
-	struct list_head *lh;
+	unsigned long lh;
 
 	system_init(s);
 
@@ -85,6 +85,19 @@ int system_create(struct system *s, char *name)
 	return 0;
 }
 
+/*
+ * Use this instead of system_distance() when only comparing distances,
+ * as it is a lot cheaper. See grid_distances_squared() for the details.
+ */
+unsigned long system_distance_squared(const struct system * const a, const struct system * const b)
+{
+	unsigned long d;
+
+	grid_distances_squared(&b->x, &b->y, 1, a->x, a->y, &d);
+
+	return d;
+}
+
 unsigned long system_distance(const struct system * const a, const struct system * const b) {
 	long result = sqrt( (double)(b->x - a->x)*(b->x - a->x) +
 			(double)(b->y - a->y)*(b->y - a->y) );
@@ -3,16 +3,15 @@
 
 #include "civ.h"
 #include "list.h"
-#include "rbtree.h"
 #include "ptrlist.h"
 #include "universe.h"
 
 struct system {
 	char *name;
+	unsigned long idx;		/* Position in univ.systems */
 	struct civ *owner;
 	char *gname;
 	long x, y;
-	struct rb_node x_rbtree;
 	unsigned long r;
 	double phi;
 	int hab;
@@ -29,5 +28,6 @@ int system_create(struct system *s, char *name);
 void system_free(struct system *s);
 
 unsigned long system_distance(const struct system * const a, const struct system * const b);
+unsigned long system_distance_squared(const struct system * const a, const struct system * const b);
 
 #endif
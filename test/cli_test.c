@@ -4,7 +4,7 @@
 #include "cli.h"
 #include "list.h"
 
-#define NUM_TESTS 57
+#define NUM_TESTS 64
 
 struct test_data {
 	const char cmd[32];
@@ -50,7 +50,7 @@ char string_is_valid_help[] = "Returns 0 if string is 'valid', else -1";
  * in all lengths from one character up to INVALID_MAX_LENGTH.
  */
 #define INVALID_MAX_LENGTH 3
-static int do_add_invalid_cmds_test(struct list_head *head)
+static int do_add_invalid_cmds_test(struct st_node *head)
 {
 	unsigned int tests = 0;
 	int data = 0;
@@ -72,7 +72,7 @@ static int do_add_invalid_cmds_test(struct list_head *head)
 	return tests;
 }
 
-static int do_add_remove_tests(struct list_head *head)
+static int do_add_remove_tests(struct st_node *head)
 {
 	unsigned int tests = 0;
 	int data = 0;
@@ -100,7 +100,7 @@ static int do_add_remove_tests(struct list_head *head)
 	return tests;
 }
 
-static int do_uniqueness_tests(struct list_head *head)
+static int do_uniqueness_tests(struct st_node *head)
 {
 	unsigned int tests = 0;
 	int data = 0;
@@ -121,7 +121,7 @@ static int do_uniqueness_tests(struct list_head *head)
 	return tests;
 }
 
-static int do_data_tests(struct list_head *head)
+static int do_data_tests(struct st_node *head)
 {
 	unsigned int tests = 0;
 	int data = 0;
@@ -136,13 +136,19 @@ static int do_data_tests(struct list_head *head)
 		tests++;
 	}
 
+	data = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(codes); i++) {
+		assert(cli_run_cmd_on(head, "foo", &codes[i]) == codes[i]);
+		tests++;
+	}
+
 	assert(!cli_rm_cmd(head, "foo"));
 	tests++;
 
 	return tests;
 }
 
-static int do_param_tests(struct list_head *head)
+static int do_param_tests(struct st_node *head)
 {
 	unsigned int tests = 0;
 
@@ -169,7 +175,7 @@ static int do_param_tests(struct list_head *head)
 	return tests;
 }
 
-static int do_run_invalid_cmds_test(struct list_head *head)
+static int do_run_invalid_cmds_test(struct st_node *head)
 {
 	unsigned int tests = 0;
 
@@ -193,7 +199,7 @@ static int do_run_invalid_cmds_test(struct list_head *head)
 int main(int argc, char *argv[])
 {
 	unsigned int tests = 0;
-	LIST_HEAD(head);
+	struct st_node head = ST_ROOT_INIT;
 
 	tests += do_add_invalid_cmds_test(&head);
 	tests += do_add_remove_tests(&head);
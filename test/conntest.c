@@ -1,143 +1,695 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/queue.h>
 
-struct connect_info {
-	char *host;
-	uint16_t port;
+/*
+ * Load generator for yastg. Every connection is a simulated player that
+ * runs a random mix of commands, sending the next one as soon as the
+ * server's prompt for the previous one has arrived. The time from sending
+ * a command until its prompt arrives is the command's latency.
+ *
+ * Players move around by looking at where they are and picking a planet,
+ * port, item or hyperspace link from what the server told them. Every
+ * move is followed by a look, so the player always knows where it is.
+ */
+
+#define PROMPT "yastg> "
+#define PROMPT_LEN (sizeof(PROMPT) - 1)
+
+#define DEF_CONNS 1000
+#define DEF_DURATION 30
+#define DEF_WARMUP 5
+/*
+ * The server's listen backlog is small, and connections that don't fit are
+ * only established on the server side when it retransmits its SYN ACK, so
+ * only this many players at a time wait for their first prompt.
+ */
+#define MAX_CONNECTING 16
+#define MAX_NAMES 32
+#define MAX_NAME_LEN 64
+#define MAX_RESPONSE (1 << 20)
+#define MIN_BUF 4096
+
+enum location {
+	UNKNOWN,
+	SYSTEM,
+	PLANET,
+	PORT,
+	LOCATION_NUM
+};
+
+enum command {
+	CMD_LOOK,
+	CMD_MAP,
+	CMD_PORTS,
+	CMD_GO,
+	CMD_ORBIT,
+	CMD_DOCK,
+	CMD_LEAVE,
+	CMD_TRADE,
+	CMD_BUY,
+	CMD_SELL,
+	CMD_NUM
+};
+
+static const char *command_names[CMD_NUM] = {
+	"look", "map", "ports", "go", "orbit", "dock", "leave", "trade", "buy", "sell"
+};
+
+/* Which commands make sense where */
+static const int command_locations[CMD_NUM] = {
+	[CMD_LOOK] = 1 << SYSTEM | 1 << PLANET | 1 << PORT,
+	[CMD_MAP] = 1 << SYSTEM,
+	[CMD_PORTS] = 1 << SYSTEM | 1 << PLANET | 1 << PORT,
+	[CMD_GO] = 1 << SYSTEM,
+	[CMD_ORBIT] = 1 << SYSTEM,
+	[CMD_DOCK] = 1 << PLANET,
+	[CMD_LEAVE] = 1 << PLANET | 1 << PORT,
+	[CMD_TRADE] = 1 << PORT,
+	[CMD_BUY] = 1 << PORT,
+	[CMD_SELL] = 1 << PORT,
+};
+
+static unsigned int mix[CMD_NUM] = {
+	[CMD_LOOK] = 20,
+	[CMD_MAP] = 2,
+	[CMD_PORTS] = 3,
+	[CMD_GO] = 5,
+	[CMD_ORBIT] = 10,
+	[CMD_DOCK] = 10,
+	[CMD_LEAVE] = 5,
+	[CMD_TRADE] = 15,
+	[CMD_BUY] = 15,
+	[CMD_SELL] = 15,
+};
+
+/*
+ * Latencies are counted in buckets with 64 sub-buckets per power of two,
+ * which keeps the error below 2% over the whole range.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct names {
+	unsigned int len;
+	char name[MAX_NAMES][MAX_NAME_LEN];
+};
+
+struct player {
 	int fd;
-	struct sockaddr_in server_addr;
-	SLIST_ENTRY(connect_info) list;
+	int connected;
+	enum location location;
+	enum command cmd;
+	uint64_t sent;			/* When the command was sent, in ns */
+	char *buf;
+	size_t len;
+	size_t alloc;
+	struct names places;		/* Planets in a system, ports at a planet */
+	struct names links;		/* Hyperspace links from a system */
+	struct names items;		/* Traded at the current port */
+	char cargo[MAX_NAME_LEN];	/* Last item bought */
 };
-SLIST_HEAD(connect_head, connect_info) conn_list;
 
-#define NUM_CONN 512
-int initialize_connections(struct connect_head *list, char *host, uint16_t port)
+static struct histogram total;
+static struct histogram per_cmd[CMD_NUM];
+static unsigned long errors, disconnects;
+static int measuring;
+static volatile sig_atomic_t interrupted;
+
+static uint64_t now_ns()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static unsigned int bucket_of(const uint64_t v)
+{
+	int shift;
+
+	if (v < 2 * HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+static uint64_t bucket_value(const unsigned int b)
 {
-	struct connect_info *info;
+	int shift;
 
-	for (unsigned int i = 0; i < NUM_CONN; i++) {
-		info = malloc(sizeof(*info));
-		assert(info);
-		memset(info, 0, sizeof(*info));
-		info->host = host;
-		info->port = port;
+	if (b < 2 * HIST_SUB)
+		return b;
 
-		info->fd = socket(AF_INET, SOCK_STREAM, 0);
-		assert(info->fd >= 0);
+	shift = b / HIST_SUB - 1;
+	return (uint64_t)(b % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void hist_add(struct histogram * const h, const uint64_t usec)
+{
+	h->buckets[bucket_of(usec)]++;
+	h->count++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
 
-		memset(&info->server_addr, 0, sizeof(info->server_addr));
-		info->server_addr.sin_family = AF_INET;
-		info->server_addr.sin_port = htons(info->port);
-		assert(inet_pton(AF_INET, info->host, &info->server_addr.sin_addr));
+static uint64_t hist_percentile(const struct histogram * const h, const double p)
+{
+	uint64_t rank = h->count * p, seen = 0;
 
-		SLIST_INSERT_HEAD(list, info, list);
+	for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen > rank)
+			return bucket_value(b);
 	}
 
+	return h->max;
+}
+
+static int random_below(const unsigned int n)
+{
+	return n ? (unsigned int)rand() % n : 0;
+}
+
+static int set_nonblocking(const int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int start_connect(struct player * const p, const int epfd, const struct sockaddr_in * const addr)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	memset(p, 0, sizeof(*p));
+	p->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (p->fd < 0)
+		return -1;
+	if (set_nonblocking(p->fd))
+		goto err;
+	setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(p->fd, (const struct sockaddr*)addr, sizeof(*addr)) && errno != EINPROGRESS)
+		goto err;
+
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = p;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev))
+		goto err;
+
 	return 0;
+
+err:
+	close(p->fd);
+	p->fd = -1;
+	return -1;
+}
+
+static void add_name(struct names * const names, const char *start, size_t len)
+{
+	while (len && start[len - 1] == ' ')
+		len--;
+
+	if (!len || len >= MAX_NAME_LEN || names->len == MAX_NAMES)
+		return;
+
+	memcpy(names->name[names->len], start, len);
+	names->name[names->len][len] = '\0';
+	names->len++;
 }
 
-int establish_connections(struct connect_head *list)
+/*
+ * Collects the lines indented by two spaces following the line containing
+ * header, cutting each line at cut if it's there. Lines indented further
+ * are details and are skipped.
+ */
+static void parse_list(struct names * const names, const char *buf,
+		const char * const header, const char * const cut)
 {
-	struct connect_info *info;
+	const char *line, *end, *c;
 
-	SLIST_FOREACH(info, list, list) {
-		printf("establishing\n");
-		connect(info->fd, (struct sockaddr*)&info->server_addr, sizeof(info->server_addr));
-		assert(info->fd > 0);
+	line = strstr(buf, header);
+	if (!line)
+		return;
+	line = strchr(line, '\n');
+
+	while (line && line[1] == ' ' && line[2] == ' ') {
+		line += 3;
+		end = strchr(line, '\n');
+		if (!end)
+			break;
+		if (*line != ' ') {
+			c = cut ? strstr(line, cut) : NULL;
+			add_name(names, line, (c && c < end ? c : end) - line);
+		}
+		line = end;
 	}
+}
 
-	return 0;
+static void parse_look(struct player * const p)
+{
+	p->places.len = 0;
+	p->links.len = 0;
+
+	if (!strncmp(p->buf, "System ", 7)) {
+		p->location = SYSTEM;
+		parse_list(&p->places, p->buf, "Planets:", ": Class");
+		parse_list(&p->links, p->buf, "hyperspace links to", NULL);
+	} else if (!strncmp(p->buf, "Planet ", 7)) {
+		p->location = PLANET;
+		parse_list(&p->places, p->buf, "Ports:", NULL);
+	} else if (!strncmp(p->buf, "Station ", 8)) {
+		p->location = PORT;
+		p->items.len = 0;
+	} else {
+		p->location = UNKNOWN;
+	}
 }
 
-static char data[] = "\n";
-int write_on_connections(struct connect_head *list)
+/*
+ * Item names are in the first, 26 character wide column. Longer names
+ * are cut, but the server accepts unique prefixes.
+ */
+static void parse_trade(struct player * const p)
 {
-	struct connect_info *info;
-	int n;
+	const char *line = strchr(p->buf, '\n'), *end;
 
-	SLIST_FOREACH(info, list, list) {
-		printf("writing\n");
-		n = write(info->fd, data, strlen(data));
-		assert(n > 0);
-		assert((unsigned int)n == strlen(data));
+	p->items.len = 0;
+	while (line && (end = strchr(line + 1, '\n'))) {
+		line++;
+		if (end - line > 26 && strncmp(line, "You have", 8))
+			add_name(&p->items, line, 26);
+		line = end;
 	}
+}
 
-	return 0;
+static void handle_response(struct player * const p)
+{
+	uint64_t usec = (now_ns() - p->sent) / 1000;
+
+	p->buf[p->len - PROMPT_LEN] = '\0';
+
+	if (measuring) {
+		hist_add(&total, usec);
+		hist_add(&per_cmd[p->cmd], usec);
+		if (strstr(p->buf, "Unknown command") || strstr(p->buf, "internal error"))
+			errors++;
+	}
+
+	switch (p->cmd) {
+	case CMD_LOOK:
+		parse_look(p);
+		break;
+	case CMD_TRADE:
+		parse_trade(p);
+		break;
+	case CMD_GO:
+	case CMD_ORBIT:
+	case CMD_DOCK:
+	case CMD_LEAVE:
+		p->location = UNKNOWN;
+		break;
+	default:
+		break;
+	}
 }
 
-int close_connections(struct connect_head *list)
+static enum command pick_command(const struct player * const p)
 {
-	struct connect_info *info;
+	unsigned int sum = 0, r;
+	int c;
 
-	SLIST_FOREACH(info, list, list) {
-		printf("closing\n");
-		close(info->fd);
+	if (p->location == UNKNOWN)
+		return CMD_LOOK;
+
+	for (c = 0; c < CMD_NUM; c++) {
+		if (command_locations[c] & 1 << p->location)
+			sum += mix[c];
 	}
 
-	return 0;
+	r = random_below(sum);
+	for (c = 0; c < CMD_NUM; c++) {
+		if (!(command_locations[c] & 1 << p->location))
+			continue;
+		if (r < mix[c])
+			break;
+		r -= mix[c];
+	}
+
+	if (c == CMD_NUM)
+		return CMD_LOOK;
+
+	/* Find out what's around before trying to go there */
+	if (c == CMD_GO && !p->links.len)
+		return CMD_LOOK;
+	if ((c == CMD_ORBIT || c == CMD_DOCK) && !p->places.len)
+		return CMD_LOOK;
+	if (c == CMD_BUY && !p->items.len)
+		return CMD_TRADE;
+	if (c == CMD_SELL && !p->cargo[0])
+		return p->items.len ? CMD_BUY : CMD_TRADE;
+
+	return c;
 }
 
-int free_connections(struct connect_head *list)
+static int send_command(struct player * const p)
 {
-	struct connect_info *info;
+	char line[MAX_NAME_LEN + 32];
+	const struct names *targets;
+	ssize_t n;
+	int len;
 
-	while (!SLIST_EMPTY(list)) {
-		info = SLIST_FIRST(list);
-		SLIST_REMOVE_HEAD(list, list);
-		free(info);
+	p->cmd = pick_command(p);
+
+	switch (p->cmd) {
+	case CMD_GO:
+	case CMD_ORBIT:
+	case CMD_DOCK:
+		targets = p->cmd == CMD_GO ? &p->links : &p->places;
+		len = snprintf(line, sizeof(line), "%s %s\n", command_names[p->cmd],
+				targets->name[random_below(targets->len)]);
+		break;
+	case CMD_BUY:
+		strcpy(p->cargo, p->items.name[random_below(p->items.len)]);
+		len = snprintf(line, sizeof(line), "buy 1 %s\n", p->cargo);
+		break;
+	case CMD_SELL:
+		len = snprintf(line, sizeof(line), "sell 1 %s\n", p->cargo);
+		break;
+	default:
+		len = snprintf(line, sizeof(line), "%s\n", command_names[p->cmd]);
 	}
 
-	return 0;
+	/* The command is tiny, so a partial write means something is wrong */
+	p->sent = now_ns();
+	n = write(p->fd, line, len);
+
+	return n == len ? 0 : -1;
 }
 
-#define CONN_SLEEP 2
-int main(int argc, char *argv[])
+static int read_response(struct player * const p)
 {
+	ssize_t n;
+	char *ptr;
 
-	if (argc != 3) {
-		fprintf(stderr,
-				"syntax:  %s <address> <port>\n"
-				"purpose: establish %d simultaneous connections to address:port\n"
-				"         keeping them open for %d seconds, then closing them.\n"
-				"         This is useful for testing networked servers.\n",
-				argv[0], NUM_CONN, CONN_SLEEP);
-		exit(1);
+	for (;;) {
+		if (p->alloc - p->len < MIN_BUF / 2) {
+			if (p->alloc >= MAX_RESPONSE)
+				return -1;
+			ptr = realloc(p->buf, p->alloc ? p->alloc * 2 : MIN_BUF);
+			if (!ptr)
+				return -1;
+			p->buf = ptr;
+			p->alloc = p->alloc ? p->alloc * 2 : MIN_BUF;
+		}
+
+		n = read(p->fd, p->buf + p->len, p->alloc - p->len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+		p->len += n;
+
+		if (p->len >= PROMPT_LEN && !memcmp(p->buf + p->len - PROMPT_LEN, PROMPT, PROMPT_LEN))
+			return 1;
+	}
+}
+
+static void disconnect(struct player * const p, const int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+	close(p->fd);
+	p->fd = -1;
+	free(p->buf);
+	p->buf = NULL;
+	p->alloc = p->len = 0;
+}
+
+static void print_line(const char * const name, const struct histogram * const h, const double secs)
+{
+	printf("%-8s %10llu %10.1f %9llu %9llu %9llu %9llu %9llu\n", name,
+			(unsigned long long)h->count, h->count / secs,
+			(unsigned long long)(h->count ? h->sum / h->count : 0),
+			(unsigned long long)hist_percentile(h, 0.5),
+			(unsigned long long)hist_percentile(h, 0.99),
+			(unsigned long long)hist_percentile(h, 0.999),
+			(unsigned long long)h->max);
+}
+
+static void print_results(const double secs, const unsigned int conns)
+{
+	printf("%u connections, %.1f seconds measured, %lu errors, %lu disconnects\n",
+			conns, secs, errors, disconnects);
+	printf("%-8s %10s %10s %9s %9s %9s %9s %9s\n",
+			"command", "count", "per sec", "avg us", "p50 us", "p99 us", "p999 us", "max us");
+	for (int c = 0; c < CMD_NUM; c++) {
+		if (per_cmd[c].count)
+			print_line(command_names[c], &per_cmd[c], secs);
+	}
+	print_line("all", &total, secs);
+}
+
+static int parse_mix(char *arg)
+{
+	char *tok, *eq, *end;
+	long weight;
+	int c;
+
+	memset(mix, 0, sizeof(mix));
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		eq = strchr(tok, '=');
+		if (!eq)
+			return -1;
+		*eq = '\0';
+
+		for (c = 0; c < CMD_NUM; c++) {
+			if (!strcmp(tok, command_names[c]))
+				break;
+		}
+		if (c == CMD_NUM)
+			return -1;
+
+		errno = 0;
+		weight = strtol(eq + 1, &end, 10);
+		if (errno || *end != '\0' || weight < 0 || weight > 1000)
+			return -1;
+		mix[c] = weight;
 	}
 
+	return 0;
+}
+
+static void usage(const char * const name)
+{
+	fprintf(stderr,
+			"syntax:  %s [-c conns] [-d secs] [-w secs] [-m mix] <address> <port>\n"
+			"purpose: connect conns simulated players (default %d) to address:port,\n"
+			"         let them run commands for secs seconds (default %d) after a\n"
+			"         warmup of -w seconds (default %d) and report command latencies.\n"
+			"         mix is a list of command weights, e.g. look=1,trade=2,buy=1\n"
+			"         Commands: look map ports go orbit dock leave trade buy sell\n",
+			name, DEF_CONNS, DEF_DURATION, DEF_WARMUP);
+	exit(1);
+}
+
+static long parse_num(const char * const s, const long min, const long max)
+{
+	char *end;
 	long l;
-	char *p;
+
 	errno = 0;
-	l = strtol(argv[2], &p, 10);
-	if (errno != 0 || !p || *p != '\0' || l < 1 || l > UINT16_MAX) {
-		fprintf(stderr, "port %s is not numeric or not in range\n", argv[2]);
+	l = strtol(s, &end, 10);
+	if (errno != 0 || *end != '\0' || l < min || l > max)
+		return -1;
+
+	return l;
+}
+
+static void interrupt(int sig)
+{
+	interrupted = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct epoll_event events[256];
+	struct player *players, *p;
+	unsigned int conns = DEF_CONNS, started = 0, connecting = 0, ready = 0;
+	long duration = DEF_DURATION, warmup = DEF_WARMUP, l;
+	uint64_t start, measure_start = 0, end = 0;
+	int epfd, n, c, err;
+	socklen_t errlen;
+
+	while ((c = getopt(argc, argv, "c:d:m:w:")) > 0) {
+		switch (c) {
+		case 'c':
+			if ((l = parse_num(optarg, 1, 1000000)) < 0)
+				usage(argv[0]);
+			conns = l;
+			break;
+		case 'd':
+			if ((duration = parse_num(optarg, 1, 86400)) < 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (parse_mix(optarg))
+				usage(argv[0]);
+			break;
+		case 'w':
+			if ((warmup = parse_num(optarg, 0, 86400)) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if ((l = parse_num(argv[optind + 1], 1, UINT16_MAX)) < 0) {
+		fprintf(stderr, "port %s is not numeric or not in range\n", argv[optind + 1]);
+		exit(1);
+	}
+	addr.sin_port = htons(l);
+	if (inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+		fprintf(stderr, "%s is not an IPv4 address\n", argv[optind]);
 		exit(1);
 	}
 
-	struct connect_head conn_list = SLIST_HEAD_INITIALIZER(conn_list);
-	initialize_connections(&conn_list, argv[1], l);
+	players = calloc(conns, sizeof(*players));
+	assert(players);
+	epfd = epoll_create1(0);
+	assert(epfd >= 0);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, interrupt);
+	srand(time(NULL));
 
-	establish_connections(&conn_list);
+	start = now_ns();
+	while (!interrupted) {
+		while (started < conns && connecting < MAX_CONNECTING) {
+			if (start_connect(&players[started], epfd, &addr)) {
+				perror("connect");
+				exit(1);
+			}
+			started++;
+			connecting++;
+		}
 
-	sleep(CONN_SLEEP);
-	write_on_connections(&conn_list);
+		/* The clock starts once everybody is connected and has had time to warm up */
+		if (!measure_start && started == conns && ready + disconnects >= conns) {
+			measure_start = now_ns() + warmup * 1000000000ULL;
+			end = measure_start + duration * 1000000000ULL;
+			printf("%u players connected in %.1f seconds\n", conns, (now_ns() - start) / 1e9);
+		}
+		if (measure_start && !measuring && now_ns() >= measure_start)
+			measuring = 1;
+		if (end && now_ns() >= end)
+			break;
 
-	sleep(CONN_SLEEP);
-	write_on_connections(&conn_list);
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(*events), 100);
+		if (n < 0 && errno == EINTR)
+			continue;
+		assert(n >= 0);
 
-	close_connections(&conn_list);
-	free_connections(&conn_list);
+		for (int i = 0; i < n; i++) {
+			p = events[i].data.ptr;
+			if (p->fd < 0)
+				continue;
 
-	return 0;
+			if (!p->connected) {
+				errlen = sizeof(err);
+				if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+					fprintf(stderr, "connect: %s\n", strerror(err));
+					connecting--;
+					disconnects++;
+					disconnect(p, epfd);
+					continue;
+				}
+				p->connected = 1;
+				events[i].events = EPOLLIN;
+				if (epoll_ctl(epfd, EPOLL_CTL_MOD, p->fd, &events[i])) {
+					perror("epoll_ctl");
+					connecting--;
+					disconnects++;
+					disconnect(p, epfd);
+					continue;
+				}
+				p->cmd = CMD_LOOK;
+			}
+
+			switch (read_response(p)) {
+			case 0:
+				continue;
+			case 1:
+				/* The prompt right after connecting isn't an answer to anything */
+				if (p->sent) {
+					handle_response(p);
+				} else {
+					ready++;
+					connecting--;
+				}
+				p->len = 0;
+				if (!send_command(p))
+					continue;
+				/* Fall through */
+			default:
+				/* Dropped before its first prompt */
+				if (!p->sent)
+					connecting--;
+				disconnects++;
+				disconnect(p, epfd);
+			}
+		}
+	}
+
+	if (measuring)
+		print_results((now_ns() - measure_start) / 1e9, conns);
+	else
+		fprintf(stderr, "stopped before measuring started\n");
+
+	for (unsigned int i = 0; i < started; i++) {
+		if (players[i].fd >= 0)
+			disconnect(&players[i], epfd);
+	}
+	close(epfd);
+	free(players);
+
+	return measuring ? 0 : 1;
 }
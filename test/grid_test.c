@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grid.h"
+#include "ptrlist.h"
+
+#define NUM_TESTS 407
+
+#define NUM_POINTS 1000
+#define CELL_SIZE 100
+#define SPREAD 5000
+
+struct point {
+	long x, y;
+};
+
+static unsigned long long dist(const struct point * const p, const long x, const long y)
+{
+	const long long dx = p->x - x;
+	const long long dy = p->y - y;
+
+	return dx * dx + dy * dy;
+}
+
+static int is_even(void *data, void *arg)
+{
+	struct point *points = arg;
+
+	return ((struct point*)data - points) % 2 == 0;
+}
+
+static int test_empty_grid()
+{
+	int tests = 0;
+	struct grid g;
+	struct ptrlist l;
+
+	assert(!grid_init(&g, CELL_SIZE));
+	ptrlist_init(&l);
+
+	assert(grid_range(&g, 0, 0, 1000, &l) == 0);
+	assert(ptrlist_len(&l) == 0);
+	tests++;
+
+	assert(grid_nearest(&g, 0, 0, 5, NULL, NULL, &l) == 0);
+	assert(ptrlist_len(&l) == 0);
+	tests++;
+
+	assert(!grid_lookup(&g, 0, 0));
+	assert(grid_remove(&g, 0, 0, &g));
+	tests++;
+
+	grid_free(&g);
+
+	return tests;
+}
+
+static int test_insert_remove()
+{
+	int tests = 0;
+	struct grid g;
+	struct point a = { -1, -1 }, b = { 0, 0 };
+
+	assert(!grid_init(&g, CELL_SIZE));
+
+	assert(!grid_insert(&g, a.x, a.y, &a));
+	assert(!grid_insert(&g, b.x, b.y, &b));
+	assert(grid_lookup(&g, -1, -1) == &a);
+	assert(grid_lookup(&g, 0, 0) == &b);
+	tests++;
+
+	/* (-1, -1) and (0, 0) must not end up in the same cell */
+	assert(g.num_cells == 2);
+	tests++;
+
+	assert(grid_remove(&g, 0, 0, &a));
+	assert(!grid_remove(&g, 0, 0, &b));
+	assert(!grid_lookup(&g, 0, 0));
+	assert(grid_lookup(&g, -1, -1) == &a);
+	tests++;
+
+	grid_free(&g);
+
+	return tests;
+}
+
+static int test_range(struct grid *g, struct point *points, const long x, const long y,
+		const unsigned long radius)
+{
+	struct ptrlist l;
+	unsigned long expected = 0;
+	unsigned long lh;
+	struct point *p;
+
+	ptrlist_init(&l);
+
+	for (int i = 0; i < NUM_POINTS; i++) {
+		if (dist(&points[i], x, y) < (unsigned long long)radius * radius)
+			expected++;
+	}
+
+	assert(grid_range(g, x, y, radius, &l) == expected);
+	assert(ptrlist_len(&l) == expected);
+	assert(grid_range(g, x, y, radius, NULL) == expected);
+
+	ptrlist_for_each_entry(p, &l, lh)
+		assert(dist(p, x, y) < (unsigned long long)radius * radius);
+
+	ptrlist_free(&l);
+
+	return 1;
+}
+
+static int test_nearest(struct grid *g, struct point *points, const long x, const long y,
+		const unsigned long k, int (*filter)(void*, void*))
+{
+	struct ptrlist l;
+	unsigned long lh;
+	unsigned long long last = 0, d;
+	unsigned long closer;
+	struct point *p;
+
+	ptrlist_init(&l);
+
+	assert(grid_nearest(g, x, y, k, filter, points, &l) == k);
+	assert(ptrlist_len(&l) == k);
+
+	ptrlist_for_each_entry(p, &l, lh) {
+		if (filter)
+			assert(filter(p, points));
+
+		d = dist(p, x, y);
+		assert(d >= last);
+		last = d;
+	}
+
+	/* Nothing outside the result may be closer than the last one found */
+	closer = 0;
+	for (int i = 0; i < NUM_POINTS; i++) {
+		if ((!filter || filter(&points[i], points)) && dist(&points[i], x, y) < last)
+			closer++;
+	}
+	assert(closer < k);
+
+	ptrlist_free(&l);
+
+	return 1;
+}
+
+static int test_random_points()
+{
+	int tests = 0;
+	struct grid g;
+	struct point *points;
+	long x, y;
+
+	srand(1);
+
+	points = malloc(NUM_POINTS * sizeof(*points));
+	assert(points);
+	assert(!grid_init(&g, CELL_SIZE));
+
+	for (int i = 0; i < NUM_POINTS; i++) {
+		points[i].x = rand() % (2 * SPREAD) - SPREAD;
+		points[i].y = rand() % (2 * SPREAD) - SPREAD;
+		assert(!grid_insert(&g, points[i].x, points[i].y, &points[i]));
+	}
+	tests++;
+
+	for (int i = 0; i < 100; i++) {
+		x = rand() % (4 * SPREAD) - 2 * SPREAD;
+		y = rand() % (4 * SPREAD) - 2 * SPREAD;
+
+		tests += test_range(&g, points, x, y, rand() % SPREAD);
+		tests += test_range(&g, points, x, y, rand() % (4 * SPREAD));
+		tests += test_nearest(&g, points, x, y, 1 + rand() % 10, NULL);
+		tests += test_nearest(&g, points, x, y, 1 + rand() % 10, is_even);
+	}
+
+	grid_free(&g);
+	free(points);
+
+	return tests;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int tests = 0;
+
+	tests += test_empty_grid();
+	tests += test_insert_remove();
+	tests += test_random_points();
+
+	assert(tests == NUM_TESTS);
+}
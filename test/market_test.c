@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "item.h"
+#include "list.h"
+#include "market.h"
+#include "port.h"
+#include "ptrlist.h"
+#include "system.h"
+#include "universe.h"
+
+#define NUM_TESTS 2406
+
+#define NUM_PORTS 200
+#define NUM_ITEMS 3
+#define ITEMS_PER_PORT 2
+#define MAX_AMOUNT 1000
+#define NUM_ROUNDS 400
+#define CHANGES_PER_ROUND 20
+
+static struct item items[NUM_ITEMS];
+static struct port ports[NUM_PORTS];
+static struct system systems[NUM_PORTS];
+
+static void random_stock(struct port * const port, const unsigned int i)
+{
+	/* Few prices, so many entries have the same */
+	port->stock.price[i] = 100 + rand() % 20;
+	port->stock.amount[i] = rand() % 4 ? rand() % (MAX_AMOUNT + 1) : 0;
+}
+
+/*
+ * All ports are close enough to be in the same cell, so a search returns
+ * the entries of a single book in the order they are in.
+ */
+static void create_ports()
+{
+	struct port *port;
+
+	universe_init(&univ);
+
+	for (unsigned int i = 0; i < NUM_ITEMS; i++) {
+		items[i].name = "item";
+		items[i].idx = i;
+		list_add_tail(&items[i].list, &univ.items);
+	}
+
+	for (unsigned int p = 0; p < NUM_PORTS; p++) {
+		system_init(&systems[p]);
+		systems[p].x = TICK_PER_LY + rand() % TICK_PER_LY;
+		systems[p].y = TICK_PER_LY + rand() % TICK_PER_LY;
+
+		port = &ports[p];
+		port_init(port);
+		port->name = "port";
+		port->system = &systems[p];
+		assert(!port_stock_alloc(&port->stock, ITEMS_PER_PORT, 0));
+		for (unsigned int i = 0; i < ITEMS_PER_PORT; i++) {
+			port->stock.item[i] = &items[(p + i) % NUM_ITEMS];
+			port->stock.max[i] = MAX_AMOUNT;
+			random_stock(port, i);
+		}
+		assert(!ptrlist_push(&univ.ports, port));
+	}
+
+	assert(!market_build());
+}
+
+static unsigned int count_ports(const struct item * const item, const int selling)
+{
+	unsigned int n = 0;
+	const struct port_stock *stock;
+
+	for (unsigned int p = 0; p < NUM_PORTS; p++) {
+		stock = &ports[p].stock;
+		for (unsigned int i = 0; i < stock->len; i++) {
+			if (stock->item[i] == item &&
+					(selling ? stock->amount[i] > 0 : stock->amount[i] < stock->max[i]))
+				n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Every port with the item must be found in price order, and what it is
+ * found with must be what the port has, which it won't be if an entry
+ * moved without its port being told where.
+ */
+static int test_book(const struct item * const item, const int selling)
+{
+	struct market_quote quotes[NUM_PORTS];
+	const struct port_stock *stock;
+	unsigned int n;
+
+	n = selling ? market_sellers(item, &systems[0], TICK_PER_LY * 10, quotes, NUM_PORTS)
+		: market_buyers(item, &systems[0], TICK_PER_LY * 10, quotes, NUM_PORTS);
+	assert(n == count_ports(item, selling));
+
+	for (unsigned int q = 0; q < n; q++) {
+		stock = &quotes[q].port->stock;
+		assert(stock->item[quotes[q].item] == item);
+		assert(quotes[q].price == stock->price[quotes[q].item]);
+		assert(quotes[q].amount == stock->amount[quotes[q].item]);
+		assert(quotes[q].room == stock->max[quotes[q].item] - stock->amount[quotes[q].item]);
+		if (q > 0)
+			assert(selling ? quotes[q - 1].price <= quotes[q].price
+					: quotes[q - 1].price >= quotes[q].price);
+	}
+
+	return 1;
+}
+
+static int test_books()
+{
+	int tests = 0;
+
+	for (unsigned int i = 0; i < NUM_ITEMS; i++) {
+		tests += test_book(&items[i], 1);
+		tests += test_book(&items[i], 0);
+	}
+
+	return tests;
+}
+
+static int test_reprice()
+{
+	int tests = 0;
+	struct port *port;
+
+	for (int r = 0; r < NUM_ROUNDS; r++) {
+		for (int c = 0; c < CHANGES_PER_ROUND; c++) {
+			port = &ports[rand() % NUM_PORTS];
+			pthread_rwlock_wrlock(&port->items_lock);
+			random_stock(port, rand() % ITEMS_PER_PORT);
+			market_update_port(port);
+			pthread_rwlock_unlock(&port->items_lock);
+		}
+		tests += test_books();
+	}
+
+	return tests;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int tests = 0;
+
+	srand(1);
+	create_ports();
+
+	tests += test_books();
+	tests += test_reprice();
+
+	market_free();
+
+	assert(tests == NUM_TESTS);
+}
@@ -0,0 +1,542 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cli.h"
+#include "common.h"
+#include "item.h"
+#include "map.h"
+#include "market.h"
+#include "mtrandom.h"
+#include "port.h"
+#include "port_update.h"
+#include "price.h"
+#include "ptrlist.h"
+#include "stringtree.h"
+#include "system.h"
+#include "universe.h"
+
+/*
+ * Micro-benchmarks for the data structures the server spends its time in.
+ * Every benchmark is run a number of times for each universe size, and the
+ * fastest run is reported as nanoseconds per operation, one tab separated
+ * line per benchmark and size. Given the output of an earlier run with -b,
+ * benchmarks that got slower by more than the threshold are listed on
+ * stderr and the exit status is 1.
+ */
+
+#define DEF_SIZES "1000,10000,100000"
+#define DEF_RUNS 5
+#define DEF_THRESHOLD 20
+#define MAX_SIZES 16
+
+#define NAME_MIN_LEN 6
+#define NAME_MAX_LEN 14
+#define SYSTEM_SPACING (10 * TICK_PER_LY)
+#define NEIGHBOUR_RADIUS (50 * TICK_PER_LY)
+#define MAP_WIDTH 71
+#define MAX_QUERIES 2000
+#define MAX_MAPS 200
+#define MAX_COMMANDS 1000
+#define ITEMS_PER_PORT 12
+#define ITEMS_WITH_REQS 2
+#define MARKET_QUOTES 10
+
+struct fixture {
+	unsigned long size;
+	char **names;
+	unsigned long *indices;		/* Random indices below size */
+	struct system **systems;
+	struct port **ports;
+	struct item items[ITEMS_PER_PORT];
+	struct st_node cli;
+	unsigned long tick;
+	unsigned long sink;		/* Keeps results from being optimized away */
+};
+
+struct baseline {
+	char name[64];
+	unsigned long size;
+	double ns;
+};
+
+static struct baseline *baselines;
+static unsigned long num_baselines;
+static unsigned int threshold = DEF_THRESHOLD;
+static int regressions;
+
+static uint64_t now_ns()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static char* random_name()
+{
+	unsigned int len = NAME_MIN_LEN + mtrandom_uint(NAME_MAX_LEN - NAME_MIN_LEN + 1);
+	char *name = malloc(len + 1);
+
+	assert(name);
+	for (unsigned int i = 0; i < len; i++)
+		name[i] = 'a' + mtrandom_uint(26);
+	name[len] = '\0';
+
+	return name;
+}
+
+static int bench_cmd(void *data, char *param)
+{
+	(*(unsigned long*)data)++;
+	return 0;
+}
+
+static struct port* create_port(struct fixture * const f)
+{
+	struct port *port = malloc(sizeof(*port));
+	struct port_stock *stock;
+
+	assert(port);
+	port_init(port);
+	stock = &port->stock;
+	assert(!port_stock_alloc(stock, ITEMS_PER_PORT, ITEMS_WITH_REQS));
+
+	stock->num_plain = ITEMS_PER_PORT - ITEMS_WITH_REQS;
+	for (unsigned int i = 0; i < ITEMS_PER_PORT; i++) {
+		stock->item[i] = &f->items[i];
+		stock->max[i] = 10000 + mtrandom_uint(10000);
+		stock->amount[i] = mtrandom_uint(stock->max[i]);
+		stock->daily_change[i] = (long)mtrandom_uint(2000) - 1000;
+		stock->req_start[i] = i <= stock->num_plain ? 0 : i - stock->num_plain;
+	}
+	stock->req_start[ITEMS_PER_PORT] = ITEMS_WITH_REQS;
+	for (unsigned int i = 0; i < ITEMS_WITH_REQS; i++)
+		stock->req[i] = i;
+
+	price_init(stock);
+	price_update(stock);
+
+	return port;
+}
+
+static void create_fixture(struct fixture * const f, const unsigned long size)
+{
+	const long side = (long)(sqrt(size) + 1) * SYSTEM_SPACING;
+	struct system *s;
+
+	memset(f, 0, sizeof(*f));
+	f->size = size;
+
+	f->names = malloc(size * sizeof(*f->names));
+	f->indices = malloc(size * sizeof(*f->indices));
+	f->systems = malloc(size * sizeof(*f->systems));
+	f->ports = malloc(size * sizeof(*f->ports));
+	assert(f->names && f->indices && f->systems && f->ports);
+
+	for (unsigned int i = 0; i < ITEMS_PER_PORT; i++) {
+		f->items[i].name = "item";
+		f->items[i].idx = i;
+		f->items[i].base_price = 1 + mtrandom_uint(100);
+	}
+
+	universe_init(&univ);
+
+	for (unsigned long i = 0; i < size; i++) {
+		f->names[i] = random_name();
+		f->indices[i] = mtrandom_ulong(size);
+
+		s = malloc(sizeof(*s));
+		assert(s);
+		system_init(s);
+		s->name = strdup(f->names[i]);
+		do {
+			s->x = mtrandom_long(side);
+			s->y = mtrandom_long(side);
+		} while (system_move(s, s->x, s->y));
+		assert(!ptrlist_push(&univ.systems, s));
+		f->systems[i] = s;
+
+		f->ports[i] = create_port(f);
+		f->ports[i]->system = s;
+	}
+
+	st_init(&f->cli);
+	for (unsigned long i = 0; i < MIN(size, MAX_COMMANDS); i++)
+		cli_add_cmd(&f->cli, f->names[i], bench_cmd, &f->sink, "benchmark");
+}
+
+static void free_fixture(struct fixture * const f)
+{
+	cli_tree_destroy(&f->cli);
+
+	for (unsigned long i = 0; i < f->size; i++) {
+		free(f->names[i]);
+		system_free(f->systems[i]);
+		port_free(f->ports[i]);
+	}
+
+	universe_free(&univ);
+	free(f->ports);
+	free(f->systems);
+	free(f->indices);
+	free(f->names);
+}
+
+/*
+ * Each benchmark does a number of operations and returns how many. Work
+ * that isn't part of what is measured is done before the clock starts, in
+ * the setup function.
+ */
+struct benchmark {
+	const char *name;
+	void (*setup)(struct fixture *f, void **state);
+	unsigned long (*run)(struct fixture *f, void *state);
+	void (*teardown)(struct fixture *f, void *state);
+};
+
+static unsigned long st_add(struct fixture *f, void *state)
+{
+	struct st_node *root = state;
+
+	for (unsigned long i = 0; i < f->size; i++)
+		st_add_string(root, f->names[i], f->names[i]);
+
+	return f->size;
+}
+
+static void st_setup(struct fixture *f, void **state)
+{
+	struct st_node *root = malloc(sizeof(*root));
+
+	assert(root);
+	st_init(root);
+	*state = root;
+}
+
+static void st_filled_setup(struct fixture *f, void **state)
+{
+	st_setup(f, state);
+	st_add(f, *state);
+}
+
+static void st_teardown(struct fixture *f, void *state)
+{
+	st_destroy(state, ST_DONT_FREE_DATA);
+	free(state);
+}
+
+static unsigned long st_lookup(struct fixture *f, void *state)
+{
+	for (unsigned long i = 0; i < f->size; i++)
+		f->sink += (uintptr_t)st_lookup_string(state, f->names[f->indices[i]]);
+
+	return f->size;
+}
+
+static void ptrlist_setup(struct fixture *f, void **state)
+{
+	struct ptrlist *l = malloc(sizeof(*l));
+
+	assert(l);
+	ptrlist_init(l);
+	*state = l;
+}
+
+static void ptrlist_teardown(struct fixture *f, void *state)
+{
+	ptrlist_free(state);
+	free(state);
+}
+
+static unsigned long ptrlist_push_all(struct fixture *f, void *state)
+{
+	for (unsigned long i = 0; i < f->size; i++)
+		ptrlist_push(state, &f->indices[i]);
+
+	return f->size;
+}
+
+static void ptrlist_filled_setup(struct fixture *f, void **state)
+{
+	ptrlist_setup(f, state);
+	ptrlist_push_all(f, *state);
+}
+
+static int cmp_indices(const void *a, const void *b, void *data)
+{
+	const unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long ptrlist_sort_all(struct fixture *f, void *state)
+{
+	ptrlist_sort(state, NULL, cmp_indices);
+
+	return f->size;
+}
+
+static unsigned long ptrlist_entry_random(struct fixture *f, void *state)
+{
+	for (unsigned long i = 0; i < f->size; i++)
+		f->sink += *(unsigned long*)ptrlist_entry(state, f->indices[i]);
+
+	return f->size;
+}
+
+static unsigned long neighbours(struct fixture *f, void *state)
+{
+	const unsigned long n = MIN(f->size, MAX_QUERIES);
+	struct ptrlist l;
+
+	for (unsigned long i = 0; i < n; i++) {
+		ptrlist_init(&l);
+		f->sink += get_neighbouring_systems(&l, f->systems[f->indices[i]], NEIGHBOUR_RADIUS);
+		ptrlist_free(&l);
+	}
+
+	return n;
+}
+
+static unsigned long map(struct fixture *f, void *state)
+{
+	const unsigned long n = MIN(f->size, MAX_MAPS);
+	char buf[80 * 50];
+
+	for (unsigned long i = 0; i < n; i++) {
+		generate_map(buf, sizeof(buf), f->systems[f->indices[i]], NEIGHBOUR_RADIUS, MAP_WIDTH);
+		f->sink += buf[0];
+	}
+
+	return n;
+}
+
+static unsigned long update_ports(struct fixture *f, void *state)
+{
+	f->tick++;
+	for (unsigned long i = 0; i < f->size; i++)
+		port_update(f->ports[i], f->tick);
+
+	return f->size;
+}
+
+/*
+ * The items and ports of the fixture are only in the universe while the
+ * market is, as universe_free() would free the items.
+ */
+static void market_setup(struct fixture *f, void **state)
+{
+	for (unsigned int i = 0; i < ITEMS_PER_PORT; i++)
+		list_add(&f->items[i].list, &univ.items);
+	for (unsigned long i = 0; i < f->size; i++)
+		assert(!ptrlist_push(&univ.ports, f->ports[i]));
+
+	assert(!market_build());
+}
+
+static void market_teardown(struct fixture *f, void *state)
+{
+	market_free();
+
+	ptrlist_free(&univ.ports);
+	ptrlist_init(&univ.ports);
+	for (unsigned int i = 0; i < ITEMS_PER_PORT; i++)
+		list_del(&f->items[i].list);
+}
+
+static unsigned long market_queries(struct fixture *f, void *state)
+{
+	const unsigned long n = MIN(f->size, MAX_QUERIES);
+	struct market_quote quotes[MARKET_QUOTES];
+
+	for (unsigned long i = 0; i < n; i++)
+		f->sink += market_sellers(&f->items[i % ITEMS_PER_PORT], f->systems[f->indices[i]],
+				NEIGHBOUR_RADIUS, quotes, MARKET_QUOTES);
+
+	return n;
+}
+
+static unsigned long run_cmds(struct fixture *f, void *state)
+{
+	const unsigned long n = MIN(f->size, MAX_COMMANDS);
+
+	for (unsigned long i = 0; i < f->size; i++)
+		cli_run_cmd(&f->cli, f->names[f->indices[i] % n]);
+
+	return f->size;
+}
+
+static const struct benchmark benchmarks[] = {
+	{ "st_add_string", st_setup, st_add, st_teardown },
+	{ "st_lookup_string", st_filled_setup, st_lookup, st_teardown },
+	{ "ptrlist_push", ptrlist_setup, ptrlist_push_all, ptrlist_teardown },
+	{ "ptrlist_sort", ptrlist_filled_setup, ptrlist_sort_all, ptrlist_teardown },
+	{ "ptrlist_entry", ptrlist_filled_setup, ptrlist_entry_random, ptrlist_teardown },
+	{ "get_neighbouring_systems", NULL, neighbours, NULL },
+	{ "generate_map", NULL, map, NULL },
+	{ "port_update", NULL, update_ports, NULL },
+	{ "market_sellers", market_setup, market_queries, market_teardown },
+	{ "cli_run_cmd", NULL, run_cmds, NULL },
+};
+
+static const struct baseline* find_baseline(const char * const name, const unsigned long size)
+{
+	for (unsigned long i = 0; i < num_baselines; i++) {
+		if (baselines[i].size == size && !strcmp(baselines[i].name, name))
+			return &baselines[i];
+	}
+
+	return NULL;
+}
+
+static void run_benchmark(struct fixture *f, const struct benchmark * const b, const unsigned int runs)
+{
+	const struct baseline *base;
+	double best = 0, ns;
+	unsigned long ops = 0;
+	uint64_t start;
+	void *state = NULL;
+
+	for (unsigned int r = 0; r < runs; r++) {
+		if (b->setup)
+			b->setup(f, &state);
+
+		start = now_ns();
+		ops = b->run(f, state);
+		ns = (double)(now_ns() - start) / ops;
+
+		if (b->teardown)
+			b->teardown(f, state);
+
+		if (!r || ns < best)
+			best = ns;
+	}
+
+	printf("%s\t%lu\t%lu\t%.1f\n", b->name, f->size, ops, best);
+	fflush(stdout);
+
+	base = find_baseline(b->name, f->size);
+	if (base && best > base->ns * (100 + threshold) / 100) {
+		fprintf(stderr, "%s with %lu systems: %.1f ns, was %.1f ns (+%.0f%%)\n",
+				b->name, f->size, best, base->ns, (best / base->ns - 1) * 100);
+		regressions++;
+	}
+}
+
+static int load_baseline(const char * const file)
+{
+	struct baseline b, *ptr;
+	unsigned long ops;
+	char line[256];
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%63s %lu %lu %lf", b.name, &b.size, &ops, &b.ns) != 4)
+			continue;
+
+		ptr = realloc(baselines, (num_baselines + 1) * sizeof(*baselines));
+		if (!ptr) {
+			fclose(fp);
+			return -1;
+		}
+		baselines = ptr;
+		baselines[num_baselines++] = b;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int parse_sizes(char *arg, unsigned long *sizes)
+{
+	unsigned int n = 0;
+	char *tok, *end;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (n == MAX_SIZES)
+			return -1;
+		errno = 0;
+		sizes[n] = strtoul(tok, &end, 10);
+		if (errno || *end != '\0' || !sizes[n])
+			return -1;
+		n++;
+	}
+
+	return n;
+}
+
+static void usage(const char * const name)
+{
+	fprintf(stderr,
+			"syntax:  %s [-b baseline] [-r runs] [-s sizes] [-t percent]\n"
+			"purpose: run micro-benchmarks on universes of the given sizes\n"
+			"         (default %s systems), printing the fastest of runs\n"
+			"         (default %d) in nanoseconds per operation. Benchmarks more\n"
+			"         than percent (default %d) slower than in the output of an\n"
+			"         earlier run given as baseline are reported as regressions.\n",
+			name, DEF_SIZES, DEF_RUNS, DEF_THRESHOLD);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	char default_sizes[] = DEF_SIZES;
+	unsigned long sizes[MAX_SIZES];
+	unsigned int runs = DEF_RUNS;
+	struct fixture f;
+	int num_sizes = -1, c;
+
+	while ((c = getopt(argc, argv, "b:r:s:t:")) > 0) {
+		switch (c) {
+		case 'b':
+			if (load_baseline(optarg)) {
+				fprintf(stderr, "could not read baseline %s\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			if (runs < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			num_sizes = parse_sizes(optarg, sizes);
+			if (num_sizes < 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			threshold = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (num_sizes < 0)
+		num_sizes = parse_sizes(default_sizes, sizes);
+
+	/* The same universes every time, so runs can be compared */
+	mtrandom_init_seed(1);
+
+	printf("# benchmark\tsize\tops\tns_per_op\n");
+	for (int s = 0; s < num_sizes; s++) {
+		create_fixture(&f, sizes[s]);
+		for (unsigned int b = 0; b < ARRAY_SIZE(benchmarks); b++)
+			run_benchmark(&f, &benchmarks[b], runs);
+		free_fixture(&f);
+	}
+
+	free(baselines);
+
+	return regressions ? 1 : 0;
+}
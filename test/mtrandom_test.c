@@ -0,0 +1,157 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "mtrandom.h"
+
+#define NUM_TESTS 11
+
+#define SEED 4711
+#define NUM_NUMBERS 64
+#define NUM_STREAMS 16
+
+static void draw(uint64_t *numbers)
+{
+	for (int i = 0; i < NUM_NUMBERS; i++)
+		numbers[i] = mtrandom_uint64(UINT64_MAX);
+}
+
+static void draw_stream(const uint64_t seed, const uint64_t stream, uint64_t *numbers)
+{
+	mtrandom_init_seed(seed);
+	mtrandom_use_stream(stream);
+	draw(numbers);
+}
+
+static void* draw_auto_stream(void *numbers)
+{
+	draw(numbers);
+	return NULL;
+}
+
+static int test_explicit_streams()
+{
+	int tests = 0;
+	uint64_t a[NUM_NUMBERS], b[NUM_NUMBERS];
+
+	draw_stream(SEED, 7, a);
+	draw_stream(SEED, 7, b);
+	assert(!memcmp(a, b, sizeof(a)));
+	tests++;
+
+	draw_stream(SEED, 8, b);
+	assert(memcmp(a, b, sizeof(a)));
+	tests++;
+
+	draw_stream(SEED + 1, 7, b);
+	assert(memcmp(a, b, sizeof(a)));
+	tests++;
+
+	/* A stream starts over every time it is picked */
+	mtrandom_init_seed(SEED);
+	mtrandom_use_stream(7);
+	draw(b);
+	mtrandom_use_stream(7);
+	draw(b);
+	assert(!memcmp(a, b, sizeof(a)));
+	tests++;
+
+	return tests;
+}
+
+static int test_auto_streams()
+{
+	int tests = 0;
+	uint64_t a[NUM_NUMBERS], b[NUM_NUMBERS], explicit[NUM_NUMBERS];
+	pthread_t thread;
+
+	mtrandom_init_seed(SEED);
+
+	/* Threads that never pick a stream get one of their own */
+	assert(!pthread_create(&thread, NULL, draw_auto_stream, a));
+	assert(!pthread_join(thread, NULL));
+	assert(!pthread_create(&thread, NULL, draw_auto_stream, b));
+	assert(!pthread_join(thread, NULL));
+	assert(memcmp(a, b, sizeof(a)));
+	tests++;
+
+	for (uint64_t stream = 0; stream < NUM_STREAMS; stream++) {
+		draw_stream(SEED, stream, explicit);
+		assert(memcmp(a, explicit, sizeof(a)));
+		assert(memcmp(b, explicit, sizeof(b)));
+	}
+	tests++;
+
+	return tests;
+}
+
+static int test_save_restore()
+{
+	int tests = 0;
+	uint64_t a[NUM_NUMBERS], b[NUM_NUMBERS];
+	struct mtrandom saved;
+
+	mtrandom_init_seed(SEED);
+	draw(a);
+	mtrandom_save(&saved);
+	draw(a);
+
+	mtrandom_init_seed(SEED);
+	draw(b);
+	mtrandom_use_stream(9);
+	mtrandom_restore(&saved);
+	draw(b);
+	assert(!memcmp(a, b, sizeof(a)));
+	tests++;
+
+	return tests;
+}
+
+static int test_ranges()
+{
+	int tests = 0;
+	double d;
+	int i;
+	long l;
+
+	mtrandom_init_seed(SEED);
+
+	for (int n = 0; n < 1000; n++)
+		assert(mtrandom_uint(10) < 10);
+	assert(mtrandom_uint(0) == 0);
+	tests++;
+
+	for (int n = 0; n < 1000; n++) {
+		i = mtrandom_int(10);
+		assert(i >= 0 && i < 10);
+	}
+	tests++;
+
+	for (int n = 0; n < 1000; n++) {
+		l = mtrandom_long(-1000000);
+		assert(l > -1000000 && l <= 0);
+		l = mtrandom_long(1000000);
+		assert(l >= 0 && l < 1000000);
+	}
+	tests++;
+
+	for (int n = 0; n < 1000; n++) {
+		d = mtrandom_double(2.5);
+		assert(d >= 0 && d < 2.5);
+	}
+	tests++;
+
+	return tests;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int tests = 0;
+
+	tests += test_explicit_streams();
+	tests += test_auto_streams();
+	tests += test_save_restore();
+	tests += test_ranges();
+
+	assert(tests == NUM_TESTS);
+}
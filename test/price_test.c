@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include "common.h"
+#include "item.h"
+#include "port.h"
+#include "price.h"
+
+#define NUM_TESTS 900
+
+#define NUM_ITEMS 100
+#define MAX_AMOUNT 100000
+#define MAX_BASE_PRICE 10000
+#define NUM_TRADES 200
+
+static struct item items[NUM_ITEMS];
+static struct item *item_ptrs[NUM_ITEMS];
+static long amount[NUM_ITEMS], max[NUM_ITEMS], price[NUM_ITEMS];
+static long base_price[NUM_ITEMS], inverse_max[NUM_ITEMS], demand[NUM_ITEMS];
+
+static struct port_stock stock = {
+	.len = NUM_ITEMS,
+	.num_plain = NUM_ITEMS,
+	.item = item_ptrs,
+	.amount = amount,
+	.max = max,
+	.price = price,
+	.base_price = base_price,
+	.inverse_max = inverse_max,
+	.demand = demand
+};
+
+/*
+ * Some items are empty, some are full, and the regions around them are as
+ * full as some other amount out of the same max.
+ */
+static void create_stock()
+{
+	for (unsigned int i = 0; i < NUM_ITEMS; i++) {
+		items[i].base_price = 1 + rand() % MAX_BASE_PRICE;
+		item_ptrs[i] = &items[i];
+		max[i] = 1 + rand() % MAX_AMOUNT;
+		switch (i % 4) {
+		case 0:
+			amount[i] = 0;
+			break;
+		case 1:
+			amount[i] = max[i];
+			break;
+		default:
+			amount[i] = rand() % (max[i] + 1);
+		}
+	}
+
+	price_init(&stock);
+
+	for (unsigned int i = 0; i < NUM_ITEMS; i++)
+		demand[i] = price_fill(rand() % (max[i] + 1), inverse_max[i]);
+
+	price_update(&stock);
+}
+
+static int test_prices()
+{
+	int tests = 0;
+
+	/* Between half and twice the base price, cheaper the more there is */
+	for (unsigned int i = 0; i < NUM_ITEMS; i++) {
+		assert(price[i] >= base_price[i] / 2 - 1 && price[i] <= base_price[i] * 2);
+		if (amount[i] < max[i])
+			assert(price_buy(&stock, i, 1) >= price_sell(&stock, i, 1));
+		tests++;
+	}
+
+	return tests;
+}
+
+/*
+ * Buying units and selling them straight back, or the other way around,
+ * must give back exactly what was paid.
+ */
+static int test_round_trip(const unsigned int i)
+{
+	int tests = 0;
+	long n, paid, got;
+
+	if (amount[i]) {
+		n = 1 + rand() % amount[i];
+		paid = price_buy(&stock, i, n);
+		amount[i] -= n;
+		got = price_sell(&stock, i, n);
+		amount[i] += n;
+		assert(paid == got);
+	}
+	tests++;
+
+	if (amount[i] < max[i]) {
+		n = 1 + rand() % (max[i] - amount[i]);
+		got = price_sell(&stock, i, n);
+		amount[i] += n;
+		paid = price_buy(&stock, i, n);
+		amount[i] -= n;
+		assert(paid == got);
+	}
+	tests++;
+
+	return tests;
+}
+
+static int test_affordable(const unsigned int i)
+{
+	int tests = 0;
+	const long wanted = rand() % (2 * MAX_AMOUNT);
+	const long limit = MIN(wanted, amount[i]);
+	long credits, n;
+
+	credits = rand() % (MAX(price_buy(&stock, i, limit), 1) * 2);
+	n = price_affordable(&stock, i, wanted, credits);
+	assert(n >= 0 && n <= limit);
+	assert(price_buy(&stock, i, n) <= credits);
+	assert(n == limit || price_buy(&stock, i, n + 1) > credits);
+	tests++;
+
+	assert(price_affordable(&stock, i, wanted, 0) == 0);
+	assert(price_affordable(&stock, i, wanted, LONG_MAX / 4) == limit);
+	assert(price_affordable(&stock, i, 0, LONG_MAX / 4) == 0);
+	tests++;
+
+	return tests;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int tests = 0;
+
+	srand(1);
+	create_stock();
+
+	tests += test_prices();
+
+	for (int t = 0; t < NUM_TRADES; t++) {
+		const unsigned int i = rand() % NUM_ITEMS;
+
+		tests += test_round_trip(i);
+		tests += test_affordable(i);
+	}
+
+	assert(tests == NUM_TESTS);
+}
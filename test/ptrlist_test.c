@@ -4,7 +4,7 @@
 #include "ptrlist.h"
 #include "list.h"
 
-#define NUM_TESTS 84
+#define NUM_TESTS 127
 
 int cmp(const void *q, const void *p, void *data)
 {
@@ -13,7 +13,7 @@ int cmp(const void *q, const void *p, void *data)
 
 static void assert_sorted(struct ptrlist * const l)
 {
-	struct list_head *lh;
+	unsigned long lh;
 	int *p;
 	int last = -1;
 
@@ -69,6 +69,45 @@ static int test_push_pull_get()
 	return tests;
 }
 
+static int test_rm_and_reuse()
+{
+	int tests = 0;
+	struct ptrlist l;
+	int array[100];
+
+	ptrlist_init(&l);
+
+	for (int i = 0; i < 100; i++) {
+		array[i] = i;
+		assert(!ptrlist_push(&l, &array[i]));
+	}
+	assert(ptrlist_len(&l) == 100);
+	assert(*(int*)ptrlist_entry(&l, 99) == 99);
+	tests++;
+
+	ptrlist_rm(&l, 50);
+	assert(ptrlist_len(&l) == 99);
+	assert(*(int*)ptrlist_entry(&l, 49) == 49);
+	assert(*(int*)ptrlist_entry(&l, 50) == 51);
+	tests++;
+
+	/* Pulling and pushing over and over must reuse the space pulled */
+	for (int i = 0; i < 1000; i++) {
+		int *p = ptrlist_pull(&l);
+		assert(!ptrlist_push(&l, p));
+	}
+	assert(ptrlist_len(&l) == 99);
+	assert(l.alloc <= 256);
+	tests++;
+
+	ptrlist_free(&l);
+	assert(!ptrlist_len(&l));
+	assert(!ptrlist_pull(&l));
+	tests++;
+
+	return tests;
+}
+
 static int ascending(const size_t len, const int index)
 {
 	return index;
@@ -114,15 +153,49 @@ static int test_sorting_list(int (*generate_number)(const size_t, const int))
 	return tests;
 }
 
+static unsigned long key(const void *p, void *data)
+{
+	return *(int*)p;
+}
+
+static int test_sorting_list_by_key(int (*generate_number)(const size_t, const int))
+{
+	int array[LEN];
+	struct ptrlist l;
+	int tests = 0;
+
+	for (size_t len = 1; len <= LEN; len++) {
+
+		ptrlist_init(&l);
+		for (size_t i = 0; i < len; i++)
+			ptrlist_push(&l, &array[i]);
+
+		for (size_t i = 0; i < len; i++)
+			array[i] = generate_number(len, i);
+
+		assert(!ptrlist_sort_by_key(&l, NULL, key));
+		assert_sorted(&l);
+		tests++;
+
+		ptrlist_free(&l);
+	}
+
+	return tests;
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned int tests = 0;
 
 	tests += test_empty_lists();
 	tests += test_push_pull_get();
+	tests += test_rm_and_reuse();
 	tests += test_sorting_list(ascending);
 	tests += test_sorting_list(descending);
 	tests += test_sorting_list(alternating);
+	tests += test_sorting_list_by_key(ascending);
+	tests += test_sorting_list_by_key(descending);
+	tests += test_sorting_list_by_key(alternating);
 
 	assert(tests == NUM_TESTS);
 }
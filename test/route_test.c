@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "landmark.h"
+#include "mtrandom.h"
+#include "ptrlist.h"
+#include "route.h"
+#include "system.h"
+#include "universe.h"
+
+#define NUM_TESTS 1002
+
+#define NUM_SYSTEMS 300
+#define NUM_LINKS 450
+#define SPREAD 1000000
+#define NUM_ROUTES 250
+
+static struct system systems[NUM_SYSTEMS];
+
+static void link_systems(struct system *a, struct system *b)
+{
+	assert(!ptrlist_push(&a->links, b));
+	assert(!ptrlist_push(&b->links, a));
+}
+
+/*
+ * Sparse enough that some systems can't be reached from others, and with
+ * links between systems far from each other so the straight way isn't
+ * always the shortest.
+ */
+static void create_systems()
+{
+	struct system *a, *b;
+
+	universe_init(&univ);
+
+	for (unsigned long i = 0; i < NUM_SYSTEMS; i++) {
+		system_init(&systems[i]);
+		systems[i].idx = i;
+		systems[i].x = mtrandom_long(SPREAD);
+		systems[i].y = mtrandom_long(SPREAD);
+		assert(!ptrlist_push(&univ.systems, &systems[i]));
+	}
+
+	for (unsigned long i = 0; i < NUM_LINKS; i++) {
+		a = &systems[mtrandom_ulong(NUM_SYSTEMS)];
+		b = &systems[mtrandom_ulong(NUM_SYSTEMS)];
+		if (a != b)
+			link_systems(a, b);
+	}
+
+	assert(!landmarks_build(&univ.landmarks, LANDMARKS_NUM));
+}
+
+/*
+ * Plain Dijkstra without a heap or any estimate, to check the searches
+ * against. Unreachable systems get ULONG_MAX.
+ */
+static void dijkstra(const struct system * const from, const enum route_metric metric,
+		unsigned long *cost)
+{
+	int done[NUM_SYSTEMS];
+	struct system *link;
+	unsigned long best, c, lh;
+	long idx;
+
+	memset(done, 0, sizeof(done));
+	for (unsigned long i = 0; i < NUM_SYSTEMS; i++)
+		cost[i] = ULONG_MAX;
+	cost[from->idx] = 0;
+
+	for (;;) {
+		idx = -1;
+		best = ULONG_MAX;
+		for (unsigned long i = 0; i < NUM_SYSTEMS; i++) {
+			if (!done[i] && cost[i] < best) {
+				best = cost[i];
+				idx = i;
+			}
+		}
+		if (idx < 0)
+			break;
+
+		done[idx] = 1;
+		ptrlist_for_each_entry(link, &systems[idx].links, lh) {
+			c = cost[idx] + (metric == ROUTE_JUMPS ? 1 : system_distance(&systems[idx], link));
+			if (c < cost[link->idx])
+				cost[link->idx] = c;
+		}
+	}
+}
+
+static int is_linked(const struct system * const a, const struct system * const b)
+{
+	struct system *link;
+	unsigned long lh;
+
+	ptrlist_for_each_entry(link, &a->links, lh) {
+		if (link == b)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int test_route(const struct system * const from, const struct system * const to,
+		const enum route_metric metric, const unsigned long * const expected)
+{
+	struct ptrlist route;
+	const struct system *prev = from;
+	struct system *s;
+	unsigned long cost = 0, sum = 0, lh;
+	int r;
+
+	ptrlist_init(&route);
+	r = route_find(&route, from, to, metric, &cost);
+
+	if (expected[to->idx] == ULONG_MAX) {
+		assert(r == 1);
+		assert(ptrlist_len(&route) == 0);
+	} else {
+		assert(r == 0);
+		assert(cost == expected[to->idx]);
+
+		/* The route must be made of links and be as long as it says */
+		ptrlist_for_each_entry(s, &route, lh) {
+			assert(is_linked(prev, s));
+			sum += metric == ROUTE_JUMPS ? 1 : system_distance(prev, s);
+			prev = s;
+		}
+		assert(prev == to);
+		assert(sum == cost);
+	}
+
+	ptrlist_free(&route);
+
+	return 1;
+}
+
+static int test_metric(const enum route_metric metric)
+{
+	int tests = 0;
+	unsigned long expected[NUM_SYSTEMS], cost[NUM_SYSTEMS];
+	const struct system *from;
+
+	for (int i = 0; i < NUM_ROUTES; i++) {
+		from = &systems[mtrandom_ulong(NUM_SYSTEMS)];
+		dijkstra(from, metric, expected);
+
+		tests += test_route(from, &systems[mtrandom_ulong(NUM_SYSTEMS)], metric, expected);
+
+		assert(!route_costs(from, metric, cost));
+		assert(!memcmp(cost, expected, sizeof(cost)));
+		tests++;
+	}
+
+	return tests;
+}
+
+static int test_same_system()
+{
+	int tests = 0;
+	struct ptrlist route;
+	unsigned long cost = 1;
+
+	ptrlist_init(&route);
+	assert(!route_find(&route, &systems[0], &systems[0], ROUTE_DISTANCE, &cost));
+	assert(cost == 0);
+	assert(ptrlist_len(&route) == 0);
+	ptrlist_free(&route);
+	tests++;
+
+	assert(!route_find(&route, &systems[0], &systems[0], ROUTE_JUMPS, &cost));
+	assert(cost == 0);
+	assert(ptrlist_len(&route) == 0);
+	ptrlist_free(&route);
+	tests++;
+
+	return tests;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int tests = 0;
+
+	mtrandom_init_seed(1);
+	create_systems();
+
+	tests += test_metric(ROUTE_DISTANCE);
+	tests += test_metric(ROUTE_JUMPS);
+	tests += test_same_system();
+
+	for (unsigned long i = 0; i < NUM_SYSTEMS; i++)
+		ptrlist_free(&systems[i].links);
+	landmarks_free(&univ.landmarks);
+
+	assert(tests == NUM_TESTS);
+}
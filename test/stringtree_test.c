@@ -9,7 +9,7 @@ struct test_pair {
 	void* dest;
 };
 
-int do_tests_on_empty_head(struct list_head *root)
+int do_tests_on_empty_head(struct st_node *root)
 {
 	unsigned int tests = 0;
 
@@ -32,7 +32,7 @@ int do_tests_on_empty_head(struct list_head *root)
 	return tests;
 }
 
-int do_add_and_remove_tests(struct list_head *root)
+int do_add_and_remove_tests(struct st_node *root)
 {
 	unsigned int tests = 0;
 	int foo, bar, quz, aaabbb, aaaccc;
@@ -76,7 +76,7 @@ int do_add_and_remove_tests(struct list_head *root)
 }
 
 #define UNIQUENESS_PAIRS 6
-int do_uniqueness_tests(struct list_head *root)
+int do_uniqueness_tests(struct st_node *root)
 {
 	unsigned int tests = 0;
 	int i, j;
@@ -118,7 +118,7 @@ int do_uniqueness_tests(struct list_head *root)
 	return tests;
 }
 
-int do_shortest_match_tests(struct list_head *root)
+int do_shortest_match_tests(struct st_node *root)
 {
 	unsigned int tests = 0;
 
@@ -224,7 +224,7 @@ int do_shortest_match_tests(struct list_head *root)
 	return tests;
 }
 
-int do_case_insensitive_tests(struct list_head *root)
+int do_case_insensitive_tests(struct st_node *root)
 {
 	unsigned int tests = 0;
 
@@ -248,14 +248,14 @@ int do_case_insensitive_tests(struct list_head *root)
 	return tests;
 }
 
-int do_destroy_tests(struct list_head *root)
+int do_destroy_tests(struct st_node *root)
 {
 	unsigned int tests = 0;
 
 	st_destroy(root, ST_DONT_FREE_DATA);
 	tests++;
 
-	assert(list_empty(root));
+	assert(!root->len && !root->children);
 	tests++;
 
 	assert(st_lookup_string(root, "foo") == NULL);
@@ -267,7 +267,7 @@ int do_destroy_tests(struct list_head *root)
 int main(int argc, char *argv[])
 {
 	unsigned int tests = 0;
-	LIST_HEAD(head);
+	struct st_node head = ST_ROOT_INIT;
 
 	tests += do_tests_on_empty_head(&head);
 	tests += do_add_and_remove_tests(&head);
@@ -7,10 +7,12 @@
 #include <pthread.h>
 #include "common.h"
 #include "log.h"
+#include "mtrandom.h"
 #include "universe.h"
 #include "item.h"
 #include "list.h"
-#include "rbtree.h"
+#include "grid.h"
+#include "landmark.h"
 #include "ptrlist.h"
 #include "planet.h"
 #include "planet_type.h"
@@ -41,12 +43,15 @@
 
 #define NEIGHBOUR_CHANCE 5		/* The higher the value, the more neighbours a system will have */
 #define NEIGHBOUR_DISTANCE_LY (25 * TICK_PER_LY)
+#define SYSTEM_GRID_CELL_SIZE (50 * TICK_PER_LY)
 
 struct universe univ;
 
 void universe_free(struct universe *u)
 {
 	ptrlist_free(&u->systems);
+	grid_free(&u->system_grid);
+	landmarks_free(&u->landmarks);
 
 	struct item *i, *_i;
 	list_for_each_entry_safe(i, _i, &u->items, list) {
@@ -77,6 +82,7 @@ void universe_free(struct universe *u)
 		free(st);
 	}
 
+	ptrlist_free(&u->ports);
 	pthread_rwlock_destroy(&u->ports_lock);
 	pthread_rwlock_destroy(&u->systemnames_lock);
 	pthread_rwlock_destroy(&u->planetnames_lock);
@@ -99,6 +105,7 @@ void linksystems(struct system *s1, struct system *s2)
 int makeneighbours(struct system *s1, struct system *s2, unsigned long min, unsigned long max)
 {
 	unsigned long x, y;
+	int r;
 
 	do {
 		if (max > min) {
@@ -109,9 +116,10 @@ int makeneighbours(struct system *s1, struct system *s2, unsigned long min, unsi
 			y = mtrandom_ulong(NEIGHBOUR_DISTANCE_LY) * 2 - NEIGHBOUR_DISTANCE_LY + s1->y;
 		}
 
-	} while (system_move(s2, x, y));
+		r = system_move(s2, x, y);
+	} while (r > 0);
 
-	return 0;
+	return r;
 	/*
 	 * FIXME: Don't place too close to another system,
 	 * 5 ly is probably a good idea considering the map resolution.
@@ -119,85 +127,66 @@ int makeneighbours(struct system *s1, struct system *s2, unsigned long min, unsi
 	 */
 }
 
-static struct system* get_first_system_after_x(const struct rb_root * const root, const long x)
+static unsigned long system_key(const void *system, void *origin)
 {
-	struct system *system;
-	struct rb_node *parent = NULL;
-	struct rb_node *node;
-
-	node = root->rb_node;
-	while (node) {
-		parent = node;
-		system = rb_entry(node, struct system, x_rbtree);
-
-		if (x < system->x)
-			node = node->rb_left;
-		else if (x > system->x)
-			node = node->rb_right;
-		else
-			return rb_entry(node, struct system, x_rbtree);
-	}
-
-	return rb_entry(parent, struct system, x_rbtree);
+	return system_distance_squared(origin, system);
 }
 
-int cmp_system_distances(const void *_system1, const void *_system2, void *_origin)
+/*
+ * Sorts the systems by distance from origin, closest (i.e. origin itself,
+ * if it is in the list) first.
+ */
+void sort_systems_by_distance(struct ptrlist * const systems, const struct system * const origin)
 {
-	const struct system *system1 = _system1;
-	const struct system *system2 = _system2;
-	const struct system *origin = _origin;
-
-	if (system1 == origin)
-		return -1;
-	else if (system2 == origin)
-		return 1;
-	else
-		return (long)system_distance(origin, system1) - (long)system_distance(origin, system2);
+	if (ptrlist_sort_by_key(systems, (void*)origin, system_key))
+		log_printfn(LOG_MAIN, "out of memory when sorting systems, list left unsorted");
 }
 
 unsigned long get_neighbouring_systems(struct ptrlist * const neighbours,
 		const struct system * const origin, const long max_distance)
 {
-	struct system *system;
-	long min_x, max_x;
-	long min_y, max_y;
-	struct rb_node *node;
-	unsigned long neighbour_count = 0;
-
-	min_x = origin->x - max_distance;
-	max_x = origin->x + max_distance;
-	min_y = origin->y - max_distance;
-	max_y = origin->y + max_distance;
-	system = get_first_system_after_x(&univ.x_rbtree, min_x);
-	node = &system->x_rbtree;
-
-	/*
-	 * The extra y-coordinate comparison before the call to
-	 * system_distance() improves performance quite considerably when
-	 * measured (with perf and gcc -O3) as system_distance() is quite slow.
-	 */
-	while (node && rb_entry(node, struct system, x_rbtree)->x <= max_x) {
+	return grid_range(&univ.system_grid, origin->x, origin->y, max_distance, neighbours);
+}
 
-		system = rb_entry(node, struct system, x_rbtree);
+struct nearest_filter {
+	const struct system *origin;
+	int (*filter)(void*, void*);
+	void *data;
+};
 
-		if (system->y >= min_y && system->y <= max_y &&
-			(system_distance(origin, system) < max_distance)) {
+static int filter_nearest(void *system, void *_f)
+{
+	struct nearest_filter *f = _f;
 
-			neighbour_count++;
-			if (neighbours)
-				ptrlist_push(neighbours, system);
-		}
+	if (system == f->origin)
+		return 0;
 
-		node = rb_next(node);
-	}
+	return !f->filter || f->filter(system, f->data);
+}
 
-	return neighbour_count;
+/*
+ * Finds the num systems closest to origin, closest first, not counting
+ * origin itself. If filter is given, only systems it returns non-zero for
+ * are considered.
+ */
+unsigned long get_nearest_systems(struct ptrlist * const nearest,
+		const struct system * const origin, const unsigned long num,
+		int (*filter)(void *system, void *data), void *data)
+{
+	struct nearest_filter f = {
+		.origin = origin,
+		.filter = filter,
+		.data = data,
+	};
+
+	return grid_nearest(&univ.system_grid, origin->x, origin->y, num,
+			filter_nearest, &f, nearest);
 }
 
 unsigned long get_neighbouring_ports(struct ptrlist * const neighbours,
 		struct system *origin, const long max_distance)
 {
-	struct list_head *lh, *li, *lj;
+	unsigned long lh, li, lj;
 	struct planet *planet;
 	struct port *port;
 	struct system *system;
@@ -206,7 +195,7 @@ unsigned long get_neighbouring_ports(struct ptrlist * const neighbours,
 	ptrlist_init(&systems);
 	get_neighbouring_systems(&systems, origin, max_distance);
 	ptrlist_push(&systems, origin);
-	ptrlist_sort(&systems, origin, cmp_system_distances);
+	sort_systems_by_distance(&systems, origin);
 
 	ptrlist_for_each_entry(system, &systems, lh) {
 		ptrlist_for_each_entry(port, &system->ports, li)
@@ -223,71 +212,26 @@ unsigned long get_neighbouring_ports(struct ptrlist * const neighbours,
 	return 0;
 }
 
-static struct system* get_system_at_x(const long x)
-{
-	struct rb_node *node = univ.x_rbtree.rb_node;
-	struct system *system;
-
-	while (node) {
-		system = rb_entry(node, struct system, x_rbtree);
-
-		if (x < system->x)
-			node = node->rb_left;
-		else if (x > system->x)
-			node = node->rb_right;
-		else
-			return rb_entry(node, struct system, x_rbtree);
-	}
-
-	return NULL;
-}
-
-static void insert_system_into_rbtree(struct system * const s)
-{
-	struct rb_node **link = &univ.x_rbtree.rb_node;
-	struct rb_node *parent = NULL;
-	struct system *system;
-
-	while (*link) {
-		parent = *link;
-		system = rb_entry(parent, struct system, x_rbtree);
-
-		if (s->x < system->x)
-			link = &(*link)->rb_left;
-		else if (s->x > system->x)
-			link = &(*link)->rb_right;
-		else
-			bug("System %s already inserted at %ldx%ld",
-					system->name, system->x, system->y);
-	}
-
-	rb_link_node(&s->x_rbtree, parent, link);
-	rb_insert_color(&s->x_rbtree, &univ.x_rbtree);
-}
-
+/*
+ * Returns 1 if there already is a system at (x, y), -1 on error
+ * and 0 on success.
+ */
 int system_move(struct system * const s, const long x, const long y)
 {
-	struct system *prev;
-
-	/*
-	 * All systems need to have unique x coordinates or there will be tree
-	 * collisions. This is the most sane place to do that check.
-	 */
-	if ((prev = get_system_at_x(x)))
+	if (grid_lookup(&univ.system_grid, x, y))
 		return 1;
 
 	/*
 	 * This function is also used to set a position for freshly created
-	 * systems which don't exist in the tree yet.
+	 * systems which don't exist in the grid yet, so this might fail.
 	 */
-	prev = get_system_at_x(s->x);
-	if (prev)
-		rb_erase(&prev->x_rbtree, &univ.x_rbtree);
+	grid_remove(&univ.system_grid, s->x, s->y, s);
 
 	s->x = x;
 	s->y = y;
 
-	insert_system_into_rbtree(s);
+	if (grid_insert(&univ.system_grid, x, y, s))
+		return -1;
 
 	return 0;
 }
@@ -296,33 +240,39 @@ void universe_init(struct universe *u)
 {
 	time(&u->created);
 	u->id = 0;
+	u->journal_seq = 0;
 	u->name = NULL;
 	ptrlist_init(&u->systems);
+	grid_init(&u->system_grid, SYSTEM_GRID_CELL_SIZE);
+	landmarks_init(&u->landmarks);
 	INIT_LIST_HEAD(&u->items);
-	INIT_LIST_HEAD(&u->ports);
+	ptrlist_init(&u->ports);
 	pthread_rwlock_init(&u->ports_lock, NULL);
 	INIT_LIST_HEAD(&u->port_types);
-	INIT_LIST_HEAD(&u->port_type_names);
+	st_init(&u->port_type_names);
 	INIT_LIST_HEAD(&u->planet_types);
 	INIT_LIST_HEAD(&u->ship_types);
-	INIT_LIST_HEAD(&u->ship_type_names);
-	INIT_LIST_HEAD(&u->item_names);
-	INIT_LIST_HEAD(&u->systemnames);
+	st_init(&u->ship_type_names);
+	st_init(&u->item_names);
+	st_init(&u->systemnames);
 	pthread_rwlock_init(&u->systemnames_lock, NULL);
-	INIT_LIST_HEAD(&u->planetnames);
+	st_init(&u->planetnames);
 	pthread_rwlock_init(&u->planetnames_lock, NULL);
-	INIT_LIST_HEAD(&u->portnames);
+	st_init(&u->portnames);
 	pthread_rwlock_init(&u->portnames_lock, NULL);
 	INIT_LIST_HEAD(&u->civs);
 }
 
-int universe_genesis(struct universe *univ)
+int universe_genesis(struct universe *univ, const unsigned int num_threads)
 {
+	/* The same seed creates the same universe */
+	univ->id = mtrandom_seed();
+
 	/*
 	 * 1. Decide number of constellations in universe.
 	 * 2. For each constellation, create a number of systems, grouping them together.
 	 */
-	if (spawn_constellations(univ))
+	if (spawn_constellations(univ, num_threads))
 		return -1;
 
 	/*
@@ -331,5 +281,12 @@ int universe_genesis(struct universe *univ)
 	 */
 	civ_spawncivs(univ);
 
+	/*
+	 * 5. Prepare for finding routes along the links
+	 */
+	printf("Picking landmarks for route planning\n");
+	if (landmarks_build(&univ->landmarks, LANDMARKS_NUM))
+		return -1;
+
 	return 0;
 }
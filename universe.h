@@ -1,33 +1,38 @@
 #ifndef _HAS_UNIVERSE_H
 #define _HAS_UNIVERSE_H
 
+#include <stdint.h>
+#include "landmark.h"
 #include "list.h"
 #include "names.h"
 #include "ptrlist.h"
-#include "rbtree.h"
+#include "stringtree.h"
+#include "grid.h"
 #include "system.h"
 
 struct universe {
-	size_t id;			/* ID of the universe (or the game?) */
+	uint64_t id;			/* The seed it was created from */
 	char* name;			/* The name of the universe (or the game?) */
 	time_t created;			/* When the universe was created */
 	unsigned long inhabited_systems;
+	uint64_t journal_seq;		/* Last journal record included, see journal.c */
 	struct ptrlist systems;
-	struct rb_root x_rbtree;
+	struct grid system_grid;
+	struct landmarks landmarks;	/* Route estimates, see landmark.c */
 	struct list_head items;
-	struct list_head ports;
+	struct ptrlist ports;
 	pthread_rwlock_t ports_lock;
 	struct list_head port_types;
-	struct list_head port_type_names;
+	struct st_node port_type_names;
 	struct list_head planet_types;
 	struct list_head ship_types;
-	struct list_head ship_type_names;
-	struct list_head item_names;
-	struct list_head systemnames;
+	struct st_node ship_type_names;
+	struct st_node item_names;
+	struct st_node systemnames;
 	pthread_rwlock_t systemnames_lock;
-	struct list_head planetnames;
+	struct st_node planetnames;
 	pthread_rwlock_t planetnames_lock;
-	struct list_head portnames;
+	struct st_node portnames;
 	pthread_rwlock_t portnames_lock;
 	struct list_head civs;
 	struct list_head list;
@@ -41,11 +46,14 @@ extern struct universe univ;
 void universe_free(struct universe *u);
 struct universe* universe_create();
 void universe_init(struct universe *u);
-int universe_genesis(struct universe *univ);
+int universe_genesis(struct universe *univ, const unsigned int num_threads);
 
-int cmp_system_distances(const void *_system1, const void *_system2, void *_origin);
+void sort_systems_by_distance(struct ptrlist * const systems, const struct system * const origin);
 unsigned long get_neighbouring_systems(struct ptrlist * const neighbours,
 		const struct system * const origin, const long max_distance);
+unsigned long get_nearest_systems(struct ptrlist * const nearest,
+		const struct system * const origin, const unsigned long num,
+		int (*filter)(void *system, void *data), void *data);
 unsigned long get_neighbouring_ports(struct ptrlist * const neighbours,
 		struct system *origin, const long max_distance);
 